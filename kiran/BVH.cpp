@@ -0,0 +1,592 @@
+//==================================================================
+// BVH.cpp   Bounding volume hierarchy over the objects in a scene.
+//==================================================================
+
+#include "BVH.hpp"
+#include "RenderStats.hpp"
+#include <algorithm>
+
+#define BVH_LEAF_SIZE   2     // max objects in a leaf
+#define BVH_STACK_SIZE  64    // max depth of traversal stack
+#define BVH_BOX_PADDING 1e-6  // slack around object bounds
+
+//==================================================================
+// struct _bvh_item  An object and its bounds used while building
+//==================================================================
+typedef struct _bvh_item
+{
+ Object *object;
+ bbox_t box;
+ vector3d_t center;
+}bvh_item_t;
+
+
+//==================================================================
+// class bvh_item_less  Orders build items along one axis
+//==================================================================
+class bvh_item_less
+{
+ public:
+  bvh_item_less(int axis) : d_axis(axis) {}
+  bool operator()(const bvh_item_t &a, const bvh_item_t &b) const
+  {
+   if(d_axis == 0) return a.center.x < b.center.x;
+   if(d_axis == 1) return a.center.y < b.center.y;
+   return a.center.z < b.center.z;
+  }
+ private:
+  int d_axis;
+};
+
+
+//==================================================================
+// BVH::BVH
+//==================================================================
+BVH::BVH()
+{
+ d_nodes.clear();
+ d_objects.clear();
+ d_boxes.clear();
+ d_unbounded.clear();
+}
+
+
+//==================================================================
+// BVH::build
+//==================================================================
+void BVH::build(const vector<Object *> &objectList)
+{
+ vector<bvh_item_t> items;
+ bvh_item_t item;
+ vector3d_t pad(BVH_BOX_PADDING, BVH_BOX_PADDING, BVH_BOX_PADDING);
+
+ d_nodes.clear();
+ d_objects.clear();
+ d_boxes.clear();
+ d_unbounded.clear();
+
+ for(unsigned int i = 0; i < objectList.size(); i++)
+ {
+  KIRAN_STAT(render_stats_class(typeid(*objectList[i])));
+  if( !objectList[i]->getBoundingBox(item.box) )
+  {
+   d_unbounded.push_back(objectList[i]);
+   continue;
+  }
+  item.object = objectList[i];
+  item.box.lo = item.box.lo - pad;
+  item.box.hi = item.box.hi + pad;
+  item.center = bbox_center(item.box);
+  items.push_back(item);
+ }
+
+ if(items.size() == 0)
+  return;
+
+ // The tree is built over the item list, which gets reordered so
+ // that each leaf refers to a contiguous range of objects.
+ d_objects.resize(items.size());
+ d_boxes.resize(items.size());
+ for(unsigned int i = 0; i < items.size(); i++)
+ {
+  d_objects[i] = items[i].object;
+  d_boxes[i] = items[i].box;
+ }
+
+ d_nodes.reserve(2 * items.size());
+ d_nodes.push_back(bvh_node_t());
+ buildNode(0, 0, items.size());
+}
+
+
+//==================================================================
+// BVH::buildNode
+//==================================================================
+int BVH::buildNode(int node, int start, int end)
+{
+ bbox_t box, centers;
+ vector3d_t extent;
+ int axis, mid, child;
+
+ for(int i = start; i < end; i++)
+ {
+  bbox_extend(box, d_boxes[i]);
+  bbox_extend(centers, bbox_center(d_boxes[i]));
+ }
+ d_nodes[node].box = box;
+
+ if(end - start <= BVH_LEAF_SIZE)
+ {
+  d_nodes[node].first = start;
+  d_nodes[node].count = end - start;
+  return node;
+ }
+
+ // split at the median object center along the longest axis
+ extent = centers.hi - centers.lo;
+ axis = 2;
+ if(extent.x > extent.y && extent.x > extent.z)
+  axis = 0;
+ else if(extent.y > extent.z)
+  axis = 1;
+
+ vector<bvh_item_t> items(end - start);
+ for(int i = start; i < end; i++)
+ {
+  items[i - start].object = d_objects[i];
+  items[i - start].box = d_boxes[i];
+  items[i - start].center = bbox_center(d_boxes[i]);
+ }
+ mid = (end - start)/2;
+ nth_element(items.begin(), items.begin() + mid, items.end(),
+             bvh_item_less(axis));
+ for(int i = start; i < end; i++)
+ {
+  d_objects[i] = items[i - start].object;
+  d_boxes[i] = items[i - start].box;
+ }
+
+ child = d_nodes.size();
+ d_nodes[node].first = child;
+ d_nodes[node].count = 0;
+ d_nodes.push_back(bvh_node_t());
+ d_nodes.push_back(bvh_node_t());
+ buildNode(child, start, start + mid);
+ buildNode(child + 1, start + mid, end);
+ return node;
+}
+
+
+//==================================================================
+// BVH::intersectBox - slab test, returns entry distance in tnear
+//==================================================================
+bool BVH::intersectBox(const bbox_t &box, const vector3d_t &orig,
+                       const vector3d_t &invDir, double tmax,
+                       double &tnear) const
+{
+ double t1, t2, tmp, tfar;
+ tnear = 0;
+ tfar = tmax;
+
+ t1 = (box.lo.x - orig.x) * invDir.x;
+ t2 = (box.hi.x - orig.x) * invDir.x;
+ if(t1 > t2) { tmp = t1; t1 = t2; t2 = tmp; }
+ if(t1 > tnear) tnear = t1;
+ if(t2 < tfar) tfar = t2;
+ if(tnear > tfar) return false;
+
+ t1 = (box.lo.y - orig.y) * invDir.y;
+ t2 = (box.hi.y - orig.y) * invDir.y;
+ if(t1 > t2) { tmp = t1; t1 = t2; t2 = tmp; }
+ if(t1 > tnear) tnear = t1;
+ if(t2 < tfar) tfar = t2;
+ if(tnear > tfar) return false;
+
+ t1 = (box.lo.z - orig.z) * invDir.z;
+ t2 = (box.hi.z - orig.z) * invDir.z;
+ if(t1 > t2) { tmp = t1; t1 = t2; t2 = tmp; }
+ if(t1 > tnear) tnear = t1;
+ if(t2 < tfar) tfar = t2;
+ if(tnear > tfar) return false;
+
+ return true;
+}
+
+
+//==================================================================
+// BVH::testObject - same acceptance rules as the linear search
+//==================================================================
+bool BVH::testObject(const Object *object, const ray_t &ray,
+                     double tooClose, double tooFar, double &closest,
+                     intercept_t &visibleIntercept) const
+{
+ intercept_t intercept;
+ double distance;
+
+ render_stats().intersectionTests++;
+ intercept = object->getIntercept(ray);
+ KIRAN_STAT(int slot = render_stats_class(typeid(*object));
+            render_stats().classTests[slot]++;
+            render_stats().classHits[slot] += (intercept.object != NULL));
+
+ // did we hit something
+ if( intercept.object == NULL )
+  return false;
+
+ // check if intercept is too near or too far
+ distance = norm(intercept.coord - ray.orig);
+ if( (distance < tooClose) || (distance > tooFar) )
+  return false;
+
+ // check if smallest intercept yet
+ if( visibleIntercept.object != NULL && distance >= closest )
+  return false;
+
+ closest = distance;
+ visibleIntercept = intercept;
+ return true;
+}
+
+
+//==================================================================
+// BVH::getIntercept
+//==================================================================
+intercept_t BVH::getIntercept(const ray_t &ray, double tooClose,
+                              double tooFar) const
+{
+ intercept_t visibleIntercept;
+ double closest = tooFar;
+ double dirLen, tnear;
+ vector3d_t invDir;
+ int stack[BVH_STACK_SIZE];
+ int top = 0;
+ const bvh_node_t *node;
+
+ visibleIntercept.coord = vector3d_t(tooFar,tooFar,tooFar);
+ visibleIntercept.object = NULL;
+
+ for(unsigned int o = 0; o < d_unbounded.size(); o++)
+  testObject(d_unbounded[o], ray, tooClose, tooFar, closest,
+             visibleIntercept);
+
+ if(d_nodes.size() == 0)
+  return visibleIntercept;
+
+ // box tests are done in ray parameter units, distances in world units
+ dirLen = norm(ray.dir);
+ invDir.x = 1.0/ray.dir.x;
+ invDir.y = 1.0/ray.dir.y;
+ invDir.z = 1.0/ray.dir.z;
+
+ stack[top++] = 0;
+ while(top > 0)
+ {
+  node = &d_nodes[stack[--top]];
+  if( !intersectBox(node->box, ray.orig, invDir, closest/dirLen, tnear) )
+   continue;
+
+  if(node->count > 0)
+  {
+   for(int i = node->first; i < node->first + node->count; i++)
+    testObject(d_objects[i], ray, tooClose, tooFar, closest,
+               visibleIntercept);
+   continue;
+  }
+
+  // visit the nearer child first so that the far one is more
+  // likely to be culled by the closest hit so far.
+  double tl, tr;
+  bool hl, hr;
+  hl = intersectBox(d_nodes[node->first].box, ray.orig, invDir,
+                    closest/dirLen, tl);
+  hr = intersectBox(d_nodes[node->first + 1].box, ray.orig, invDir,
+                    closest/dirLen, tr);
+  if(hl && hr)
+  {
+   if(tl < tr)
+   {
+    stack[top++] = node->first + 1;
+    stack[top++] = node->first;
+   }
+   else
+   {
+    stack[top++] = node->first;
+    stack[top++] = node->first + 1;
+   }
+  }
+  else if(hl)
+   stack[top++] = node->first;
+  else if(hr)
+   stack[top++] = node->first + 1;
+ }
+ return visibleIntercept;
+}
+
+
+//==================================================================
+// BVH::occludeObject - true if the object is an opaque blocker
+//==================================================================
+bool BVH::occludeObject(const Object *object, const ray_t &ray,
+                        double tooClose, double tooFar,
+                        double &transmittance) const
+{
+ double kt;
+
+ render_stats().intersectionTests++;
+ KIRAN_STAT(int slot = render_stats_class(typeid(*object));
+            render_stats().classTests[slot]++);
+ if( !object->isOccluding(ray, tooClose, tooFar) )
+  return false;
+ KIRAN_STAT(render_stats().classHits[slot]++);
+
+ kt = object->getTransmittivity();
+ if(kt <= 0)
+ {
+  transmittance = 0;
+  return true;
+ }
+ transmittance *= kt;
+ return false;
+}
+
+
+//==================================================================
+// BVH::isOccluded
+//==================================================================
+bool BVH::isOccluded(const ray_t &ray, double tooClose, double tooFar,
+                     double &transmittance) const
+{
+ double tmax, tnear;
+ vector3d_t invDir;
+ int stack[BVH_STACK_SIZE];
+ int top = 0;
+ const bvh_node_t *node;
+
+ transmittance = 1;
+
+ for(unsigned int o = 0; o < d_unbounded.size(); o++)
+  if( occludeObject(d_unbounded[o], ray, tooClose, tooFar, transmittance) )
+   return true;
+
+ if(d_nodes.size() == 0)
+  return false;
+
+ // any hit will do, so the order of traversal does not matter
+ tmax = tooFar/norm(ray.dir);
+ invDir.x = 1.0/ray.dir.x;
+ invDir.y = 1.0/ray.dir.y;
+ invDir.z = 1.0/ray.dir.z;
+
+ stack[top++] = 0;
+ while(top > 0)
+ {
+  node = &d_nodes[stack[--top]];
+  if( !intersectBox(node->box, ray.orig, invDir, tmax, tnear) )
+   continue;
+
+  if(node->count > 0)
+  {
+   for(int i = node->first; i < node->first + node->count; i++)
+    if( occludeObject(d_objects[i], ray, tooClose, tooFar, transmittance) )
+     return true;
+   continue;
+  }
+  stack[top++] = node->first + 1;
+  stack[top++] = node->first;
+ }
+ return false;
+}
+
+
+//==================================================================
+// BVH::intersectPacketBox - true if any ray of the packet hits box
+//==================================================================
+bool BVH::intersectPacketBox(const bbox_t &box, const ray_packet_t &packet,
+                             const real_t *invDx, const real_t *invDy,
+                             const real_t *invDz, const real_t *tmax) const
+{
+ real_t t1, t2, tnear, tfar;
+ int hits = 0;
+
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  t1 = (box.lo.x - packet.ox[i]) * invDx[i];
+  t2 = (box.hi.x - packet.ox[i]) * invDx[i];
+  tnear = (t1 < t2) ? t1 : t2;
+  tfar = (t1 < t2) ? t2 : t1;
+  tnear = (tnear > 0) ? tnear : 0;
+  tfar = (tfar < tmax[i]) ? tfar : tmax[i];
+
+  t1 = (box.lo.y - packet.oy[i]) * invDy[i];
+  t2 = (box.hi.y - packet.oy[i]) * invDy[i];
+  tnear = (((t1 < t2) ? t1 : t2) > tnear) ? ((t1 < t2) ? t1 : t2) : tnear;
+  tfar = (((t1 < t2) ? t2 : t1) < tfar) ? ((t1 < t2) ? t2 : t1) : tfar;
+
+  t1 = (box.lo.z - packet.oz[i]) * invDz[i];
+  t2 = (box.hi.z - packet.oz[i]) * invDz[i];
+  tnear = (((t1 < t2) ? t1 : t2) > tnear) ? ((t1 < t2) ? t1 : t2) : tnear;
+  tfar = (((t1 < t2) ? t2 : t1) < tfar) ? ((t1 < t2) ? t2 : t1) : tfar;
+
+  hits += (tnear <= tfar);
+ }
+ return hits > 0;
+}
+
+
+//==================================================================
+// BVH::testPacketObject - testObject for each ray in a packet
+//==================================================================
+void BVH::testPacketObject(Object *object, const ray_packet_t &packet,
+                           double tooClose, double tooFar, Object **objects,
+                           real_t *distance) const
+{
+ real_t d[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+
+ render_stats().intersectionTests += packet.size;
+ object->getPacketDistances(packet, d);
+ KIRAN_STAT(int slot = render_stats_class(typeid(*object));
+            render_stats().classTests[slot] += packet.size;
+            for(int i = 0; i < packet.size; i++)
+             render_stats().classHits[slot] += (d[i] >= 0));
+ for(int i = 0; i < packet.size; i++)
+ {
+  if( (d[i] < tooClose) || (d[i] > tooFar) )
+   continue;
+  if( objects[i] != NULL && d[i] >= distance[i] )
+   continue;
+  objects[i] = object;
+  distance[i] = d[i];
+ }
+}
+
+
+//==================================================================
+// BVH::getPacketIntercepts
+//==================================================================
+void BVH::getPacketIntercepts(const ray_packet_t &packet, double tooClose,
+                              double tooFar, Object **objects,
+                              real_t *distance) const
+{
+ real_t dirLen[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t tmax[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDx[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDy[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDz[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ int stack[BVH_STACK_SIZE];
+ int top = 0;
+ const bvh_node_t *node;
+
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  objects[i] = NULL;
+  distance[i] = tooFar;
+  dirLen[i] = sqrt(packet.dx[i]*packet.dx[i] + packet.dy[i]*packet.dy[i] +
+                   packet.dz[i]*packet.dz[i]);
+  invDx[i] = 1.0/packet.dx[i];
+  invDy[i] = 1.0/packet.dy[i];
+  invDz[i] = 1.0/packet.dz[i];
+ }
+
+ for(unsigned int o = 0; o < d_unbounded.size(); o++)
+  testPacketObject(d_unbounded[o], packet, tooClose, tooFar, objects,
+                   distance);
+
+ if(d_nodes.size() == 0)
+  return;
+
+ // rays in a packet start close together and point the same way,
+ // so the nodes are visited in a fixed order.
+ stack[top++] = 0;
+ while(top > 0)
+ {
+  node = &d_nodes[stack[--top]];
+  for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+   tmax[i] = (i < packet.size) ? distance[i]/dirLen[i] : -1;
+  if( !intersectPacketBox(node->box, packet, invDx, invDy, invDz, tmax) )
+   continue;
+
+  if(node->count == 0)
+  {
+   stack[top++] = node->first + 1;
+   stack[top++] = node->first;
+   continue;
+  }
+
+  for(int o = node->first; o < node->first + node->count; o++)
+   testPacketObject(d_objects[o], packet, tooClose, tooFar, objects,
+                    distance);
+ }
+}
+
+
+//==================================================================
+// BVH::occludePacketObject - returns number of rays newly blocked
+//==================================================================
+int BVH::occludePacketObject(const Object *object,
+                             const ray_packet_t &packet, double tooClose,
+                             const real_t *tooFar, real_t *tmax,
+                             double *transmittance, bool *blocked) const
+{
+ real_t d[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ double kt;
+ int numBlocked = 0;
+
+ render_stats().intersectionTests += packet.size;
+ object->getPacketDistances(packet, d);
+ KIRAN_STAT(int slot = render_stats_class(typeid(*object));
+            render_stats().classTests[slot] += packet.size;
+            for(int i = 0; i < packet.size; i++)
+             render_stats().classHits[slot] += (d[i] >= 0));
+ kt = object->getTransmittivity();
+ for(int i = 0; i < packet.size; i++)
+ {
+  if( blocked[i] || d[i] < tooClose || d[i] > tooFar[i] )
+   continue;
+  if(kt <= 0)
+  {
+   // a blocked ray drops out of the box tests
+   transmittance[i] = 0;
+   blocked[i] = true;
+   tmax[i] = -1;
+   numBlocked++;
+  }
+  else
+   transmittance[i] *= kt;
+ }
+ return numBlocked;
+}
+
+
+//==================================================================
+// BVH::getPacketOcclusion
+//==================================================================
+void BVH::getPacketOcclusion(const ray_packet_t &packet, double tooClose,
+                             const real_t *tooFar, double *transmittance,
+                             bool *blocked) const
+{
+ real_t tmax[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDx[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDy[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t invDz[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ int stack[BVH_STACK_SIZE];
+ int top = 0;
+ int numOpen = packet.size;
+ const bvh_node_t *node;
+
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  transmittance[i] = 1;
+  blocked[i] = false;
+  tmax[i] = (i < packet.size) ? tooFar[i] : -1;
+  tmax[i] /= sqrt(packet.dx[i]*packet.dx[i] + packet.dy[i]*packet.dy[i] +
+                  packet.dz[i]*packet.dz[i]);
+  invDx[i] = 1.0/packet.dx[i];
+  invDy[i] = 1.0/packet.dy[i];
+  invDz[i] = 1.0/packet.dz[i];
+ }
+
+ for(unsigned int o = 0; o < d_unbounded.size() && numOpen > 0; o++)
+  numOpen -= occludePacketObject(d_unbounded[o], packet, tooClose, tooFar,
+                                 tmax, transmittance, blocked);
+
+ if(d_nodes.size() == 0)
+  return;
+
+ stack[top++] = 0;
+ while(top > 0 && numOpen > 0)
+ {
+  node = &d_nodes[stack[--top]];
+  if( !intersectPacketBox(node->box, packet, invDx, invDy, invDz, tmax) )
+   continue;
+
+  if(node->count > 0)
+  {
+   for(int o = node->first; o < node->first + node->count; o++)
+    numOpen -= occludePacketObject(d_objects[o], packet, tooClose, tooFar,
+                                   tmax, transmittance, blocked);
+   continue;
+  }
+  stack[top++] = node->first + 1;
+  stack[top++] = node->first;
+ }
+}
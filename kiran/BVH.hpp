@@ -0,0 +1,112 @@
+//==================================================================
+// BVH.hpp   Bounding volume hierarchy over the objects in a scene.
+//           Bounded objects are sorted into a binary tree of axis
+//           aligned boxes. Unbounded objects (infinite planes) are
+//           kept in a flat list and tested against every ray.
+//==================================================================
+
+#ifndef _BVH_HPP_INCLUDED
+#define _BVH_HPP_INCLUDED
+
+#include <vector>
+#include "data_types.hpp"
+#include "objects.hpp"
+
+//==================================================================
+// struct _bvh_node  A node in the hierarchy. Children of an interior
+//                   node are stored next to each other.
+//==================================================================
+typedef struct _bvh_node
+{
+ bbox_t box;  // bounds of everything below this node
+ int first;   // index of first child (interior) or first object (leaf)
+ int count;   // number of objects in a leaf, 0 for interior nodes
+}bvh_node_t;
+
+
+//==================================================================
+// class BVH
+//==================================================================
+class BVH
+{
+ public:
+  BVH();
+   // The default constructor. Creates an empty hierarchy.
+
+  ~BVH() {}
+   // The destructor. Does not delete the objects.
+
+  void build(const vector<Object *> &objectList);
+   // Build the hierarchy. Call once after the scene is read.
+   //  objectList  All objects in the scene.
+
+  intercept_t getIntercept(const ray_t &ray, double tooClose,
+                           double tooFar) const;
+   //  return    The closest intercept of the ray with an object
+   //            at a distance in the range [tooClose, tooFar] from
+   //            the ray origin. intercept.object is NULL if
+   //            nothing was hit.
+
+  bool isOccluded(const ray_t &ray, double tooClose, double tooFar,
+                  double &transmittance) const;
+   // Any-hit query for shadow rays. Stops at the first opaque 
+   // object between tooClose and tooFar.
+   //  transmittance  Set to the product of the transmittivities of 
+   //                 the transparent objects along the ray, or 0 
+   //                 if the ray is blocked.
+   //  return         true if an opaque object blocks the ray.
+
+  void getPacketIntercepts(const ray_packet_t &packet, double tooClose,
+                           double tooFar, Object **objects,
+                           real_t *distance) const;
+   // Closest hit query for a packet of rays. A node is entered when 
+   // any ray in the packet hits its box.
+   //  objects   Array of KIRAN_PACKET_SIZE, set to the closest 
+   //            object hit by each ray, or NULL.
+   //  distance  Array of KIRAN_PACKET_SIZE, set to the distance to 
+   //            that object. Call getIntercept on the object for 
+   //            the full intercept.
+
+  void getPacketOcclusion(const ray_packet_t &packet, double tooClose,
+                          const real_t *tooFar, double *transmittance,
+                          bool *blocked) const;
+   // Any-hit query for a packet of shadow rays, see isOccluded.
+   //  tooFar         Distance to the light along each ray.
+   //  transmittance  Set per ray as in isOccluded.
+   //  blocked        Set to true for rays blocked by opaque objects.
+
+  int getNumBoundedObjects() const {return d_objects.size();}
+   //  return  Number of objects in the tree.
+
+  int getNumUnboundedObjects() const {return d_unbounded.size();}
+   //  return  Number of objects outside the tree.
+
+ private:
+  int buildNode(int node, int start, int end);
+  bool intersectBox(const bbox_t &box, const vector3d_t &orig,
+                    const vector3d_t &invDir, double tmax,
+                    double &tnear) const;
+  bool testObject(const Object *object, const ray_t &ray,
+                  double tooClose, double tooFar, double &closest,
+                  intercept_t &visibleIntercept) const;
+  bool occludeObject(const Object *object, const ray_t &ray,
+                     double tooClose, double tooFar,
+                     double &transmittance) const;
+  bool intersectPacketBox(const bbox_t &box, const ray_packet_t &packet,
+                          const real_t *invDx, const real_t *invDy,
+                          const real_t *invDz, const real_t *tmax) const;
+  void testPacketObject(Object *object, const ray_packet_t &packet,
+                        double tooClose, double tooFar, Object **objects,
+                        real_t *distance) const;
+  int occludePacketObject(const Object *object, const ray_packet_t &packet,
+                          double tooClose, const real_t *tooFar,
+                          real_t *tmax, double *transmittance,
+                          bool *blocked) const;
+
+  vector<bvh_node_t> d_nodes;
+  vector<Object *> d_objects;    // bounded objects, in leaf order
+  vector<bbox_t> d_boxes;        // bounds of d_objects
+  vector<Object *> d_unbounded;  // objects that are not in the tree
+};
+
+#endif // _BVH_HPP_INCLUDED
@@ -81,19 +81,20 @@ void Camera::setPosition(vector3d_t pos, vector3d_t lookAt, vector3d_t up)
 }
 
 
-ray_list_t *Camera::getRays(double u, double v) const
+int Camera::getRays(double u, double v, vector<ray_t> &rays) const
 {
- ray_list_t *rayList = NULL, *tmpPtr = NULL;
  double l;
  vector3d_t vx, vy, vz, centerRay;
  vector3d_t fPoint;
  vector3d_t cvec[8];
+ ray_t ray;
  
+ rays.clear();
  if(u > d_width+0.5 || u < -0.5 || v > d_height+0.5 || v < -0.5)
  {
   cerr << "Camera: ERROR pixel index (" << u << ", " << v << ") out of range." 
        << endl;
-  return NULL;
+  return 0;
  }
  
  vz = d_focalLength * d_look;
@@ -116,27 +117,27 @@ ray_list_t *Camera::getRays(double u, double v) const
  cvec[7] = -1.0 * cvec[3]; 
 
  l = d_focalLength/90.0; // only center ray at f-stop of 45+
- rayList = new ray_list_t;
- tmpPtr = rayList;
+
+ // every ray is a cone as wide as one pixel seen through the lens
+ ray.width = 0;
+ ray.spread = d_ku/d_focalLength;
 
  // generate rays from lens surface
  for(double j = l; j < d_lensRadius; j += l)
  {
   for(int i = 0; i < 8; i++)
   {
-   tmpPtr->ray.orig = d_pos + (cvec[i] * j);
-   tmpPtr->ray.dir = fPoint - tmpPtr->ray.orig;
-   tmpPtr->ray.dir = normalize(tmpPtr->ray.dir);
-   tmpPtr->nxt = new ray_list_t;
-   tmpPtr = tmpPtr->nxt;
+   ray.orig = d_pos + (cvec[i] * j);
+   ray.dir = fPoint - ray.orig;
+   ray.dir = normalize(ray.dir);
+   rays.push_back(ray);
   }
  }
 
- tmpPtr->ray.orig = d_pos;
- tmpPtr->ray.dir = fPoint - tmpPtr->ray.orig;
- tmpPtr->ray.dir = normalize(tmpPtr->ray.dir);
+ ray.orig = d_pos;
+ ray.dir = fPoint - ray.orig;
+ ray.dir = normalize(ray.dir);
+ rays.push_back(ray);
  
- return rayList;
+ return rays.size();
 }
-
-
@@ -54,9 +54,12 @@ class Camera
   double getFarClippingDistance() const;
    // Farthest distance visible to the camera.
    
-  ray_list_t *getRays(double u, double v) const; 
-   //  return  A bunch of rays from camera for the pixel 
-   //          location (u,v). 
+  int getRays(double u, double v, vector<ray_t> &rays) const; 
+   // Generate a bunch of rays from camera for the pixel location
+   // (u,v). Reuse the same vector from one call to the next so that
+   // no memory is allocated once it has grown large enough.
+   //  rays    Cleared, then filled with the rays.
+   //  return  Number of rays generated.
 
  private:
   double d_focalLength;
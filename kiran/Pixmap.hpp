@@ -12,27 +12,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <iostream>
+#include "vecmath.hpp"
 
 using namespace std;
 
 //==================================================================
-// struct _rgb  A simple structure to represent colors.
+// Colors in the precision chosen in vecmath.hpp
 //==================================================================
-typedef struct _rgb
-{
- _rgb(double R = 0, double G = 0, double B = 0) : r(R), g(G), b(B) {};
- double r;
- double g;
- double b;
-}rgb_t;
-
-
-//==================================================================
-// Operators for _rgb
-//==================================================================
-rgb_t operator+(const rgb_t &c1, const rgb_t &c2);
-rgb_t operator*(const double &scalar, const rgb_t &c);
-rgb_t operator*(const rgb_t &c, const double &scalar);
+typedef _rgb<real_t> rgb_t;
 
 
 //==================================================================
@@ -73,6 +60,11 @@ class Pixmap
   // ========== END OF INTERFACE ==========
   
  private:
+  static int readHeaderValue(FILE *source, int &value);
+   // Reads a number of the PPM header, skipping white space and 
+   // comments before it and one white space character after it.
+   //  return  0 on success, -1 if there is no number
+
   int d_width;
   int d_height;
   fileType_t d_fileType;
@@ -0,0 +1,187 @@
+//==================================================================
+// RenderStats.cpp  Counters for measuring where the render time 
+//                  goes.
+//==================================================================
+
+#include "RenderStats.hpp"
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <string>
+
+__thread render_stats_t render_thread_stats;
+
+static const type_info *s_classTypes[RENDER_STATS_MAX_CLASSES];
+static int s_numClasses = 0;
+static int s_lastPercent = -1;
+
+//==================================================================
+// render_stats_add
+//==================================================================
+void render_stats_add(render_stats_t &total, const render_stats_t &stats)
+{
+ total.primaryRays += stats.primaryRays;
+ total.secondaryRays += stats.secondaryRays;
+ total.shadowRays += stats.shadowRays;
+ total.intersectionTests += stats.intersectionTests;
+ total.interceptQueries += stats.interceptQueries;
+ total.packetQueries += stats.packetQueries;
+ for(int i = 0; i < RENDER_STATS_MAX_CLASSES; i++)
+ {
+  total.classTests[i] += stats.classTests[i];
+  total.classHits[i] += stats.classHits[i];
+ }
+ for(int i = 0; i < RENDER_STATS_MAX_DEPTH; i++)
+  total.depthCount[i] += stats.depthCount[i];
+ total.bumpLookups += stats.bumpLookups;
+ total.interceptTime += stats.interceptTime;
+ total.lightTime += stats.lightTime;
+}
+
+
+//==================================================================
+// render_stats_rays
+//==================================================================
+unsigned long render_stats_rays(const render_stats_t &stats)
+{
+ return stats.primaryRays + stats.secondaryRays + stats.shadowRays;
+}
+
+
+//==================================================================
+// render_stats_time
+//==================================================================
+double render_stats_time()
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//==================================================================
+// render_stats_class
+//==================================================================
+int render_stats_class(const type_info &type)
+{
+ for(int i = 0; i < s_numClasses; i++)
+  if(*s_classTypes[i] == type)
+   return i;
+ if(s_numClasses == RENDER_STATS_MAX_CLASSES)
+  return RENDER_STATS_MAX_CLASSES - 1;
+ s_classTypes[s_numClasses] = &type;
+ return s_numClasses++;
+}
+
+
+#ifdef KIRAN_STATS
+//==================================================================
+// render_stats_class_name - demangled name of a registered class
+//==================================================================
+static string render_stats_class_name(int slot)
+{
+ string name;
+ char *demangled;
+ int status;
+
+ demangled = abi::__cxa_demangle(s_classTypes[slot]->name(), NULL, NULL, 
+                                 &status);
+ name = (status == 0) ? demangled : s_classTypes[slot]->name();
+ free(demangled);
+ return name;
+}
+#endif
+
+
+//==================================================================
+// render_stats_print
+//==================================================================
+void render_stats_print(ostream &out, const render_stats_t &stats)
+{
+ unsigned long numRays = render_stats_rays(stats);
+
+ out << "Load time    : " << stats.loadTime << " s" << endl;
+ out << "Build time   : " << stats.buildTime << " s" << endl;
+ out << "Render time  : " << stats.renderTime << " s" << endl;
+ out << "Write time   : " << stats.writeTime << " s" << endl;
+ out << "Rays         : " << numRays << " (" << stats.primaryRays 
+     << " primary, " << stats.secondaryRays << " secondary, " 
+     << stats.shadowRays << " shadow)" << endl;
+ if(stats.renderTime > 0)
+  out << "Rays/sec     : " << (long)(numRays/stats.renderTime) << endl;
+ out << "Tests        : " << stats.intersectionTests;
+ if(numRays)
+  out << " (" << (double)stats.intersectionTests/numRays << " per ray)";
+ out << endl;
+
+#ifdef KIRAN_STATS
+ out << "Queries      : " << stats.interceptQueries << " closest hit, " 
+     << stats.packetQueries << " packet" << endl;
+ out << "Time         : " << stats.interceptTime << " s closest hit, "
+     << stats.lightTime << " s lighting (all threads)" << endl;
+ out << "Bump lookups : " << stats.bumpLookups << endl;
+ for(int i = 0; i < s_numClasses; i++)
+ {
+  out << "  " << render_stats_class_name(i) << ": " << stats.classTests[i]
+      << " tests, " << stats.classHits[i] << " hits";
+  if(stats.classTests[i])
+   out << " (" << 100.0 * stats.classHits[i]/stats.classTests[i] << " %)";
+  out << endl;
+ }
+ out << "Depth        :";
+ for(int i = 0; i < RENDER_STATS_MAX_DEPTH; i++)
+  if(stats.depthCount[i])
+   out << " " << i << ":" << stats.depthCount[i];
+ out << endl;
+#endif
+}
+
+
+//==================================================================
+// render_stats_write_json
+//==================================================================
+void render_stats_write_json(ostream &out, const render_stats_t &stats)
+{
+ out << "{" << endl;
+ out << " \"load_time\": " << stats.loadTime << "," << endl;
+ out << " \"build_time\": " << stats.buildTime << "," << endl;
+ out << " \"render_time\": " << stats.renderTime << "," << endl;
+ out << " \"write_time\": " << stats.writeTime << "," << endl;
+ out << " \"primary_rays\": " << stats.primaryRays << "," << endl;
+ out << " \"secondary_rays\": " << stats.secondaryRays << "," << endl;
+ out << " \"shadow_rays\": " << stats.shadowRays << "," << endl;
+ out << " \"intersection_tests\": " << stats.intersectionTests;
+#ifdef KIRAN_STATS
+ out << "," << endl;
+ out << " \"intercept_queries\": " << stats.interceptQueries << "," << endl;
+ out << " \"packet_queries\": " << stats.packetQueries << "," << endl;
+ out << " \"intercept_time\": " << stats.interceptTime << "," << endl;
+ out << " \"light_time\": " << stats.lightTime << "," << endl;
+ out << " \"bump_lookups\": " << stats.bumpLookups << "," << endl;
+ out << " \"classes\": {";
+ for(int i = 0; i < s_numClasses; i++)
+  out << (i ? ", " : "") << "\"" << render_stats_class_name(i) 
+      << "\": {\"tests\": " << stats.classTests[i] 
+      << ", \"hits\": " << stats.classHits[i] << "}";
+ out << "}," << endl;
+ out << " \"depth_histogram\": [";
+ for(int i = 0; i < RENDER_STATS_MAX_DEPTH; i++)
+  out << (i ? ", " : "") << stats.depthCount[i];
+ out << "]";
+#endif
+ out << endl << "}" << endl;
+}
+
+
+//==================================================================
+// render_stats_progress
+//==================================================================
+void render_stats_progress(ostream &out, int done, int total)
+{
+ int percent = (int)ceil(done * 100.0/total);
+ if(percent == s_lastPercent)
+  return;
+ s_lastPercent = percent;
+ out << "\rRendering    : " << percent << " % done" << flush;
+}
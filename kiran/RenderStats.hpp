@@ -0,0 +1,92 @@
+//==================================================================
+// RenderStats.hpp  Counters for measuring where the render time 
+//                  goes. Each thread counts into its own copy, and
+//                  the copies are summed when the threads finish.
+//
+//                  The ray counts are always kept. The detailed 
+//                  counters and timers are only compiled in with
+//                  -DKIRAN_STATS (make STATS=-DKIRAN_STATS), since
+//                  they sit on the hottest paths of the tracer.
+//==================================================================
+
+#ifndef _RENDERSTATS_HPP_INCLUDED
+#define _RENDERSTATS_HPP_INCLUDED
+
+#include <iostream>
+#include <typeinfo>
+
+using namespace std;
+
+#ifdef KIRAN_STATS
+#define KIRAN_STAT(...) __VA_ARGS__  // code for the detailed statistics
+#else
+#define KIRAN_STAT(...)
+#endif
+
+#define RENDER_STATS_MAX_DEPTH   16  // depths in the histogram
+#define RENDER_STATS_MAX_CLASSES 16  // object classes counted
+
+//==================================================================
+// struct _render_stats
+//==================================================================
+typedef struct _render_stats
+{
+ unsigned long primaryRays;        // rays from the camera
+ unsigned long secondaryRays;      // reflected and refracted rays
+ unsigned long shadowRays;         // rays towards the lights
+ unsigned long intersectionTests;  // ray-object intersection tests
+
+ // detailed statistics, see KIRAN_STATS
+ unsigned long interceptQueries;   // kiran_find_intercept calls
+ unsigned long packetQueries;      // closest hit queries for packets
+ unsigned long classTests[RENDER_STATS_MAX_CLASSES]; // tests by class
+ unsigned long classHits[RENDER_STATS_MAX_CLASSES];  // and their hits
+ unsigned long depthCount[RENDER_STATS_MAX_DEPTH];   // traces by depth
+ unsigned long bumpLookups;        // bump map texel reads
+ double interceptTime;             // seconds finding closest hits
+ double lightTime;                 // seconds lighting, with shadows
+
+ // stages of main, in seconds
+ double loadTime;                  // reading the scene
+ double buildTime;                 // building the BVH
+ double renderTime;                // tracing the image
+ double writeTime;                 // writing the image
+}render_stats_t;
+
+
+//==================================================================
+// Operations on _render_stats
+//==================================================================
+extern __thread render_stats_t render_thread_stats;
+
+inline render_stats_t &render_stats() {return render_thread_stats;}
+ //  return  Counters of the calling thread, zero when it starts.
+
+void render_stats_add(render_stats_t &total, const render_stats_t &stats);
+ // Add one set of counters to another.
+
+unsigned long render_stats_rays(const render_stats_t &stats);
+ //  return  Number of rays of all kinds.
+
+double render_stats_time();
+ //  return  Seconds on a monotonic clock.
+
+int render_stats_class(const type_info &type);
+ // Slot in classTests and classHits for a class of object. Register
+ // every class before the render threads start, later lookups of an
+ // unknown class share the last slot.
+ //  type    typeid of the object.
+
+void render_stats_print(ostream &out, const render_stats_t &stats);
+ // Print a readable summary.
+
+void render_stats_write_json(ostream &out, const render_stats_t &stats);
+ // Write the statistics as a JSON object.
+
+void render_stats_progress(ostream &out, int done, int total);
+ // Report progress of the render. Called by every render thread 
+ // with a lock held, prints only when the percentage changes.
+ //  done   Units of work finished.
+ //  total  Units of work in the render.
+
+#endif // _RENDERSTATS_HPP_INCLUDED
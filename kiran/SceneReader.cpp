@@ -1,6 +1,130 @@
 #include "SceneReader.hpp"
 #include <typeinfo>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// kinds of sections in a scene file
+enum
+{
+ SCENE_SPHERE,
+ SCENE_INFINITE_PLANE,
+ SCENE_CHECKER_BOARD,
+ SCENE_PLANAR_CONVEX_QUAD,
+ SCENE_BOX,
+ SCENE_ZCYLINDER,
+ SCENE_POINT_LIGHT,
+ SCENE_AMBIENT_LIGHT,
+ SCENE_CAMERA,
+ SCENE_BACKGROUND,
+ SCENE_GLOBAL
+};
+
+
+//==================================================================
+// scene_read_records - index the lines of a section by key
+//==================================================================
+static void scene_read_records(char *text, char *end, section_t &section)
+{
+ while(text < end)
+ {
+  char *line = text;
+  char *eol = (char *)memchr(text, '\n', end - text);
+  if(eol == NULL)
+   eol = end;
+  text = eol + 1;
+  *eol = '\0';
+  if(!isalpha(line[0]))
+   continue;
+
+  // A key is the start of a line up to a character that is not a
+  // letter or digit, and the value is the text after that character.
+  // So a line also gives a value to every shorter key it starts
+  // with up to a '_', as the line of phong_size does to phong. The
+  // last line of a key wins.
+  for(char *c = line + 1; ; c++)
+  {
+   if(isalnum(*c))
+    continue;
+   section.records[string(line, c - line)] = (*c == '\0') ? c : c + 1;
+   if(*c == '\0' || isspace(*c))
+    break;
+  }
+ }
+}
+
+
+//==================================================================
+// scene_read_sections - split a scene file into sections, writing
+//                       string ends into the text
+//==================================================================
+static void scene_read_sections(char *text, char *end, 
+                                vector<section_t> &sections)
+{
+ char *name, *close;
+
+ while(text < end)
+ {
+  // a section is <name>, its lines, and </...>
+  name = (char *)memchr(text, '<', end - text);
+  if(name == NULL)
+   return;
+  name++;
+  text = (char *)memchr(name, '>', end - name);
+  if(text == NULL)
+   return;
+  *text++ = '\0';
+  close = (char *)memchr(text, '<', end - text);
+  if(close == NULL)
+   return;
+  if(close + 1 >= end || close[1] != '/')
+  {
+   // not closed, start again from the next section
+   text = close + 1;
+   continue;
+  }
+
+  sections.push_back(section_t());
+  sections.back().name = name;
+  scene_read_records(text, close, sections.back());
+
+  // skip the rest of the line that closes the section
+  text = (char *)memchr(close, '\n', end - close);
+  if(text == NULL)
+   return;
+  text++;
+ }
+}
+
+
+//==================================================================
+// scene_read_numbers - numbers from the value of a record. Values
+//                      stop at text that is not a number, which reads
+//                      as 0, or at the end of the line, leaving the 
+//                      rest as they were.
+//==================================================================
+static void scene_read_numbers(const char *text, double *values, int count)
+{
+ char *end;
+
+ for(int i = 0; i < count; i++)
+ {
+  while(isspace(*text))
+   text++;
+  if(*text == '\0')
+   return;
+  values[i] = strtod(text, &end);
+  if(end == text)
+  {
+   values[i] = 0;
+   return;
+  }
+  text = end;
+ }
+}
 
 //==================================================================
 // SceneReader::SceneReader
@@ -17,6 +141,8 @@ SceneReader::SceneReader( char *sceneFile )
  d_imageWidth = 640;
  d_imageHeight = 480;
  d_isAntiAliasEnabled = false;
+ d_isAntiAliasAdaptive = false;
+ d_antiAliasThreshold = 0.2;
  d_numShadowRays = 1;
  
  if(sceneFile == NULL)
@@ -55,8 +181,6 @@ SceneReader::~SceneReader()
  
  if(d_bkImage)
   delete d_bkImage;
-  
- d_file.close();
 }
 
 
@@ -68,122 +192,109 @@ int SceneReader::open(char *sceneFile)
  if(sceneFile == NULL)
   return(-1);
 
- d_file.open(sceneFile, fstream::in);
- if( !d_file.is_open() )
+ struct stat info;
+ char *data = NULL;
+ int fd;
+
+ // the file is mapped and read in one pass, string ends are written
+ // into the private copy of the pages
+ fd = ::open(sceneFile, O_RDONLY);
+ if(fd < 0 || fstat(fd, &info) != 0)
+ {
+  if(fd >= 0)
+   close(fd);
   return(-1);
- 
- cout << "SceneReader: Processing scene file " << sceneFile << "." 
-      << endl;
- 
- Object *object;
- Light *light;
- int fileLen;
- char buf[80];
- 
- // get length of scene file
- d_file.seekg(0, ios::end);
- fileLen = d_file.tellg();
- d_file.seekg(0, ios::beg);
- 
- // Make a list of all sections
- d_sectionList.clear();
- while(!d_file.eof())
+ }
+ if(info.st_size > 0)
  {
-  d_file.ignore(fileLen,'<'); // begin class section
-  d_file.getline(buf, 80,'>'); // get class name
-  section_t *section = new section_t;
-  section->begin = d_file.tellg();
-  strcpy(section->name, buf);
-  d_file.ignore(fileLen, '<');
-  if(d_file.peek() == '/') // </ is end class
+  data = (char *)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, 
+                      MAP_PRIVATE, fd, 0);
+  if(data == MAP_FAILED)
   {
-   section->end = d_file.tellg();
-   d_sectionList.push_back(section);
-   d_file.ignore(fileLen, '\n'); // ignore rest of the line
+   close(fd);
+   return(-1);
   }
  }
+ close(fd);
+ 
+ cout << "SceneReader: Processing scene file " << sceneFile << "." 
+      << endl;
+ 
+ static const unordered_map<string, int> kinds = {
+  {"Sphere", SCENE_SPHERE},
+  {"InfinitePlane", SCENE_INFINITE_PLANE},
+  {"CheckerBoard", SCENE_CHECKER_BOARD},
+  {"PlanarConvexQuad", SCENE_PLANAR_CONVEX_QUAD},
+  {"Box", SCENE_BOX},
+  {"ZCylinder", SCENE_ZCYLINDER},
+  {"PointLight", SCENE_POINT_LIGHT},
+  {"AmbientLight", SCENE_AMBIENT_LIGHT},
+  {"Camera", SCENE_CAMERA},
+  {"Background", SCENE_BACKGROUND},
+  {"Global", SCENE_GLOBAL}};
+ unordered_map<string, int>::const_iterator kind;
+ vector<section_t> sections;
 
+ // Make a list of all sections
+ if(data != NULL)
+  scene_read_sections(data, data + info.st_size, sections);
 
  // Step through sections
- for(unsigned int i = 0; i < d_sectionList.size(); i++)
+ for(unsigned int i = 0; i < sections.size(); i++)
  {
-  if(strstr(d_sectionList[i]->name, "Sphere") != NULL)
-  {
-   object = readSphere(d_sectionList[i]);
-   d_objectList.push_back(object);
-   continue;
-  }
+  section_t *section = &sections[i];
 
-  if(strstr(d_sectionList[i]->name, "InfinitePlane") != NULL)
+  kind = kinds.find(section->name);
+  if(kind == kinds.end())
   {
-   object = readInfinitePlane(d_sectionList[i]);
-   d_objectList.push_back(object);
+   cout << "SceneReader: ERROR unknown object " << section->name << endl;
    continue;
   }
 
-  if(strstr(d_sectionList[i]->name, "CheckerBoard") != NULL)
+  switch(kind->second)
   {
-   object = readCheckerBoard(d_sectionList[i]);
-   d_objectList.push_back(object);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "PlanarConvexQuad") != NULL)
-  {
-   object = readPlanarConvexQuad(d_sectionList[i]);
-   d_objectList.push_back(object);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "Box") != NULL)
-  {
-   object = readBox(d_sectionList[i]);
-   d_objectList.push_back(object);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "ZCylinder") != NULL)
-  {
-   object = readZCylinder(d_sectionList[i]);
-   d_objectList.push_back(object);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "PointLight") != NULL)
-  {
-   light = readPointLight(d_sectionList[i]);
-   d_lightList.push_back(light);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "AmbientLight") != NULL)
-  {
-   d_ambientLight = readAmbientLight(d_sectionList[i]);
-   continue;
-  }
-
-  if(strstr(d_sectionList[i]->name, "Camera") != NULL)
-  {
-   d_camera = readCamera(d_sectionList[i]);
-   continue;
+   case SCENE_SPHERE:
+    d_objectList.push_back(readSphere(section));
+    break;
+   case SCENE_INFINITE_PLANE:
+    d_objectList.push_back(readInfinitePlane(section));
+    break;
+   case SCENE_CHECKER_BOARD:
+    d_objectList.push_back(readCheckerBoard(section));
+    break;
+   case SCENE_PLANAR_CONVEX_QUAD:
+    d_objectList.push_back(readPlanarConvexQuad(section));
+    break;
+   case SCENE_BOX:
+    d_objectList.push_back(readBox(section));
+    break;
+   case SCENE_ZCYLINDER:
+    d_objectList.push_back(readZCylinder(section));
+    break;
+   case SCENE_POINT_LIGHT:
+    d_lightList.push_back(readPointLight(section));
+    break;
+   case SCENE_AMBIENT_LIGHT:
+    d_ambientLight = readAmbientLight(section);
+    break;
+   case SCENE_CAMERA:
+    d_camera = readCamera(section);
+    break;
+   case SCENE_BACKGROUND:
+    readBackGround(section);
+    break;
+   case SCENE_GLOBAL:
+    readGlobalSettings(section);
+    break;
   }
+ }
 
-  if(strstr(d_sectionList[i]->name, "Background") != NULL)
-  {
-   readBackGround(d_sectionList[i]);
-   continue;
-  }
+ // all properties are read, let objects precompute their tests
+ for(unsigned int i = 0; i < d_objectList.size(); i++)
+  d_objectList[i]->finalize();
 
-  if(strstr(d_sectionList[i]->name, "Global") != NULL)
-  {
-   readGlobalSettings(d_sectionList[i]);
-   continue;
-  }
-  
-  cout << "SceneReader: ERROR unknown object " << d_sectionList[i]->name 
-       << endl;
- }
- d_file.close();
+ if(data != NULL)
+  munmap(data, info.st_size);
  return 0;
 }
 
@@ -270,6 +381,24 @@ bool SceneReader::isAntiAliasEnabled()
 }
 
 
+//==================================================================
+// SceneReader::isAntiAliasAdaptive
+//==================================================================
+bool SceneReader::isAntiAliasAdaptive()
+{
+ return d_isAntiAliasAdaptive;
+}
+
+
+//==================================================================
+// SceneReader::getAntiAliasThreshold
+//==================================================================
+double SceneReader::getAntiAliasThreshold()
+{
+ return d_antiAliasThreshold;
+}
+
+
 //==================================================================
 // SceneReader::getNumShadowRays
 //==================================================================
@@ -303,25 +432,11 @@ void SceneReader::printSceneInfo()
 void SceneReader::getScalarRecord(section_t *section, char *name, 
                                   double &value, double def)
 {
- char buf[80];
- int nameLen = strlen(name);
- int i = section->begin;
+ unordered_map<string, char *>::iterator record;
  value = def;
- d_file.clear();  // clear eof or bad state
- d_file.seekg(i, ios::beg);
- while(i < section->end)
- {
-  d_file.getline(buf, 80);
-  if(strncmp(buf, name, nameLen) == 0) // check for name matches
-  {
-   // make sure match is not just in part
-   if(isalpha(buf[nameLen]) || isdigit(buf[nameLen])) 
-    continue;
-   istrstream data((buf+nameLen+1));
-   data >> value;
-  }
-  i = d_file.tellg();
- }
+ record = section->records.find(name);
+ if(record != section->records.end())
+  scene_read_numbers(record->second, &value, 1);
 }
 
 
@@ -331,54 +446,33 @@ void SceneReader::getScalarRecord(section_t *section, char *name,
 void SceneReader::getVectorRecord(section_t *section, char *name, 
                                  vector3d_t &value, vector3d_t def)
 {
- char buf[80];
- int nameLen = strlen(name);
- int i = section->begin;
+ unordered_map<string, char *>::iterator record;
+ double xyz[3];
  value = def;
- d_file.clear();  // clear eof or bad state
- d_file.seekg(i, ios::beg);
- while(i < section->end)
- {
-  d_file.getline(buf, 80);
-  if(strncmp(buf, name, nameLen) == 0) // check for name matches
-  {
-   // make sure match is not just in part
-   if(isalpha(buf[nameLen]) || isdigit(buf[nameLen])) 
-    continue;
-   istrstream data((buf+nameLen+1));
-   data >> value.x;
-   data >> value.y;
-   data >> value.z;
-  }
-  i = d_file.tellg();
- }
+ record = section->records.find(name);
+ if(record == section->records.end())
+  return;
+ xyz[0] = value.x;
+ xyz[1] = value.y;
+ xyz[2] = value.z;
+ scene_read_numbers(record->second, xyz, 3);
+ value.x = xyz[0];
+ value.y = xyz[1];
+ value.z = xyz[2];
 }
 
 
 //==================================================================
 // SceneReader::getStringRecord
 //==================================================================
-void SceneReader::getStringRecord(section_t *section, char *name, 
-                                          char *value, char *def)
+char *SceneReader::getStringRecord(section_t *section, char *name, 
+                                   char *def)
 {
- char buf[80];
- int nameLen = strlen(name);
- int i = section->begin;
- strcpy(value, def);
- d_file.clear();  // clear eof or bad state
- d_file.seekg(i, ios::beg);
- while(i < section->end)
- {
-  d_file.getline(buf, 80);
-  if(strncmp(buf, name, nameLen) == 0) // check for name matches
-  {
-   // make sure match is not just in part
-   if(isalpha(buf[nameLen]) || isdigit(buf[nameLen])) 
-    continue;
-   strcpy(value, (buf+nameLen+1));
-  }
-  i = d_file.tellg();
- }
+ unordered_map<string, char *>::iterator record;
+ record = section->records.find(name);
+ if(record == section->records.end())
+  return def;
+ return record->second;
 }
 
 
@@ -389,10 +483,10 @@ void SceneReader::readCommonProperties(section_t *section, Object *object)
 {
  double sc;
  vector3d_t vec;
- char str[80];
+ char *str;
  rgb_t color;
  
- getStringRecord(section, "name", str, "noname");
+ str = getStringRecord(section, "name", "noname");
  object->setName(str);
 
  getVectorRecord(section, "color", vec, vector3d_t(0,0,0));
@@ -401,11 +495,11 @@ void SceneReader::readCommonProperties(section_t *section, Object *object)
  color.b = vec.z;
  object->setColor(color);
 
- getStringRecord(section, "texture", str, "NULL");
+ str = getStringRecord(section, "texture", "NULL");
  if( strcmp(str, "NULL") != 0 )
   object->setTexture(str);
 
- getStringRecord(section, "bump_map", str, "NULL");
+ str = getStringRecord(section, "bump_map", "NULL");
  if( strcmp(str, "NULL") != 0 )
   object->setBumpMap(str);
  
@@ -542,7 +636,7 @@ Object *SceneReader::readZCylinder(section_t *section)
 {
  vector3d_t v;
  double sc;
- char str[80];
+ char *str;
 
  Object *object = new ZCylinder;
 
@@ -553,7 +647,7 @@ Object *SceneReader::readZCylinder(section_t *section)
  ((ZCylinder *)object)->setRadius(sc);
  getScalarRecord(section, "length", sc, 0);
  ((ZCylinder *)object)->setLength(sc);
- getStringRecord(section, "show_end_caps", str, "no");
+ str = getStringRecord(section, "show_end_caps", "no");
  if(strcmp(str, "yes") == 0)
   ((ZCylinder *)object)->setEndCapsOn();
 
@@ -568,9 +662,9 @@ Light *SceneReader::readPointLight(section_t *section)
 {
  Light *light = new PointLight;
  vector3d_t vec;
- char str[80];
+ char *str;
  
- getStringRecord(section, "name", str, "noname");
+ str = getStringRecord(section, "name", "noname");
  ((PointLight *)light)->setName(str);
 
  getVectorRecord(section, "position", vec, vector3d_t(0,0,0));
@@ -593,9 +687,9 @@ AmbientLight *SceneReader::readAmbientLight(section_t *section)
 {
  AmbientLight *light = new AmbientLight;
  vector3d_t vec;
- char str[80];
+ char *str;
  
- getStringRecord(section, "name", str, "noname");
+ str = getStringRecord(section, "name", "noname");
  ((AmbientLight *)light)->setName(str);
 
  getVectorRecord(section, "intensity", vec, vector3d_t(0,0,0));
@@ -612,9 +706,9 @@ void SceneReader::readBackGround(section_t *section)
 {
  vector3d_t vec;
  rgb_t color;
- char str[80];
+ char *str;
  
- getStringRecord(section, "image", str, "noname");
+ str = getStringRecord(section, "image", "noname");
  if(strcmp(str, "noname") != 0)
  {
   d_bkImageSpecified = true;
@@ -634,7 +728,7 @@ void SceneReader::readBackGround(section_t *section)
 //==================================================================
 void SceneReader::readGlobalSettings(section_t *section)
 {
- char str[80];
+ char *str;
  double sc;
 
  getScalarRecord(section, "num_shadow_rays", sc, 1);
@@ -646,9 +740,17 @@ void SceneReader::readGlobalSettings(section_t *section)
  getScalarRecord(section, "image_height", sc, 240);
   d_imageHeight = (int)sc;
 
- getStringRecord(section, "anti_alias", str, "no");
+ str = getStringRecord(section, "anti_alias", "no");
  if(strcmp(str, "yes") == 0)
   d_isAntiAliasEnabled = true;
+ if(strcmp(str, "adaptive") == 0)
+ {
+  d_isAntiAliasEnabled = true;
+  d_isAntiAliasAdaptive = true;
+ }
+
+ getScalarRecord(section, "aa_threshold", sc, 0.2);
+  d_antiAliasThreshold = sc;
 }
 
 
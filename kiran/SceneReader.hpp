@@ -10,9 +10,9 @@
 #ifndef _SCENEREADER_HPP_INCLUDED
 #define _SCENEREADER_HPP_INCLUDED
 
-#include <fstream>
 #include <vector>
-#include <strstream>
+#include <string>
+#include <unordered_map>
 #include "objects.hpp"
 #include "Pixmap.hpp"
 #include "lights.hpp"
@@ -20,14 +20,15 @@
 #include "data_types.hpp"
 
 //==================================================================
-// struct _section  A structure for beginning and end of a section
-//                  in a scene file.
+// struct _section  A section of a scene file, with the text after
+//                  each key in it. The text lives in the buffer the
+//                  file is read into, and is only valid while the
+//                  file is being read.
 //==================================================================
 typedef struct _section
 {
- char name[80];
- int begin; // pointer to beginning of section
- int end;   // pointer to end of section
+ char *name;                            // text between < and >
+ unordered_map<string, char *> records; // rest of the line by key
 }section_t;
 
 
@@ -79,6 +80,14 @@ class SceneReader
  bool isAntiAliasEnabled();
   //  return  True if anti-aliasing is on
 
+ bool isAntiAliasAdaptive();
+  //  return  True if anti-aliasing only supersamples pixels that
+  //          differ from their neighbours (anti_alias adaptive)
+
+ double getAntiAliasThreshold();
+  //  return  Color difference between neighbouring samples above 
+  //          which adaptive anti-aliasing subdivides (aa_threshold)
+
  int getNumShadowRays();
   // Number of shadow rays to create soft shadows
    
@@ -90,7 +99,7 @@ class SceneReader
  private:
   void getScalarRecord(section_t *section, char *name, double &value, double def);
   void getVectorRecord(section_t *section, char *name, vector3d_t &value, vector3d_t def);
-  void getStringRecord(section_t *section, char *name, char *value, char *def);
+  char *getStringRecord(section_t *section, char *name, char *def);
   void readCommonProperties(section_t *section, Object *object);
   Object *readSphere(section_t *section);
   Object *readInfinitePlane(section_t *section);
@@ -104,11 +113,9 @@ class SceneReader
   void readBackGround(section_t *section);
   void readGlobalSettings(section_t *section);
   
-  fstream d_file;
   Camera *d_camera;
   vector<Object *> d_objectList;
   vector<Light *> d_lightList;
-  vector<section_t *> d_sectionList;
   AmbientLight *d_ambientLight;
   Pixmap *d_bkImage;
   rgb_t d_bkColor;
@@ -116,6 +123,8 @@ class SceneReader
   int d_imageWidth;
   int d_imageHeight;
   bool d_isAntiAliasEnabled;
+  bool d_isAntiAliasAdaptive;
+  double d_antiAliasThreshold;
   int d_numShadowRays;
 };
 
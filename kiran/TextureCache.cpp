@@ -0,0 +1,692 @@
+//==================================================================
+// TextureCache.cpp  Texture maps shared by all objects
+//==================================================================
+
+#include "TextureCache.hpp"
+#include <map>
+#include <string>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// state of the cache, protected by s_lock. Tiles in memory are read
+// without it, see Texture::texel.
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, Texture *> s_textures;  // textures by file name
+static map<string, Texture *> s_derivatives; // bump maps by file name
+static texture_tile_t *s_newest = NULL;    // tiles by load, see getTile
+static texture_tile_t *s_oldest = NULL;
+static texture_tile_t *s_unused = NULL;    // tiles dropped, for reuse
+static size_t s_memory = 0;                // bytes in tiles
+static size_t s_maxMemory = TEXTURE_DEFAULT_MEMORY;
+static unsigned long s_loads = 0;
+static unsigned long s_evictions = 0;
+static double s_scale[256];                // texel byte -> color value
+
+
+//==================================================================
+// texture_header_value - a number of a PPM header in memory, see
+//                        Pixmap::readHeaderValue
+//==================================================================
+static int texture_header_value(const unsigned char *data, size_t size,
+                                size_t &pos, int &value)
+{
+ // skip white space and comments
+ while(pos < size && (data[pos] == '#' || isspace(data[pos])))
+ {
+  if(data[pos] == '#')
+   while(pos < size && data[pos] != '\n')
+    pos++;
+  else
+   pos++;
+ }
+ if(pos >= size || !isdigit(data[pos]))
+  return -1;
+ for(value = 0; pos < size && isdigit(data[pos]); pos++)
+  value = 10 * value + (data[pos] - '0');
+ // one white space character ends the header
+ if(pos >= size || !isspace(data[pos]))
+  return -1;
+ pos++;
+ return 0;
+}
+
+
+//==================================================================
+// texture_box_filter - texels of a MIP map level, each the mean of
+//                      2 x 2 texels of the level below. Rows of both
+//                      are those of a tile.
+//==================================================================
+template<class T>
+static void texture_box_filter(const T *below, int dx, int dy, T *level,
+                               int width, int height, int channels)
+{
+ const size_t rowSize = TEXTURE_TILE_SIZE * channels;
+
+ // a level one texel across averages that texel with itself
+ dx *= channels;
+ for(int y = 0; y < height; y++)
+ {
+  const T *r0 = below + (size_t)(2 * y) * rowSize;
+  const T *r1 = r0 + dy * rowSize;
+  T *c = level + (size_t)y * rowSize;
+  for(int x = 0; x < width; x++)
+   for(int k = 0; k < channels; k++, c++)
+   {
+    const int i = 2 * x * channels + k;
+    *c = (T)((r0[i] + r0[i + dx] + r1[i] + r1[i + dx] + 2) >> 2);
+   }
+ }
+}
+
+
+//==================================================================
+// texture_unlink - take a tile out of the list of tiles in memory
+//==================================================================
+static void texture_unlink(texture_tile_t *tile)
+{
+ if(tile->prev)
+  tile->prev->next = tile->next;
+ else
+  s_newest = tile->next;
+ if(tile->next)
+  tile->next->prev = tile->prev;
+ else
+  s_oldest = tile->prev;
+}
+
+
+//==================================================================
+// texture_link - put a tile at the front of the list of tiles in
+//                memory
+//==================================================================
+static void texture_link(texture_tile_t *tile)
+{
+ tile->prev = NULL;
+ tile->next = s_newest;
+ if(s_newest)
+  s_newest->prev = tile;
+ s_newest = tile;
+ if(s_oldest == NULL)
+  s_oldest = tile;
+}
+
+
+//==================================================================
+// Texture::Texture
+//==================================================================
+Texture::Texture()
+{
+ d_width = 0;
+ d_height = 0;
+ d_channels = 3;
+ d_depth = 1;
+ d_source = NULL;
+ d_numLevels = 0;
+}
+
+
+//==================================================================
+// Texture::open
+//==================================================================
+int Texture::open(const char *fileName)
+{
+ struct stat info;
+ const unsigned char *data;
+ size_t pos = 2;
+ int fd, maxPixVal;
+
+ fd = ::open(fileName, O_RDONLY);
+ if(fd < 0 || fstat(fd, &info) != 0 || info.st_size < 2)
+ {
+  cerr << "TextureCache: ERROR opening image file " << fileName << endl;
+  if(fd >= 0)
+   close(fd);
+  return -1;
+ }
+ data = (const unsigned char *)mmap(NULL, info.st_size, PROT_READ,
+                                    MAP_PRIVATE, fd, 0);
+ close(fd);
+ if(data == MAP_FAILED)
+ {
+  cerr << "TextureCache: ERROR mapping image file " << fileName << endl;
+  return -1;
+ }
+
+ if(data[0] != 'P' || texture_header_value(data, info.st_size, pos,
+                                           d_width) != 0 ||
+    texture_header_value(data, info.st_size, pos, d_height) != 0 ||
+    texture_header_value(data, info.st_size, pos, maxPixVal) != 0 ||
+    d_width <= 0 || d_height <= 0 || maxPixVal != 255 ||
+    (data[1] != '2' && data[1] != '3' && data[1] != '5' && data[1] != '6'))
+ {
+  cerr << "TextureCache: ERROR reading image header of " << fileName
+       << endl;
+  munmap((void *)data, info.st_size);
+  return -1;
+ }
+ d_channels = (data[1] == '2' || data[1] == '5') ? 1 : 3;
+
+ if(data[1] == '5' || data[1] == '6')
+ {
+  // binary texels are read from the mapped file as they are needed
+  if(pos + (size_t)d_width * d_height * d_channels > (size_t)info.st_size)
+  {
+   cerr << "TextureCache: ERROR image file " << fileName
+        << " is truncated." << endl;
+   munmap((void *)data, info.st_size);
+   return -1;
+  }
+  data += pos;
+ }
+ else
+ {
+  // ascii files are decoded once, the cache pages from the result
+  Pixmap image;
+  unsigned char *decoded;
+  munmap((void *)data, info.st_size);
+  if(image.open(fileName) != 0)
+   return -1;
+  decoded = (unsigned char *)malloc((size_t)d_width * d_height * d_channels);
+  if(decoded == NULL)
+  {
+   cerr << "TextureCache: ERROR allocating memory." << endl;
+   exit(-1);
+  }
+  for(int y = 1; y <= d_height; y++)
+   for(int x = 1; x <= d_width; x++)
+   {
+    unsigned char *c = decoded + ((size_t)(y - 1) * d_width + x - 1) *
+                       d_channels;
+    const rgb_t color = image(x, y);
+    c[0] = (unsigned char)(color.r * 255 + 0.5);
+    if(d_channels == 3)
+    {
+     c[1] = (unsigned char)(color.g * 255 + 0.5);
+     c[2] = (unsigned char)(color.b * 255 + 0.5);
+    }
+   }
+  data = decoded;
+ }
+
+ if(addLevel(data, d_width, d_height) != 0)
+  return -1;
+ makeLevels();
+ return 0;
+}
+
+
+//==================================================================
+// Texture::makeDerivatives
+//==================================================================
+int Texture::makeDerivatives(const Texture &bumpMap)
+{
+ d_source = &bumpMap;
+ d_width = bumpMap.d_width;
+ d_height = bumpMap.d_height;
+ d_channels = 3;
+ d_depth = 2;
+ if(addLevel(NULL, d_width, d_height) != 0)
+  return -1;
+ makeLevels();
+ return 0;
+}
+
+
+//==================================================================
+// Texture::addLevel
+//==================================================================
+int Texture::addLevel(const unsigned char *data, int width, int height)
+{
+ int tilesY;
+
+ if(d_numLevels >= TEXTURE_MAX_LEVELS)
+  return -1;
+
+ texture_level_t &level = d_levels[d_numLevels];
+ level.data = data;
+ level.width = width;
+ level.height = height;
+ level.tilesX = (width + TEXTURE_TILE_SIZE - 1) >> TEXTURE_TILE_BITS;
+ tilesY = (height + TEXTURE_TILE_SIZE - 1) >> TEXTURE_TILE_BITS;
+ level.tiles = (texture_tile_t **)calloc(level.tilesX * tilesY,
+                                         sizeof(texture_tile_t *));
+ if(level.tiles == NULL)
+ {
+  cerr << "TextureCache: ERROR allocating memory." << endl;
+  exit(-1);
+ }
+ d_numLevels++;
+ return 0;
+}
+
+
+//==================================================================
+// Texture::makeLevels
+//==================================================================
+void Texture::makeLevels()
+{
+ while(d_numLevels < TEXTURE_MAX_LEVELS)
+ {
+  const texture_level_t &below = d_levels[d_numLevels - 1];
+
+  if(below.width == 1 && below.height == 1)
+   return;
+  addLevel(NULL, (below.width > 1) ? below.width/2 : 1,
+           (below.height > 1) ? below.height/2 : 1);
+ }
+}
+
+
+//==================================================================
+// Texture::filterTile
+//==================================================================
+void Texture::filterTile(int level, int index, unsigned char *texels) const
+{
+ const texture_level_t &l = d_levels[level];
+ const texture_level_t &below = d_levels[level - 1];
+ const int half = TEXTURE_TILE_SIZE/2;
+ const int x0 = (index % l.tilesX) << TEXTURE_TILE_BITS;
+ const int y0 = (index / l.tilesX) << TEXTURE_TILE_BITS;
+ const int dx = (below.width > 1) ? 1 : 0;
+ const int dy = (below.height > 1) ? 1 : 0;
+
+ // each quarter of the tile is made from one tile of the level below,
+ // read just before it is used as reading another may drop it
+ for(int qy = 0; qy < 2; qy++)
+  for(int qx = 0; qx < 2; qx++)
+  {
+   const int x = x0 + qx * half;
+   const int y = y0 + qy * half;
+   const int columns = (l.width - x < half) ? l.width - x : half;
+   const int rows = (l.height - y < half) ? l.height - y : half;
+   const texture_tile_t *tile;
+   unsigned char *c;
+
+   if(columns <= 0 || rows <= 0)
+    continue;
+   tile = getTile(level - 1, ((2 * y) >> TEXTURE_TILE_BITS) * below.tilesX +
+                             ((2 * x) >> TEXTURE_TILE_BITS));
+   c = texels + ((qy * half << TEXTURE_TILE_BITS) + qx * half) * 
+                d_channels * d_depth;
+   if(d_depth == 1)
+    texture_box_filter(tile->texels, dx, dy, c, columns, rows, d_channels);
+   else
+    texture_box_filter((const unsigned short *)tile->texels, dx, dy,
+                       (unsigned short *)c, columns, rows, d_channels);
+  }
+}
+
+
+//==================================================================
+// Texture::deriveTile
+//==================================================================
+void Texture::deriveTile(int index, unsigned char *texels) const
+{
+ const texture_level_t &l = d_levels[0];
+ const unsigned char *bump = d_source->d_levels[0].data;
+ const int channels = d_source->d_channels;
+ const int step = TEXTURE_DERIVATIVE_STEP;
+ const int size = TEXTURE_TILE_SIZE + 2 * step;
+ const int x0 = (index % l.tilesX) << TEXTURE_TILE_BITS;
+ const int y0 = (index / l.tilesX) << TEXTURE_TILE_BITS;
+ const int columns = (l.width - x0 < TEXTURE_TILE_SIZE) ? l.width - x0
+                                                        : TEXTURE_TILE_SIZE;
+ const int rows = (l.height - y0 < TEXTURE_TILE_SIZE) ? l.height - y0
+                                                      : TEXTURE_TILE_SIZE;
+ double height[size * size];  // heights of the tile and step around it
+
+ // neighbors past the border are read at the border
+ for(int y = 0; y < rows + 2 * step; y++)
+ {
+  int by = y0 + y - step;
+  by = (by < 0) ? 0 : (by >= d_height) ? d_height - 1 : by;
+  for(int x = 0; x < columns + 2 * step; x++)
+  {
+   int bx = x0 + x - step;
+   bx = (bx < 0) ? 0 : (bx >= d_width) ? d_width - 1 : bx;
+   const unsigned char *c = bump + ((size_t)by * d_width + bx) * channels;
+   if(channels == 1)
+    height[y * size + x] = 0.33 * 3 * s_scale[c[0]] - 0.5;
+   else
+    height[y * size + x] = 0.33 * (s_scale[c[0]] + s_scale[c[1]] + 
+                                   s_scale[c[2]]) - 0.5;
+  }
+ }
+
+ for(int y = 0; y < rows; y++)
+  for(int x = 0; x < columns; x++)
+  {
+   const double *h = height + (y + step) * size + x + step;
+   unsigned short *d = (unsigned short *)texels + 
+                       ((y << TEXTURE_TILE_BITS) + x) * 3;
+   double value[3];
+
+   value[0] = 0.25 * (h[-step] + h[step] + h[-step * size] + h[step * size]);
+   value[1] = (h[step] - h[-step])/(2 * step);
+   value[2] = (h[step * size] - h[-step * size])/(2 * step);
+   for(int k = 0; k < 3; k++)
+   {
+    double v = value[k] * TEXTURE_DERIVATIVE_SCALE + 32768.5;
+    d[k] = (unsigned short)((v < 0) ? 0 : (v > 65535) ? 65535 : v);
+   }
+  }
+}
+
+
+//==================================================================
+// Texture::getTile
+//==================================================================
+const texture_tile_t *Texture::getTile(int level, int index) const
+{
+ const texture_level_t &l = d_levels[level];
+ texture_tile_t *tile = l.tiles[index];
+ const size_t texelBytes = d_channels * d_depth;
+ const size_t rowBytes = TEXTURE_TILE_SIZE * texelBytes;
+ const size_t bytes = TEXTURE_TILE_SIZE * rowBytes;
+ texture_tile_t *kept = NULL;
+
+ if(tile != NULL)
+  return tile;
+
+ // drop the oldest tiles to make room. Tiles read since they were
+ // last passed get another turn (second chance), and tiles pinned by
+ // a reader are kept until a full turn has gone by.
+ while(s_oldest != NULL && s_oldest != kept &&
+       s_memory + bytes > s_maxMemory)
+ {
+  texture_tile_t *old = s_oldest;
+  texture_tile_t **slot = &old->texture->d_levels[old->level].tiles[old->index];
+
+  texture_unlink(old);
+  if(__atomic_load_n(&old->used, __ATOMIC_RELAXED))
+  {
+   __atomic_store_n(&old->used, 0, __ATOMIC_RELAXED);
+   texture_link(old);
+   continue;
+  }
+  // a reader pins a tile before checking it is still in its slot
+  __atomic_store_n(slot, NULL, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&old->pins, __ATOMIC_SEQ_CST) != 0)
+  {
+   __atomic_store_n(slot, old, __ATOMIC_RELEASE);
+   texture_link(old);
+   if(kept == NULL)
+    kept = old;
+   continue;
+  }
+  s_memory -= TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 
+              old->texture->d_channels * old->texture->d_depth;
+  free(old->texels);
+  old->next = s_unused;
+  s_unused = old;
+  s_evictions++;
+ }
+
+ // a reader may still pin a dropped tile, so it is never freed
+ if(s_unused != NULL)
+ {
+  tile = s_unused;
+  s_unused = tile->next;
+ }
+ else
+ {
+  tile = (texture_tile_t *)malloc(sizeof(texture_tile_t));
+  if(tile != NULL)
+   tile->pins = 0;
+ }
+ if(tile == NULL || (tile->texels = (unsigned char *)malloc(bytes)) == NULL)
+ {
+  cerr << "TextureCache: ERROR allocating memory." << endl;
+  exit(-1);
+ }
+ tile->texture = (Texture *)this;
+ tile->level = level;
+ tile->index = index;
+ tile->used = 0;
+ // counted now, as making the texels may read other tiles
+ s_memory += bytes;
+ if(l.data != NULL)
+ {
+  const int x0 = (index % l.tilesX) << TEXTURE_TILE_BITS;
+  const int y0 = (index / l.tilesX) << TEXTURE_TILE_BITS;
+  const int columns = (l.width - x0 < TEXTURE_TILE_SIZE) ? l.width - x0
+                                                         : TEXTURE_TILE_SIZE;
+  const int rows = (l.height - y0 < TEXTURE_TILE_SIZE) ? l.height - y0
+                                                       : TEXTURE_TILE_SIZE;
+  for(int r = 0; r < rows; r++)
+   memcpy(tile->texels + r * rowBytes,
+          l.data + ((size_t)(y0 + r) * l.width + x0) * texelBytes,
+          columns * texelBytes);
+ }
+ else if(level == 0)
+  deriveTile(index, tile->texels);
+ else
+  filterTile(level, index, tile->texels);
+ texture_link(tile);
+ __atomic_store_n(&l.tiles[index], tile, __ATOMIC_RELEASE);
+ s_loads++;
+ return tile;
+}
+
+
+//==================================================================
+// Texture::decode
+//==================================================================
+rgb_t Texture::decode(const texture_tile_t *tile, int x, int y) const
+{
+ const unsigned char *c;
+ rgb_t color;
+
+ c = tile->texels + (((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_BITS) +
+                     (x & (TEXTURE_TILE_SIZE - 1))) * d_channels * d_depth;
+ if(d_depth == 2)
+ {
+  const unsigned short *d = (const unsigned short *)c;
+  color.r = (d[0] - 32768)/TEXTURE_DERIVATIVE_SCALE;
+  color.g = (d[1] - 32768)/TEXTURE_DERIVATIVE_SCALE;
+  color.b = (d[2] - 32768)/TEXTURE_DERIVATIVE_SCALE;
+ }
+ else if(d_channels == 1)
+ {
+  color.r =
+  color.g =
+  color.b = s_scale[c[0]];
+ }
+ else
+ {
+  color.r = s_scale[c[0]];
+  color.g = s_scale[c[1]];
+  color.b = s_scale[c[2]];
+ }
+ return color;
+}
+
+
+//==================================================================
+// Texture::texel
+//==================================================================
+rgb_t Texture::texel(int level, int x, int y) const
+{
+ const texture_level_t &l = d_levels[level];
+ texture_tile_t *tile, **slot;
+ rgb_t color;
+
+ if( x >= l.width || x < 0  || y >= l.height || y < 0)
+  return color;
+
+ slot = &l.tiles[(y >> TEXTURE_TILE_BITS) * l.tilesX + 
+                 (x >> TEXTURE_TILE_BITS)];
+ tile = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+ if(tile != NULL)
+ {
+  // pin the tile, then check it was not dropped meanwhile. getTile
+  // puts back a tile it finds pinned after taking it out of its slot.
+  __atomic_add_fetch(&tile->pins, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(slot, __ATOMIC_SEQ_CST) == tile)
+  {
+   if(!__atomic_load_n(&tile->used, __ATOMIC_RELAXED))
+    __atomic_store_n(&tile->used, 1, __ATOMIC_RELAXED);
+   color = decode(tile, x, y);
+   __atomic_sub_fetch(&tile->pins, 1, __ATOMIC_RELEASE);
+   return color;
+  }
+  __atomic_sub_fetch(&tile->pins, 1, __ATOMIC_RELEASE);
+ }
+
+ pthread_mutex_lock(&s_lock);
+ color = decode(getTile(level, slot - l.tiles), x, y);
+ pthread_mutex_unlock(&s_lock);
+ return color;
+}
+
+
+//==================================================================
+// Texture::operator()
+//==================================================================
+rgb_t Texture::operator()(int x, int y) const
+{
+ return texel(0, x - 1, y - 1);
+}
+
+
+//==================================================================
+// Texture::lookup
+//==================================================================
+rgb_t Texture::lookup(double s, double t, double width) const
+{
+ rgb_t color, above;
+ double lod, f;
+ int level;
+
+ // texels are addressed the way the objects always did
+ if(width <= 1)
+  return (*this)((int)(s * (d_width - 1) + 1), (int)(t * (d_height - 1)) + 1);
+
+ lod = log2(width);
+ level = (int)lod;
+ f = lod - level;
+ if(level >= d_numLevels - 1)
+ {
+  level = d_numLevels - 1;
+  f = 0;
+ }
+
+ const texture_level_t &l = d_levels[level];
+ color = texel(level, (int)(s * (l.width - 1) + 1) - 1,
+               (int)(t * (l.height - 1)));
+ if(f > 0)
+ {
+  const texture_level_t &u = d_levels[level + 1];
+  above = texel(level + 1, (int)(s * (u.width - 1) + 1) - 1,
+                (int)(t * (u.height - 1)));
+  color.r = (1 - f) * color.r + f * above.r;
+  color.g = (1 - f) * color.g + f * above.g;
+  color.b = (1 - f) * color.b + f * above.b;
+ }
+ return color;
+}
+
+
+//==================================================================
+// texture_cache_open
+//==================================================================
+Texture *texture_cache_open(const char *fileName)
+{
+ Texture *texture;
+ map<string, Texture *>::iterator found;
+
+ pthread_mutex_lock(&s_lock);
+ found = s_textures.find(fileName);
+ if(found != s_textures.end())
+ {
+  pthread_mutex_unlock(&s_lock);
+  return found->second;
+ }
+
+ // same values as Pixmap reads
+ for(int v = 0; v < 256; v++)
+  s_scale[v] = v/255.0;
+
+ texture = new Texture;
+ if(texture->open(fileName) != 0)
+ {
+  delete texture;
+  texture = NULL;
+ }
+ else
+  s_textures[fileName] = texture;
+ pthread_mutex_unlock(&s_lock);
+ return texture;
+}
+
+
+//==================================================================
+// texture_cache_open_derivatives
+//==================================================================
+Texture *texture_cache_open_derivatives(const char *fileName)
+{
+ Texture *bumpMap, *derivatives;
+ map<string, Texture *>::iterator found;
+
+ bumpMap = texture_cache_open(fileName);
+ if(bumpMap == NULL)
+  return NULL;
+
+ pthread_mutex_lock(&s_lock);
+ found = s_derivatives.find(fileName);
+ if(found != s_derivatives.end())
+ {
+  pthread_mutex_unlock(&s_lock);
+  return found->second;
+ }
+
+ derivatives = new Texture;
+ if(derivatives->makeDerivatives(*bumpMap) != 0)
+ {
+  delete derivatives;
+  derivatives = NULL;
+ }
+ else
+  s_derivatives[fileName] = derivatives;
+ pthread_mutex_unlock(&s_lock);
+ return derivatives;
+}
+
+
+//==================================================================
+// texture_cache_set_memory
+//==================================================================
+void texture_cache_set_memory(size_t bytes)
+{
+ pthread_mutex_lock(&s_lock);
+ s_maxMemory = bytes;
+ pthread_mutex_unlock(&s_lock);
+}
+
+
+//==================================================================
+// texture_cache_get_memory
+//==================================================================
+size_t texture_cache_get_memory()
+{
+ return s_maxMemory;
+}
+
+
+//==================================================================
+// texture_cache_stats
+//==================================================================
+void texture_cache_stats(unsigned long &loads, unsigned long &evictions,
+                         size_t &memory)
+{
+ pthread_mutex_lock(&s_lock);
+ loads = s_loads;
+ evictions = s_evictions;
+ memory = s_memory;
+ pthread_mutex_unlock(&s_lock);
+}
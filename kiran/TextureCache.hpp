@@ -0,0 +1,183 @@
+//==================================================================
+// TextureCache.hpp  Texture maps shared by all objects. Each PPM file
+//                   is opened once and mapped into memory, and its
+//                   texels are copied into tiles of 8 bit values as
+//                   they are first read. The tiles of all textures
+//                   share a memory limit, past which the oldest tiles
+//                   not read of late are dropped. Tiles in memory
+//                   are read without locking. Filtered
+//                   lookups read from a pyramid of images of half
+//                   the size each (a MIP map), whose tiles are
+//                   averaged from the level below when first read
+//                   and paged like those of the texture itself.
+//                   Bump maps are read as derivative maps, with the
+//                   height and its slopes in 16 bits per channel,
+//                   whose tiles are made from the file when first
+//                   read.
+//==================================================================
+
+#ifndef _TEXTURECACHE_HPP_INCLUDED
+#define _TEXTURECACHE_HPP_INCLUDED
+
+#include <stddef.h>
+#include "Pixmap.hpp"  // rgb_t
+
+#define TEXTURE_TILE_BITS 5                        // tiles of 32 x 32
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_BITS) // texels
+#define TEXTURE_DEFAULT_MEMORY (256 << 20)         // bytes of tiles
+#define TEXTURE_MAX_LEVELS 16                      // levels of a MIP map
+#define TEXTURE_DERIVATIVE_SCALE 32768.0           // 16 bit value of 1.0
+#define TEXTURE_DERIVATIVE_STEP 2                  // texels to neighbors
+
+class Texture;
+
+//==================================================================
+// struct _texture_tile  A block of texels in memory, and its place
+//                       in the list of tiles by load. Dropped tiles
+//                       are kept for reuse, not freed, as a reader
+//                       may still pin one.
+//==================================================================
+typedef struct _texture_tile
+{
+ Texture *texture;            // texture the tile belongs to
+ int level;                   // MIP map level of the tile
+ int index;                   // tile number in the level
+ int pins;                    // readers of the texels now
+ int used;                    // read since the cache last passed it
+ struct _texture_tile *prev;  // newer tile
+ struct _texture_tile *next;  // older tile, or next unused tile
+ unsigned char *texels;       // rows of TEXTURE_TILE_SIZE texels
+}texture_tile_t;
+
+
+//==================================================================
+// struct _texture_level  One image of a MIP map. Level 0 is the
+//                        texture as stored in the file.
+//==================================================================
+typedef struct _texture_level
+{
+ const unsigned char *data;   // rows of texels, NULL if the tiles are
+                              // made, see Texture::getTile
+ int width;
+ int height;
+ int tilesX;                  // tiles in a row of the level
+ texture_tile_t **tiles;      // tiles in memory, NULL for the others.
+                              // Read and set atomically.
+}texture_level_t;
+
+
+//==================================================================
+// class Texture  A texture map read through the cache. Texels are
+//                addressed like Pixmap pixels.
+//==================================================================
+class Texture
+{
+ public:
+  inline int width() const {return d_width;}
+  inline int height() const {return d_height;}
+
+  rgb_t operator()(int x, int y) const;
+   // Color of a texel, loading its tile if it is not in memory.
+   // Safe to call from several threads.
+   //  x, y    Column and row from 1 to width() and height().
+   //  return  The texel, black if x, y is outside the texture.
+
+  rgb_t lookup(double s, double t, double width) const;
+   // Color of the texture over an area, from the MIP map levels
+   // whose texels are closest in size to the area, blended by how
+   // close each one is. An area of one texel or less gives the
+   // same texel as operator(). Safe to call from several threads.
+   //  s, t    Position across and down the texture, from 0 to 1.
+   //  width   Width of the area in texels of the full texture.
+
+ private:
+  friend Texture *texture_cache_open(const char *fileName);
+  friend Texture *texture_cache_open_derivatives(const char *fileName);
+  Texture();
+  ~Texture() {}
+   // Textures are made by texture_cache_open and live until the
+   // program exits.
+
+  int open(const char *fileName);
+   // Map a P5 or P6 file, or decode a P2 or P3 file into memory.
+   //  return  0 on success, else -1
+
+  int makeDerivatives(const Texture &bumpMap);
+   // Make the texture the derivative map of the full size level of
+   // a bump map, see deriveTile.
+   //  return  0 on success, else -1
+
+  int addLevel(const unsigned char *data, int width, int height);
+   // Append a level to the MIP map.
+   //  data    Texels of the level, or NULL to make its tiles from
+   //          the level below.
+   //  return  0 on success, else -1
+
+  void makeLevels();
+   // Add the levels above 0, each half the size of the one below,
+   // down to a single texel.
+
+  void deriveTile(int index, unsigned char *texels) const;
+   // Make the texels of a tile of level 0 of a derivative map from
+   // the file of the bump map. Heights are gray values as the objects
+   // have always read them, from -0.5 to 0.5, at the four texels
+   // TEXTURE_DERIVATIVE_STEP away from each texel.
+
+  void filterTile(int level, int index, unsigned char *texels) const;
+   // Make the texels of a tile above level 0, each the mean of 2 x 2
+   // texels of the level below, whose last odd row or column is
+   // dropped. Call with the cache locked.
+
+  const texture_tile_t *getTile(int level, int index) const;
+   // A tile, read from the level data if it is not in memory, or
+   // made by deriveTile or filterTile for a level without data. Call
+   // with the cache locked.
+
+  rgb_t decode(const texture_tile_t *tile, int x, int y) const;
+   // Color of the texel of a tile at column x and row y of its level
+
+  rgb_t texel(int level, int x, int y) const;
+   // A texel of a level, black outside it. The cache is locked only
+   // if the tile of the texel is not in memory.
+   //  x, y    Column and row from 0.
+
+  int d_width;
+  int d_height;
+  int d_channels;              // 1 for gray, 3 for color
+  int d_depth;                 // bytes of a channel, 2 in derivative maps
+  const Texture *d_source;     // bump map of a derivative map, else NULL
+  int d_numLevels;
+  texture_level_t d_levels[TEXTURE_MAX_LEVELS];
+};
+
+
+//==================================================================
+// Operations of the texture cache
+//==================================================================
+Texture *texture_cache_open(const char *fileName);
+ // The texture of a PPM file. Objects using the same file share one
+ // texture. Only the header is read here, texels are read later.
+ //  return  The texture, or NULL if the file cannot be read.
+
+Texture *texture_cache_open_derivatives(const char *fileName);
+ // The derivative map of the bump map in a PPM file. Texels read
+ // from it hold the mean height of the texels TEXTURE_DERIVATIVE_STEP
+ // left, right, above and below in r, and the change of height per
+ // column between left and right in g and per row between above and
+ // below in b. Objects using the same file share one map.
+ //  return  The map, or NULL if the file cannot be read.
+
+void texture_cache_set_memory(size_t bytes);
+ // Limit the memory used by texels of all textures. The default is
+ // TEXTURE_DEFAULT_MEMORY. At least one tile is always kept.
+
+size_t texture_cache_get_memory();
+ //  return  The limit set by texture_cache_set_memory.
+
+void texture_cache_stats(unsigned long &loads, unsigned long &evictions,
+                         size_t &memory);
+ //  loads      Set to the number of tiles read.
+ //  evictions  Set to the number of tiles dropped to stay in the limit.
+ //  memory     Set to the bytes of tiles now in memory.
+
+#endif // _TEXTURECACHE_HPP_INCLUDED
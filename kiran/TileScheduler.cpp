@@ -0,0 +1,94 @@
+//==================================================================
+// TileScheduler.cpp  Hands out image tiles to render threads.
+//==================================================================
+
+#include "TileScheduler.hpp"
+
+//==================================================================
+// TileScheduler::TileScheduler
+//==================================================================
+TileScheduler::TileScheduler(int width, int height, int tileSize,
+                             int numWorkers)
+{
+ vector<tile_t> tiles;
+ tile_t tile;
+ int begin, end;
+
+ if(numWorkers < 1)
+  numWorkers = 1;
+ if(tileSize < 1)
+  tileSize = 1;
+ d_numWorkers = numWorkers;
+
+ // columns of tiles, in the same order as the serial renderer
+ for(int u = 1; u <= width; u += tileSize)
+ {
+  for(int v = 1; v <= height; v += tileSize)
+  {
+   tile.u0 = u;
+   tile.v0 = v;
+   tile.u1 = (u + tileSize - 1 > width) ? width : u + tileSize - 1;
+   tile.v1 = (v + tileSize - 1 > height) ? height : v + tileSize - 1;
+   tiles.push_back(tile);
+  }
+ }
+ d_numTiles = tiles.size();
+
+ // each worker starts on a contiguous strip of the image
+ d_queues.resize(d_numWorkers);
+ d_locks.resize(d_numWorkers);
+ for(int w = 0; w < d_numWorkers; w++)
+ {
+  pthread_mutex_init(&d_locks[w], NULL);
+  begin = (d_numTiles * w)/d_numWorkers;
+  end = (d_numTiles * (w + 1))/d_numWorkers;
+  for(int i = begin; i < end; i++)
+   d_queues[w].push_back(tiles[i]);
+ }
+}
+
+
+//==================================================================
+// TileScheduler::~TileScheduler
+//==================================================================
+TileScheduler::~TileScheduler()
+{
+ for(int w = 0; w < d_numWorkers; w++)
+  pthread_mutex_destroy(&d_locks[w]);
+}
+
+
+//==================================================================
+// TileScheduler::getTile
+//==================================================================
+bool TileScheduler::getTile(int worker, tile_t &tile)
+{
+ int victim;
+
+ // own queue first
+ pthread_mutex_lock(&d_locks[worker]);
+ if(!d_queues[worker].empty())
+ {
+  tile = d_queues[worker].front();
+  d_queues[worker].pop_front();
+  pthread_mutex_unlock(&d_locks[worker]);
+  return true;
+ }
+ pthread_mutex_unlock(&d_locks[worker]);
+
+ // steal from the far end of somebody else's queue
+ for(int i = 1; i < d_numWorkers; i++)
+ {
+  victim = (worker + i) % d_numWorkers;
+  pthread_mutex_lock(&d_locks[victim]);
+  if(!d_queues[victim].empty())
+  {
+   tile = d_queues[victim].back();
+   d_queues[victim].pop_back();
+   pthread_mutex_unlock(&d_locks[victim]);
+   return true;
+  }
+  pthread_mutex_unlock(&d_locks[victim]);
+ }
+ return false;
+}
@@ -0,0 +1,62 @@
+//==================================================================
+// TileScheduler.hpp  Hands out image tiles to a pool of render
+//                    threads. Each worker owns a queue of tiles and
+//                    steals from the other queues when its own runs
+//                    dry.
+//==================================================================
+
+#ifndef _TILESCHEDULER_HPP_INCLUDED
+#define _TILESCHEDULER_HPP_INCLUDED
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+//==================================================================
+// struct _tile  A rectangular block of pixels. Pixel indices follow
+//               Pixmap convention (1 based), bounds are inclusive.
+//==================================================================
+typedef struct _tile
+{
+ int u0, v0; // first column and row
+ int u1, v1; // last column and row
+}tile_t;
+
+
+//==================================================================
+// class TileScheduler
+//==================================================================
+class TileScheduler
+{
+ public:
+  TileScheduler(int width, int height, int tileSize, int numWorkers);
+   // The constructor. Splits the image into tiles and deals
+   // consecutive runs of tiles to each worker.
+   //  width, height  Image dimensions
+   //  tileSize       Side of a square tile in pixels
+   //  numWorkers     Number of threads that will ask for tiles
+
+  ~TileScheduler();
+   // The destructor.
+
+  bool getTile(int worker, tile_t &tile);
+   // Get the next tile to render. Takes from the front of the
+   // worker's own queue, otherwise steals from the back of
+   // another worker's queue.
+   //  worker  Worker index in the range [0, numWorkers-1]
+   //  tile    Set to the tile to render.
+   //  return  false when there is no work left.
+
+  int getNumTiles() const {return d_numTiles;}
+   //  return  Total number of tiles in the image.
+
+ private:
+  int d_numWorkers;
+  int d_numTiles;
+  vector< deque<tile_t> > d_queues;
+  vector<pthread_mutex_t> d_locks;
+};
+
+#endif // _TILESCHEDULER_HPP_INCLUDED
@@ -0,0 +1,80 @@
+#!/bin/sh
+#==================================================================
+# compare.sh  Compare a bench run with a baseline run. Fails if a 
+#             render got slower than the tolerance allows, or if it
+#             needs more intersection tests per ray than before.
+#             Ray counts and tests per ray do not depend on the 
+#             machine, speeds do, so keep the baseline up to date
+#             with make bench-baseline on the machine you test on.
+#
+#             usage: sh bench/compare.sh baseline latest [tolerance %]
+#==================================================================
+
+if [ $# -lt 2 ]; then
+ echo "usage: $0 baseline latest [tolerance %]" >&2
+ exit 2
+fi
+if [ ! -f "$1" ]; then
+ echo "$0: no baseline $1, make one with make bench-baseline" >&2
+ exit 2
+fi
+
+awk -v tol=${3:-15} '
+function parse(line,    n, i, kv, f)
+{
+ delete rec
+ n = split(line, f, " ")
+ for(i = 1; i <= n; i++)
+ {
+  split(f[i], kv, "=")
+  rec[kv[1]] = kv[2]
+ }
+}
+
+# anything else kiran printed
+!/^scene=/ {
+ next
+}
+
+FNR == NR {
+ parse($0)
+ key = rec["scene"] " " rec["size"]
+ baseSpeed[key] = rec["rays_per_sec"]
+ baseTests[key] = rec["tests_per_ray"]
+ next
+}
+
+{
+ parse($0)
+ key = rec["scene"] " " rec["size"]
+ if(!(key in baseSpeed))
+ {
+  printf("%-24s %-8s %12s %12d     new\n", rec["scene"], rec["size"], "-", 
+         rec["rays_per_sec"])
+  next
+ }
+ change = 100 * (rec["rays_per_sec"] - baseSpeed[key])/baseSpeed[key]
+ status = "ok"
+ if(change < -tol)
+ {
+  status = "SLOWER"
+  failed = 1
+ }
+ if(rec["tests_per_ray"] > baseTests[key] * 1.01)
+ {
+  status = status " MORE-TESTS"
+  failed = 1
+ }
+ printf("%-24s %-8s %12d %12d %+7.1f%% %s\n", rec["scene"], rec["size"], 
+        baseSpeed[key], rec["rays_per_sec"], change, status)
+}
+
+BEGIN {
+ printf("%-24s %-8s %12s %12s %8s\n", "scene", "size", "base rays/s", 
+        "rays/s", "change")
+}
+
+END {
+ exit failed
+}
+' "$1" "$2"
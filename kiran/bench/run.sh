@@ -0,0 +1,18 @@
+#!/bin/sh
+#==================================================================
+# run.sh   Render every scene in scenes/ at each of the given sizes
+#          and print one line of statistics per render. Run from
+#          the kiran directory.
+#
+#          usage: sh bench/run.sh [WIDTHxHEIGHT ...]
+#==================================================================
+
+SIZES=${*:-"160x120 320x240"}
+THREADS=${BENCH_THREADS:-1}
+
+for size in $SIZES; do
+ for scene in scenes/*.env; do
+  out=`./kiran -b -j $THREADS -r $size -i $scene -o /dev/null` || exit 1
+  echo "$out" | grep "^scene="
+ done
+done
@@ -31,27 +31,33 @@ void Box::setVertices(vector3d_t lo, vector3d_t hi)
 }
 
 
-rgb_t Box::getColor(vector3d_t pos) const
+rgb_t Box::getColor(vector3d_t pos, double footprint) const
 {
  return d_color;
 }
 
 
-intercept_t Box::getIntercept(const ray_t &ray) const
+bool Box::getBoundingBox(bbox_t &box) const
 {
- intercept_t intercept;
- intercept.object = NULL;
+ box = bbox_t();
+ bbox_extend(box, d_vl);
+ bbox_extend(box, d_vh);
+ return true;
+}
 
- double tnear, tfar, t1, t2, tmp;
+
+bool Box::getSlabDistance(const ray_t &ray, double &tnear) const
+{
+ double tfar, t1, t2, tmp;
  
  tnear = -1e10;
  tfar = 1e10;
- 
+
  // test for intersection with X planes
  if( (fabs(ray.dir.x) < 1e-6) )
  {
   if( (ray.orig.x < d_vl.x) || (ray.orig.x > d_vh.x) )
-   return intercept;
+   return false;
  }
  else
  {
@@ -67,14 +73,14 @@ intercept_t Box::getIntercept(const ray_t &ray) const
 
   if(t1 > tnear) tnear = t1;
   if(t2 < tfar) tfar = t2;
-  if( (tnear > tfar) || (tfar < 1e-6) ) return intercept;
+  if( (tnear > tfar) || (tfar < 1e-6) ) return false;
  }
 
  // test for intersection with Y planes
  if( (fabs(ray.dir.y) < 1e-6) )
  {
   if( (ray.orig.y < d_vl.y) || (ray.orig.y > d_vh.y) )
-   return intercept;
+   return false;
  }
  else
  {
@@ -90,14 +96,14 @@ intercept_t Box::getIntercept(const ray_t &ray) const
 
   if(t1 > tnear) tnear = t1;
   if(t2 < tfar) tfar = t2;
-  if( (tnear > tfar) || (tfar < 1e-6) ) return intercept;
+  if( (tnear > tfar) || (tfar < 1e-6) ) return false;
  }
 
  // test for intersection with Z planes
  if( (fabs(ray.dir.z) < 1e-6) )
  {
   if( (ray.orig.z < d_vl.z) || (ray.orig.z > d_vh.z) )
-   return intercept;
+   return false;
  }
  else
  {
@@ -113,11 +119,87 @@ intercept_t Box::getIntercept(const ray_t &ray) const
 
   if(t1 > tnear) tnear = t1;
   if(t2 < tfar) tfar = t2;
-  if( (tnear > tfar) || (tfar < 1e-6) ) return intercept;
+  if( (tnear > tfar) || (tfar < 1e-6) ) return false;
+ }
+ 
+ return true;
+}
+
+
+bool Box::isOccluding(const ray_t &ray, double tooClose, 
+                      double tooFar) const
+{
+ double tnear, distance;
+
+ if( !getSlabDistance(ray, tnear) )
+  return false;
+
+ distance = fabs(tnear) * norm(ray.dir);
+ return ( (distance >= tooClose) && (distance <= tooFar) );
+}
+
+
+void Box::getPacketDistances(const ray_packet_t &packet, 
+                             real_t *__restrict__ distance) const
+{
+ real_t tnear, tfar, t1, t2, tmin, tmax, len;
+ bool flat, out;
+
+ // Branch free version of getSlabDistance, one ray per lane. A ray
+ // parallel to a pair of planes gets an empty slab if it starts 
+ // outside them, and an unbounded one otherwise. Since tnear only 
+ // grows and tfar only shrinks, testing them once at the end gives 
+ // the same answer as testing after every slab.
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  flat = fabs(packet.dx[i]) < 1e-6;
+  out = (packet.ox[i] < d_vl.x) | (packet.ox[i] > d_vh.x);
+  t1 = (d_vl.x - packet.ox[i])/(packet.dx[i]);
+  t2 = (d_vh.x - packet.ox[i])/(packet.dx[i]);
+  tnear = flat ? (out ? 1e30 : -1e10) : ((t1 > t2) ? t2 : t1);
+  tfar = flat ? 1e10 : ((t1 > t2) ? t1 : t2);
+  tnear = (tnear > -1e10) ? tnear : -1e10;
+  tfar = (tfar < 1e10) ? tfar : 1e10;
+
+  flat = fabs(packet.dy[i]) < 1e-6;
+  out = (packet.oy[i] < d_vl.y) | (packet.oy[i] > d_vh.y);
+  t1 = (d_vl.y - packet.oy[i])/(packet.dy[i]);
+  t2 = (d_vh.y - packet.oy[i])/(packet.dy[i]);
+  tmin = flat ? (out ? 1e30 : -1e10) : ((t1 > t2) ? t2 : t1);
+  tmax = flat ? 1e10 : ((t1 > t2) ? t1 : t2);
+  tnear = (tmin > tnear) ? tmin : tnear;
+  tfar = (tmax < tfar) ? tmax : tfar;
+
+  flat = fabs(packet.dz[i]) < 1e-6;
+  out = (packet.oz[i] < d_vl.z) | (packet.oz[i] > d_vh.z);
+  t1 = (d_vl.z - packet.oz[i])/(packet.dz[i]);
+  t2 = (d_vh.z - packet.oz[i])/(packet.dz[i]);
+  tmin = flat ? (out ? 1e30 : -1e10) : ((t1 > t2) ? t2 : t1);
+  tmax = flat ? 1e10 : ((t1 > t2) ? t1 : t2);
+  tnear = (tmin > tnear) ? tmin : tnear;
+  tfar = (tmax < tfar) ? tmax : tfar;
+
+  len = sqrt(packet.dx[i] * packet.dx[i] + packet.dy[i] * packet.dy[i] + 
+             packet.dz[i] * packet.dz[i]);
+  distance[i] = ((tnear > tfar) | (tfar < 1e-6)) ? -1 : fabs(tnear) * len;
  }
+}
+
+
+intercept_t Box::getIntercept(const ray_t &ray) const
+{
+ intercept_t intercept;
+ intercept.object = NULL;
+
+ double tnear;
  
+ if( !getSlabDistance(ray, tnear) )
+  return intercept;
+
  intercept.coord = ray.orig + (ray.dir * tnear);
  intercept.incidentRay = ray.dir;
+ intercept.footprint = ray_footprint(ray, tnear);
+ intercept.spread = ray.spread;
  intercept.object = (Object *)this;
 
  if( fabs(intercept.coord.z - d_vh.z) < 1e-6)
@@ -2,226 +2,65 @@
 #include <math.h>
 
 //==================================================================
-// norm
+// ray_packet_load - pack up to KIRAN_PACKET_SIZE rays, returns count
 //==================================================================
-double norm( const vector3d_t &vector )
+int ray_packet_load(ray_packet_t &packet, const ray_t *rays, int count)
 {
- return sqrt(vector.x * vector.x + 
-             vector.y * vector.y + 
-             vector.z * vector.z);
+ int src;
+ if(count > KIRAN_PACKET_SIZE)
+  count = KIRAN_PACKET_SIZE;
+ packet.size = count;
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  src = (i < count) ? i : 0;
+  packet.ox[i] = rays[src].orig.x;
+  packet.oy[i] = rays[src].orig.y;
+  packet.oz[i] = rays[src].orig.z;
+  packet.dx[i] = rays[src].dir.x;
+  packet.dy[i] = rays[src].dir.y;
+  packet.dz[i] = rays[src].dir.z;
+ }
+ return count;
 }
 
 
 //==================================================================
-// normalize
+// ray_packet_get
 //==================================================================
-vector3d_t normalize(const vector3d_t &vector)
+ray_t ray_packet_get(const ray_packet_t &packet, int lane)
 {
- return (vector * (1/norm(vector)));
+ ray_t ray;
+ ray.orig = vector3d_t(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+ ray.dir = vector3d_t(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+ return ray;
 }
 
 
 //==================================================================
-// operator+ for vector3d_t
+// bbox_extend
 //==================================================================
-vector3d_t operator+(const vector3d_t &v1, const vector3d_t &v2)
+void bbox_extend(bbox_t &box, const vector3d_t &point)
 {
- vector3d_t result;
- result.x = v1.x + v2.x;
- result.y = v1.y + v2.y;
- result.z = v1.z + v2.z;
- return result;
+ if(point.x < box.lo.x) box.lo.x = point.x;
+ if(point.y < box.lo.y) box.lo.y = point.y;
+ if(point.z < box.lo.z) box.lo.z = point.z;
+ if(point.x > box.hi.x) box.hi.x = point.x;
+ if(point.y > box.hi.y) box.hi.y = point.y;
+ if(point.z > box.hi.z) box.hi.z = point.z;
 }
 
 
-//==================================================================
-// operator- for vector3d_t
-//==================================================================
-vector3d_t operator-(const vector3d_t &v1, const vector3d_t &v2)
-{
- vector3d_t result;
- result.x = v1.x - v2.x;
- result.y = v1.y - v2.y;
- result.z = v1.z - v2.z;
- return result;
-}
-
-
-//==================================================================
-// operator* for vector3d_t
-//==================================================================
-vector3d_t operator*(const double &scalar, const vector3d_t &vector)
-{
- vector3d_t result;
- result.x = vector.x * scalar;
- result.y = vector.y * scalar;
- result.z = vector.z * scalar;
- return result; 
-}
-
-
-vector3d_t operator*(const vector3d_t &vector, const double &scalar)
-{
- vector3d_t result;
- result.x = vector.x * scalar;
- result.y = vector.y * scalar;
- result.z = vector.z * scalar;
- return result; 
-}
-
-
-//==================================================================
-// dot product between two vector3d_t
-//==================================================================
-double dot(const vector3d_t &v1, const vector3d_t &v2)
+void bbox_extend(bbox_t &box, const bbox_t &other)
 {
- return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z);
+ bbox_extend(box, other.lo);
+ bbox_extend(box, other.hi);
 }
 
 
 //==================================================================
-// cross product between two vector3d_t
+// bbox_center
 //==================================================================
-vector3d_t cross(const vector3d_t &v1, const vector3d_t &v2)
+vector3d_t bbox_center(const bbox_t &box)
 {
- vector3d_t result;
- result.x = v1.y * v2.z - v2.y * v1.z;
- result.y = v2.x * v1.z - v1.x * v2.z;
- result.z = v1.x * v2.y - v2.x * v1.y;
- return result;
+ return 0.5 * (box.lo + box.hi);
 }
-
-
-//==================================================================
-// operator* for transform_t
-//==================================================================
-vector3d_t operator*(const transform_t &t, const vector3d_t &v)
-{
- vector3d_t r;
- r.x = t.t[0][0] * v.x + t.t[0][1] * v.y + t.t[0][2] * v.z + t.t[0][3];
- r.y = t.t[1][0] * v.x + t.t[1][1] * v.y + t.t[1][2] * v.z + t.t[1][3];
- r.z = t.t[2][0] * v.x + t.t[2][1] * v.y + t.t[2][2] * v.z + t.t[2][3];
- return r;
-}
-
-
-transform_t operator*(const transform_t &t1, const transform_t &t2)
-{
- transform_t t;
- for(int i = 0; i < 4; i++)
-  for(int j = 0; j < 4; j++)
-  {
-   t.t[i][j] = 0;
-   for(int k = 0; k < 4; k++)
-    t.t[i][j] += (t1.t[i][k] * t2.t[k][j]);
-  }
- return t;
-}
-
-
-//==================================================================
-// set_rotation
-//==================================================================
-transform_t set_rotation(double rx, double ry, double rz)
-{
- transform_t t(0, 0, 0, rx, ry, rz);
- return t;
-}
-
-
-//==================================================================
-// set_translation
-//==================================================================
-transform_t set_translation(double x, double y, double z)
-{
- transform_t t(x, y, z, 0, 0, 0);
- return t;
-}
-
-
-//==================================================================
-// set_rotation_about
-//==================================================================
-transform_t set_rotation_about(vector3d_t u, double theta)
-{
- transform_t t;
- double ct, st;
- double vt;
-
- ct = cos(theta);
- st = sin(theta);
- vt = 1 - ct;
- 
- t.t[0][0] = u.x * u.x * vt + ct;
- t.t[0][1] = u.x * u.y * vt - u.z * st;
- t.t[0][2] = u.x * u.z * vt + u.y * st;
- t.t[1][0] = u.x * u.y * vt + u.z * st;
- t.t[1][1] = u.y * u.y * vt + ct;
- t.t[1][2] = u.y * u.z * vt - u.x * st;
- t.t[2][0] = u.x * u.z * vt - u.y * st;
- t.t[2][1] = u.y * u.z * vt + u.x * st;
- t.t[2][2] = u.z * u.z * vt + ct;
- 
- return t;
-}
-
-
-//==================================================================
-// inverse
-//==================================================================
-transform_t inverse(transform_t t)
-{
- transform_t it;
- vector3d_t c1(t.t[0][0], t.t[1][0], t.t[2][0]), 
-            c2(t.t[0][1], t.t[1][1], t.t[2][1]), 
-            c3(t.t[0][2], t.t[1][2], t.t[2][2]);
- vector3d_t p(t.t[0][3], t.t[1][3], t.t[2][3]);
- 
- it.t[0][0] = t.t[0][0];
- it.t[0][1] = t.t[1][0];
- it.t[0][2] = t.t[2][0];
-
- it.t[1][0] = t.t[0][1];
- it.t[1][1] = t.t[1][1];
- it.t[1][2] = t.t[2][1];
- 
- it.t[2][0] = t.t[0][2];
- it.t[2][1] = t.t[1][2];
- it.t[2][2] = t.t[2][2];
- 
- it.t[0][3] = -dot(p, c1);
- it.t[1][3] = -dot(p, c2);
- it.t[2][3] = -dot(p, c3);
-
- it.t[3][3] = 1;
- 
- return it;
-}
-
-
-//==================================================================
-// get_rotation
-//==================================================================
-void get_rotation(const transform_t &t, double &rx, double &ry, double &rz)
-{
- ry = -asin(t.t[2][0]);
- rx = asin((t.t[2][1])/cos(ry));
- rz = asin((t.t[1][0])/cos(ry));
-}
-
-
-//==================================================================
-// get_translation
-//==================================================================
-vector3d_t get_translation(transform_t t)
-{
- vector3d_t v;
- 
- v.x = t.t[0][3];
- v.y = t.t[1][3];
- v.z = t.t[2][3];
- 
- return v;
-}
-
-
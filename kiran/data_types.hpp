@@ -12,78 +12,67 @@
 #include <iostream>
 #include <string>
 #include <math.h>
+#include <vector>
+#include "vecmath.hpp"
 
 using namespace std;
 
 //==================================================================
-// struct _vector3d  A simple structure for 3D vectors.
+// Vectors and transforms in the precision chosen in vecmath.hpp
 //==================================================================
-typedef struct _vector3d
-{
- _vector3d(double X = 0, double Y = 0, double Z = 0) : x(X), y(Y), z(Z) {};
- double x;
- double y;
- double z;
-}vector3d_t;
+typedef _vector3d<real_t> vector3d_t;
+typedef _transform<real_t> transform_t;
 
 
 //==================================================================
-// struct _transform  Homogeneous transformation matrix
-//==================================================================
-typedef struct _transform
-{
- double t[4][4];
- _transform(double x = 0, double y = 0, double z = 0, double rx = 0, 
-            double ry = 0, double rz = 0) 
- {
-  double cx, cy, cz, sx, sy, sz;
-  cx = cos(rx); cy = cos(ry); cz = cos(rz);
-  sx = sin(rx); sy = sin(ry); sz = sin(rz);
-  
-  t[0][3] = x;
-  t[1][3] = y;
-  t[2][3] = z;
-  t[3][3] = 1;
-  
-  t[0][0] = cz * cy;
-  t[0][1] = cz * sy * sx - sz * cx;
-  t[0][2] = sz * sx + cz * sy * cx;
-
-  t[1][0] = sz * cy;
-  t[1][1] = sz * sy * sx + cz * cx;
-  t[1][2] = -cz * sx + sz * sy * cx;
-
-  t[2][0] = -sy;
-  t[2][1] = cy * sx;
-  t[2][2] = cy * cx;
-  
-  t[3][0] = 0.0;
-  t[3][1] = 0.0;
-  t[3][2] = 0.0;
- }
-}transform_t;
-
-
-//==================================================================
-// struct _ray  A simple structure for a ray of light.
+// struct _ray  A simple structure for a ray of light. The ray
+//              stands for a cone around it, as wide as the part of
+//              the scene one pixel sees, so that textures can be
+//              filtered over that area. A default ray is thin.
 //==================================================================
 typedef struct _ray
 {
+ _ray() : width(0), spread(0) {};
  vector3d_t orig;  // ray origin
- vector3d_t dir;   // ray direction
+ vector3d_t dir;   // ray direction, of unit length
+ real_t width;     // width of the cone at orig
+ real_t spread;    // growth of the width per unit distance
 }ray_t;
 
 
 //==================================================================
-// struct _ray_list  A linked list of light rays.
+// struct _ray_packet  A bundle of rays stored as separate arrays of 
+//                     coordinates, so that intersection kernels can
+//                     work on several rays per SIMD instruction. 
+//                     Unused lanes hold copies of the first ray.
+//==================================================================
+#ifndef KIRAN_PACKET_SIZE
+#define KIRAN_PACKET_SIZE 8 // rays in a packet, 4, 8 or 16
+#endif
+
+typedef struct _ray_packet
+{
+ real_t ox[KIRAN_PACKET_SIZE] __attribute__((aligned(64))); // origins
+ real_t oy[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t oz[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t dx[KIRAN_PACKET_SIZE] __attribute__((aligned(64))); // directions
+ real_t dy[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ real_t dz[KIRAN_PACKET_SIZE] __attribute__((aligned(64)));
+ int size; // number of rays in use
+}ray_packet_t;
+
+
+//==================================================================
+// struct _bbox  An axis aligned bounding box in world coordinates.
+//               A default constructed box is empty.
 //==================================================================
-typedef struct _ray_list
+typedef struct _bbox
 {
- _ray_list(_ray_list *n = NULL)
-          : nxt(n) {};
- _ray_list *nxt;
- ray_t ray;
-}ray_list_t;
+ _bbox() : lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30) {};
+ vector3d_t lo;  // minimum corner
+ vector3d_t hi;  // maximum corner
+}bbox_t;
+
 
 //==================================================================
 // struct _intercept  A structure to hold interception data 
@@ -96,33 +85,48 @@ typedef struct _intercept
  vector3d_t normal;         // surface normal
  vector3d_t incidentRay;    // direction from eye-point to intercept
  Object *object;            // object intercepted by ray
+ real_t footprint;          // width of the ray cone at coord
+ real_t spread;             // spread of the ray cone
 }intercept_t;
 
 
 //==================================================================
-// Operators for _vector3d
+// Operations on _ray
 //==================================================================
-double norm(const vector3d_t &vector);
-vector3d_t normalize( const vector3d_t &vector);
-vector3d_t operator+(const vector3d_t &v1, const vector3d_t &v2);
-vector3d_t operator-(const vector3d_t &v1, const vector3d_t &v2);
-vector3d_t operator*(const double &scalar, const vector3d_t &vector);
-vector3d_t operator*(const vector3d_t &vector, const double &scalar);
-double dot(const vector3d_t &v1, const vector3d_t &v2);
-vector3d_t cross(const vector3d_t &v1, const vector3d_t &v2);
+inline real_t ray_footprint(const ray_t &ray, double distance)
+{
+ return ray.width + ray.spread * distance;
+}
 
 
 //==================================================================
-// Operators for _transform
+// Operations on _ray_packet
 //==================================================================
-vector3d_t operator*(const transform_t &t, const vector3d_t &v);
-transform_t operator*(const transform_t &t1, const transform_t &t2);
-transform_t set_translation(double x, double y, double z);
-transform_t set_rotation(double rx, double ry, double rz);
-transform_t set_rotation_about(vector3d_t axis, double angle);
-void get_rotation(const transform_t &t, double &rx, double &ry, double &rz);
-vector3d_t get_translation(transform_t t);
-transform_t inverse(transform_t t);
+int ray_packet_load(ray_packet_t &packet, const ray_t *rays, int count);
+ray_t ray_packet_get(const ray_packet_t &packet, int lane);
+
+
+//==================================================================
+// Operations on _bbox
+//==================================================================
+void bbox_extend(bbox_t &box, const vector3d_t &point);
+void bbox_extend(bbox_t &box, const bbox_t &other);
+vector3d_t bbox_center(const bbox_t &box);
+
+
+//==================================================================
+// Construction of transform_t, see vecmath.hpp for the operators
+//==================================================================
+inline transform_t set_translation(double x, double y, double z)
+{
+ return transform_t(x, y, z, 0, 0, 0);
+}
+
+
+inline transform_t set_rotation(double rx, double ry, double rz)
+{
+ return transform_t(0, 0, 0, rx, ry, rz);
+}
 
 
 #endif // ifndef _DATA_TYPES_HPP_INCLUDED
@@ -6,43 +6,47 @@
 //==================================================================
 
 #include "SceneReader.hpp"
+#include "BVH.hpp"
+#include "TileScheduler.hpp"
+#include "RenderStats.hpp"
+#include "TextureCache.hpp"
 
 #include <signal.h>
+#include <pthread.h>
 #include <vector>
 #include <unistd.h>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
 
 using namespace std;
 
+#define KIRAN_TILE_SIZE 16 // side of a square image tile in pixels
+#define KIRAN_AA_MAX_DEPTH 1 // subdivisions of a pixel in adaptive AA
+
 //==================================================================
 // kiran_find_intercept
 //==================================================================
-intercept_t kiran_find_intercept(ray_t ray, vector<Object *> &sceneList, 
+intercept_t kiran_find_intercept(ray_t ray, const BVH &scene, 
                                  double tooClose, double tooFar)
 {
- intercept_t visibleIntercept, intercept;
- double distance;
- visibleIntercept.coord = vector3d_t(tooFar,tooFar,tooFar);
- visibleIntercept.object = NULL;
+ intercept_t intercept;
+ KIRAN_STAT(render_stats().interceptQueries++;
+            double startTime = render_stats_time());
+ intercept = scene.getIntercept(ray, tooClose, tooFar);
+ KIRAN_STAT(render_stats().interceptTime += render_stats_time() - startTime);
+ return intercept;
+}
 
- for(unsigned int o = 0; o < sceneList.size(); o++)
- {
-  intercept = sceneList[o]->getIntercept(ray);
 
-  // did we hit something
-  if( intercept.object == NULL )
-   continue;
-  
-  // check if intercept is too near or too far
-  distance = norm(intercept.coord - ray.orig);
-  if( (distance < tooClose) || (distance > tooFar) )
-   continue;
-    
-  // check if smallest intercept yet
-  if( distance < norm(visibleIntercept.coord - ray.orig) )
-   visibleIntercept = intercept;
- }
- return visibleIntercept;
+//==================================================================
+// kiran_is_occluded - any-hit query for shadow rays
+//==================================================================
+bool kiran_is_occluded(ray_t ray, const BVH &scene, double tooClose, 
+                       double tooFar, double &transmittance)
+{
+ return scene.isOccluded(ray, tooClose, tooFar, transmittance);
 }
 
 
@@ -50,14 +54,22 @@ intercept_t kiran_find_intercept(ray_t ray, vector<Object *> &sceneList,
 // kiran_do_lights - diffuse and specular lighting
 //==================================================================
 rgb_t kiran_do_lights(intercept_t intercept, vector< Light *> &lightList, 
-                      vector<Object *> &sceneList, double tooClose, int numShadowRays)
+                      const BVH &scene, double tooClose, int numShadowRays,
+                      unsigned int *seed)
 {
  vector3d_t randVec = vector3d_t(0,0,0);
  int count;
  rgb_t color, directColor;
  vector3d_t vectorToLight;
  ray_t ray;
- intercept_t interceptBeforelight;
+ double transmittance;
+ ray_t rays[KIRAN_PACKET_SIZE];
+ ray_packet_t packet;
+ real_t tooFar[KIRAN_PACKET_SIZE];
+ double transmittances[KIRAN_PACKET_SIZE];
+ bool blocked[KIRAN_PACKET_SIZE];
+ int numRays;
+ KIRAN_STAT(double startTime = render_stats_time());
  
  for(unsigned int l = 0; l < lightList.size(); l++)
  {
@@ -65,54 +77,86 @@ rgb_t kiran_do_lights(intercept_t intercept, vector< Light *> &lightList,
   ray.orig = intercept.coord;
   directColor = lightList[l]->calculateLight(intercept);
   directColor = directColor * (1/(double)numShadowRays);
+
+  // Soft shadow rays all start at the intercept and end near the 
+  // light, so they are traced as packets.
+  if(numShadowRays > 1)
+  {
+   while(count < numShadowRays)
+   {
+    for(numRays = 0; numRays < KIRAN_PACKET_SIZE && count < numShadowRays;
+        numRays++, count++)
+    {
+     if(count)
+      randVec = vector3d_t(0.05 * (float)rand_r(seed)/(float)RAND_MAX,
+                           0.05 * (float)rand_r(seed)/(float)RAND_MAX,
+                           0.05 * (float)rand_r(seed)/(float)RAND_MAX);
+     vectorToLight = lightList[l]->getPosition() + randVec - ray.orig;
+     rays[numRays].orig = ray.orig;
+     rays[numRays].dir = normalize(vectorToLight);
+     tooFar[numRays] = norm(vectorToLight);
+    }
+    render_stats().shadowRays += numRays;
+    ray_packet_load(packet, rays, numRays);
+    scene.getPacketOcclusion(packet, tooClose, tooFar, transmittances, 
+                             blocked);
+    for(int i = 0; i < numRays; i++)
+     if( !blocked[i] )
+      color = color + (directColor * transmittances[i]);
+   }
+   continue;
+  }
+
   do
   {
    if(count)
-    randVec = vector3d_t(0.05 * (float)rand()/(float)RAND_MAX,
-                         0.05 * (float)rand()/(float)RAND_MAX,
-                         0.05 * (float)rand()/(float)RAND_MAX);
+    randVec = vector3d_t(0.05 * (float)rand_r(seed)/(float)RAND_MAX,
+                         0.05 * (float)rand_r(seed)/(float)RAND_MAX,
+                         0.05 * (float)rand_r(seed)/(float)RAND_MAX);
    vectorToLight = lightList[l]->getPosition() + randVec - ray.orig;
    ray.dir = normalize(vectorToLight);
+   render_stats().shadowRays++;
 
-   interceptBeforelight = kiran_find_intercept(ray, sceneList, tooClose,
-                          norm(vectorToLight));
-
-   if(interceptBeforelight.object == NULL) // light not occluded by objects 
-    color = color + directColor;
-   else
-    color = color + (directColor * interceptBeforelight.object->getTransmittivity());
+   // light reaches through transparent objects, attenuated by each
+   if( !kiran_is_occluded(ray, scene, tooClose, norm(vectorToLight), 
+                          transmittance) )
+    color = color + (directColor * transmittance);
    count++;
   }while(count < numShadowRays);
  }
+ KIRAN_STAT(render_stats().lightTime += render_stats_time() - startTime);
  return color;
 }
 
 
-//==================================================================
-// kiran_recursive_trace
-//==================================================================
 int kiran_recursive_trace(ray_t ray, vector< Light *> &lightList,
-                          Light *ambient, vector<Object *> &sceneList, 
+                          Light *ambient, const BVH &scene, 
                           double tooClose, double tooFar, int maxDepth,
-                          int depth, rgb_t &color, int numShadowRays)
+                          int depth, rgb_t &color, int numShadowRays,
+                          unsigned int *seed);
+
+//==================================================================
+// kiran_shade - color at an intercept, tracing secondary rays
+//==================================================================
+int kiran_shade(intercept_t intercept, vector< Light *> &lightList,
+                Light *ambient, const BVH &scene, 
+                double tooClose, double tooFar, int maxDepth,
+                int depth, rgb_t &color, int numShadowRays,
+                unsigned int *seed)
 {
  int newDepth;
  ray_t newRay;
- intercept_t intercept;
  rgb_t localColor;
  rgb_t reflColor = color; // set init color to background
  rgb_t refrColor = color;
  double kr, kt;
- static double mui = 1;
+ double mui = 1; // rays always start out in air
  double mur; //refractive indices of incident and refracted rays
  double mr;
  newDepth = depth+1;
 
- intercept = kiran_find_intercept(ray, sceneList, tooClose, tooFar);
- if(intercept.object == NULL)
-  return newDepth;
-
- localColor = kiran_do_lights(intercept, lightList, sceneList, tooClose, numShadowRays);
+ localColor = kiran_do_lights(intercept, lightList, scene, tooClose, 
+                              numShadowRays, seed);
  if(ambient != NULL)
   localColor = localColor + ambient->calculateLight(intercept);
 
@@ -124,14 +168,19 @@ int kiran_recursive_trace(ray_t ray, vector< Light *> &lightList,
  else
  {
   // Estimate contribution from reflections
+  // secondary rays go on with the cone of the ray that hit
+  newRay.width = intercept.footprint;
+  newRay.spread = intercept.spread;
+
   if(intercept.object->getReflectivity() > 0)
   {
    newRay.orig = intercept.coord;
    newRay.dir = normalize(intercept.incidentRay - 2 * 
                            dot(intercept.incidentRay, intercept.normal) 
                            * intercept.normal);
-   kiran_recursive_trace(newRay, lightList, ambient, sceneList, tooClose, tooFar, 
-                           maxDepth, newDepth, reflColor, numShadowRays);
+   render_stats().secondaryRays++;
+   kiran_recursive_trace(newRay, lightList, ambient, scene, tooClose, tooFar, 
+                           maxDepth, newDepth, reflColor, numShadowRays, seed);
   }
 
   // Estimate contribution from refractions
@@ -154,8 +203,9 @@ int kiran_recursive_trace(ray_t ray, vector< Light *> &lightList,
     newRay.dir = mr * intercept.incidentRay + intercept.normal
                  * (mr * fabs(iDotN) - sqrt(cosr));
     newRay.dir = normalize(newRay.dir);
-    kiran_recursive_trace(newRay, lightList, ambient, sceneList, tooClose, tooFar, 
-                                maxDepth, newDepth, refrColor, numShadowRays);
+    render_stats().secondaryRays++;
+    kiran_recursive_trace(newRay, lightList, ambient, scene, tooClose, tooFar, 
+                                maxDepth, newDepth, refrColor, numShadowRays, seed);
     //mui = mur;
    }
   }
@@ -167,46 +217,497 @@ int kiran_recursive_trace(ray_t ray, vector< Light *> &lightList,
 }
 
 
+//==================================================================
+// kiran_recursive_trace
+//==================================================================
+int kiran_recursive_trace(ray_t ray, vector< Light *> &lightList,
+                          Light *ambient, const BVH &scene, 
+                          double tooClose, double tooFar, int maxDepth,
+                          int depth, rgb_t &color, int numShadowRays,
+                          unsigned int *seed)
+{
+ intercept_t intercept;
+
+ KIRAN_STAT(render_stats().depthCount[(depth < RENDER_STATS_MAX_DEPTH) ? 
+                                      depth : RENDER_STATS_MAX_DEPTH-1]++);
+ intercept = kiran_find_intercept(ray, scene, tooClose, tooFar);
+ if(intercept.object == NULL)
+  return depth+1;
+
+ return kiran_shade(intercept, lightList, ambient, scene, tooClose, tooFar,
+                    maxDepth, depth, color, numShadowRays, seed);
+}
+
+
 //==================================================================
 // kiran_trace
 //==================================================================
-rgb_t kiran_trace(ray_list_t *rayList, vector< Light *> &lightList,
-                  Light *ambient, vector<Object *> &sceneList, rgb_t bkColor,
-                  double tooClose, double tooFar, int maxDepth, int depth, 
-                  int numShadowRays)
+rgb_t kiran_trace(const ray_t *rays, Object *const *hits, int count,
+                  vector< Light *> &lightList, Light *ambient, 
+                  const BVH &scene, rgb_t bkColor, double tooClose, 
+                  double tooFar, int maxDepth, int depth, 
+                  int numShadowRays, unsigned int *seed)
 {
  rgb_t color, tmpColor;
+ intercept_t intercept;
  tmpColor = bkColor;
  double numRays = 0;
- ray_list_t *tmpPtr;
  
- tmpPtr = rayList;
- while(tmpPtr != NULL)
+ render_stats().primaryRays += count;
+ for(int i = 0; i < count; i++)
  {
   numRays++;
-  kiran_recursive_trace(tmpPtr->ray, lightList, ambient, sceneList, 
+
+  // hits found by a packet trace only need the full intercept
+  if(hits == NULL)
+   kiran_recursive_trace(rays[i], lightList, ambient, scene, 
+                           tooClose, tooFar, maxDepth, 
+                           depth, tmpColor, numShadowRays, seed);
+  else
+  {
+   KIRAN_STAT(render_stats().depthCount[(depth < RENDER_STATS_MAX_DEPTH) ? 
+                                        depth : RENDER_STATS_MAX_DEPTH-1]++);
+  }
+  if(hits != NULL && hits[i] != NULL)
+  {
+   // in single precision the packet kernels can report a grazing hit
+   // that getIntercept misses, such rays are traced again on their own
+   intercept = hits[i]->getIntercept(rays[i]);
+   if(intercept.object != NULL)
+    kiran_shade(intercept, lightList, ambient, scene, tooClose, tooFar, 
+                maxDepth, depth, tmpColor, numShadowRays, seed);
+   else
+    kiran_recursive_trace(rays[i], lightList, ambient, scene, 
                           tooClose, tooFar, maxDepth, 
-                          depth, tmpColor, numShadowRays);
+                          depth, tmpColor, numShadowRays, seed);
+  }
 
   color.r = (1.0/numRays)*((numRays-1) * color.r + tmpColor.r);
   color.g = (1.0/numRays)*((numRays-1) * color.g + tmpColor.g);
   color.b = (1.0/numRays)*((numRays-1) * color.b + tmpColor.b);
-
-  tmpPtr = tmpPtr->nxt; 
  }
  
- // release rays from memory
- while(rayList != NULL)
+ return color;
+}
+
+
+//==================================================================
+// struct _render_job  Everything the render threads share. All of
+//                     it is read only while rendering, except the
+//                     output image, where every pixel is written by
+//                     exactly one thread, and the progress count.
+//==================================================================
+typedef struct _render_job
+{
+ SceneReader *sceneReader;
+ Camera *camera;
+ const BVH *scene;
+ vector<Light *> *lightList;
+ Light *ambient;
+ Pixmap *outputImage;
+ TileScheduler *scheduler;
+ int imageWidth;
+ int imageHeight;
+ int maxDepth;
+ int numShadowRays;
+ bool antiAlias;
+ bool adaptiveAntiAlias; // supersample only where the contrast is high
+ double aaThreshold;     // contrast that triggers supersampling
+ vector<rgb_t> *centers; // one sample per pixel, from the first pass
+ int pass;               // 0 traces pixel centers, 1 refines edges
+ int numPasses;
+ bool usePackets; // trace camera rays in packets
+ bool quiet;      // no progress report
+ int tilesDone;
+ render_stats_t stats; // totals from finished threads
+ pthread_mutex_t progressLock;
+}render_job_t;
+
+
+//==================================================================
+// struct _render_sample  An image location to trace
+//==================================================================
+typedef struct _render_sample
+{
+ double u, v;  // position on the image plane
+ int col, row; // pixel it belongs to
+ rgb_t color;  // result
+}render_sample_t;
+
+
+//==================================================================
+// struct _render_worker  Arguments to a render thread
+//==================================================================
+typedef struct _render_worker
+{
+ render_job_t *job;
+ int id;
+ pthread_t thread;
+ vector<ray_t> rays;              // camera rays, reused for every sample
+ vector<render_sample_t> samples; // a column of samples in a tile
+ vector<ray_t> packetRays;        // camera rays for all the samples
+ vector<int> firstRay;            // where each sample's rays start
+ vector<Object *> hits;           // closest object for each ray
+ vector<tile_t> edges;            // pixels to refine in adaptive AA
+ vector<rgb_t> corners;           // their corner samples
+ vector<bool> hasCorner;
+ vector<int> cornerIndex;
+}render_worker_t;
+
+
+//==================================================================
+// kiran_add_sample
+//==================================================================
+void kiran_add_sample(render_worker_t *worker, double u, double v, 
+                      int col, int row)
+{
+ render_sample_t sample;
+ sample.u = u;
+ sample.v = v;
+ sample.col = col;
+ sample.row = row;
+ worker->samples.push_back(sample);
+}
+
+
+//==================================================================
+// kiran_sample_seed
+//==================================================================
+unsigned int kiran_sample_seed(render_worker_t *worker, 
+                               const render_sample_t &sample)
+{
+ // The random sequence is seeded from the position on the half pixel 
+ // grid, so that the image does not depend on how the work was split
+ // between threads.
+ return (unsigned int)(2 * sample.v + 1) * 
+        (2 * worker->job->imageWidth + 3) + (unsigned int)(2 * sample.u + 1);
+}
+
+
+//==================================================================
+// kiran_sample - trace the rays for each of the worker's samples
+//==================================================================
+void kiran_sample(render_worker_t *worker)
+{
+ render_job_t *job = worker->job;
+ rgb_t bkColor;
+ unsigned int seed;
+ int count;
+ ray_packet_t packet;
+ Object *objects[KIRAN_PACKET_SIZE];
+ real_t distance[KIRAN_PACKET_SIZE];
+ double tooFar = job->camera->getFarClippingDistance();
+
+ if(!job->usePackets)
+ {
+  for(unsigned int s = 0; s < worker->samples.size(); s++)
+  {
+   render_sample_t &sample = worker->samples[s];
+   seed = kiran_sample_seed(worker, sample);
+   count = job->camera->getRays(sample.u, sample.v, worker->rays);
+   if(count == 0)
+   {
+    sample.color = rgb_t();
+    continue;
+   }
+   bkColor = job->sceneReader->getBackGroundColor(sample.col, sample.row);
+   sample.color = kiran_trace(&worker->rays[0], NULL, count, 
+                              *job->lightList, job->ambient, *job->scene,
+                              bkColor, 1e-6, tooFar, job->maxDepth, 0, 
+                              job->numShadowRays, &seed);
+  }
+  return;
+ }
+
+ // Neighbouring samples have nearly parallel camera rays. Find the 
+ // closest objects for all of them a packet at a time, then shade 
+ // each sample in order, just as the scalar path does.
+ worker->packetRays.clear();
+ worker->firstRay.clear();
+ for(unsigned int s = 0; s < worker->samples.size(); s++)
  {
-  tmpPtr = rayList; 
-  rayList = rayList->nxt;
-  delete tmpPtr;
+  worker->firstRay.push_back(worker->packetRays.size());
+  job->camera->getRays(worker->samples[s].u, worker->samples[s].v, 
+                       worker->rays);
+  worker->packetRays.insert(worker->packetRays.end(), worker->rays.begin(),
+                            worker->rays.end());
  }
- 
+ worker->firstRay.push_back(worker->packetRays.size());
+ worker->hits.resize(worker->packetRays.size());
+
+ for(unsigned int r = 0; r < worker->packetRays.size(); r += count)
+ {
+  count = ray_packet_load(packet, &worker->packetRays[r], 
+                          worker->packetRays.size() - r);
+  KIRAN_STAT(render_stats().packetQueries++;
+             double startTime = render_stats_time());
+  job->scene->getPacketIntercepts(packet, 1e-6, tooFar, objects, distance);
+  KIRAN_STAT(render_stats().interceptTime += render_stats_time() - startTime);
+  for(int i = 0; i < count; i++)
+   worker->hits[r + i] = objects[i];
+ }
+
+ for(unsigned int s = 0; s < worker->samples.size(); s++)
+ {
+  render_sample_t &sample = worker->samples[s];
+  seed = kiran_sample_seed(worker, sample);
+  count = worker->firstRay[s+1] - worker->firstRay[s];
+  if(count == 0)
+  {
+   sample.color = rgb_t();
+   continue;
+  }
+  bkColor = job->sceneReader->getBackGroundColor(sample.col, sample.row);
+  sample.color = kiran_trace(&worker->packetRays[worker->firstRay[s]], 
+                             &worker->hits[worker->firstRay[s]], count,
+                             *job->lightList, job->ambient, *job->scene,
+                             bkColor, 1e-6, tooFar, job->maxDepth, 0, 
+                             job->numShadowRays, &seed);
+ }
+}
+
+
+//==================================================================
+// kiran_contrast - largest difference in any color channel
+//==================================================================
+double kiran_contrast(const rgb_t &a, const rgb_t &b)
+{
+ double contrast = fabs(a.r - b.r);
+ if(fabs(a.g - b.g) > contrast) contrast = fabs(a.g - b.g);
+ if(fabs(a.b - b.b) > contrast) contrast = fabs(a.b - b.b);
+ return contrast;
+}
+
+
+//==================================================================
+// kiran_adaptive_sample - color of a square of the image plane
+//==================================================================
+rgb_t kiran_adaptive_sample(render_worker_t *worker, double u, double v,
+                            double size, const rgb_t &center, 
+                            const rgb_t *corners, int col, int row, 
+                            int depth)
+{
+ render_job_t *job = worker->job;
+ rgb_t mid[8], quad[4], color;
+ double h = size/2;
+ bool refine = false;
+
+ // Corners are in the order (-,-), (+,-), (-,+), (+,+). A square 
+ // that is not split is weighted as in regular anti-aliasing.
+ for(int i = 0; i < 4; i++)
+  if(kiran_contrast(corners[i], center) > job->aaThreshold)
+   refine = true;
+ if(!refine || depth >= KIRAN_AA_MAX_DEPTH)
+  return 0.5 * center + 0.125 * corners[0] + 0.125 * corners[1] + 
+         0.125 * corners[2] + 0.125 * corners[3];
+
+ // An edge runs through the square, split it in four. The quarters 
+ // share the corners and center of this square, so only the middle 
+ // of each side and the center of each quarter are new.
+ worker->samples.clear();
+ kiran_add_sample(worker, u, v-h, col, row);
+ kiran_add_sample(worker, u-h, v, col, row);
+ kiran_add_sample(worker, u+h, v, col, row);
+ kiran_add_sample(worker, u, v+h, col, row);
+ kiran_add_sample(worker, u-h/2, v-h/2, col, row);
+ kiran_add_sample(worker, u+h/2, v-h/2, col, row);
+ kiran_add_sample(worker, u-h/2, v+h/2, col, row);
+ kiran_add_sample(worker, u+h/2, v+h/2, col, row);
+ kiran_sample(worker);
+ for(int i = 0; i < 8; i++)
+  mid[i] = worker->samples[i].color;
+
+ quad[0] = corners[0]; quad[1] = mid[0]; quad[2] = mid[1]; quad[3] = center;
+ color = 0.25 * kiran_adaptive_sample(worker, u-h/2, v-h/2, h, mid[4], 
+                                      quad, col, row, depth+1);
+ quad[0] = mid[0]; quad[1] = corners[1]; quad[2] = center; quad[3] = mid[2];
+ color = color + 0.25 * kiran_adaptive_sample(worker, u+h/2, v-h/2, h, 
+                                      mid[5], quad, col, row, depth+1);
+ quad[0] = mid[1]; quad[1] = center; quad[2] = corners[2]; quad[3] = mid[3];
+ color = color + 0.25 * kiran_adaptive_sample(worker, u-h/2, v+h/2, h, 
+                                      mid[6], quad, col, row, depth+1);
+ quad[0] = center; quad[1] = mid[2]; quad[2] = mid[3]; quad[3] = corners[3];
+ color = color + 0.25 * kiran_adaptive_sample(worker, u+h/2, v+h/2, h, 
+                                      mid[7], quad, col, row, depth+1);
  return color;
 }
 
 
+//==================================================================
+// kiran_render_tile_adaptive - second pass of adaptive AA, refines
+//                              pixels that differ from a neighbour
+//==================================================================
+void kiran_render_tile_adaptive(render_worker_t *worker, const tile_t &tile)
+{
+ render_job_t *job = worker->job;
+ vector<rgb_t> &centers = *job->centers;
+ int width = job->imageWidth;
+ int rows = tile.v1 - tile.v0 + 2; // corners in a column of the tile
+ rgb_t center, corners[4];
+ double contrast;
+ int k;
+
+ // pixels whose center sample differs from a neighbour's
+ worker->edges.clear();
+ for(int u = tile.u0; u <= tile.u1; u++)
+ {
+  for(int v = tile.v0; v <= tile.v1; v++)
+  {
+   center = centers[(v-1) * width + (u-1)];
+   contrast = 0;
+   if(u > 1)
+    contrast = fmax(contrast, kiran_contrast(center, 
+                    centers[(v-1) * width + (u-2)]));
+   if(u < width)
+    contrast = fmax(contrast, kiran_contrast(center, 
+                    centers[(v-1) * width + u]));
+   if(v > 1)
+    contrast = fmax(contrast, kiran_contrast(center, 
+                    centers[(v-2) * width + (u-1)]));
+   if(v < job->imageHeight)
+    contrast = fmax(contrast, kiran_contrast(center, 
+                    centers[v * width + (u-1)]));
+   if(contrast > job->aaThreshold)
+   {
+    tile_t pixel = {u, v, u, v};
+    worker->edges.push_back(pixel);
+   }
+  }
+ }
+ if(worker->edges.empty())
+  return;
+
+ // Trace the pixel corners they need. Neighbouring pixels share 
+ // corners, so each one is traced once.
+ worker->corners.assign((tile.u1 - tile.u0 + 2) * rows, rgb_t());
+ worker->hasCorner.assign(worker->corners.size(), false);
+ worker->cornerIndex.clear();
+ worker->samples.clear();
+ for(unsigned int e = 0; e < worker->edges.size(); e++)
+ {
+  int u = worker->edges[e].u0, v = worker->edges[e].v0;
+  for(int c = 0; c < 4; c++)
+  {
+   k = (u - tile.u0 + (c & 1)) * rows + (v - tile.v0 + (c >> 1));
+   if(worker->hasCorner[k])
+    continue;
+   worker->hasCorner[k] = true;
+   worker->cornerIndex.push_back(k);
+   kiran_add_sample(worker, u - 0.5 + (c & 1), v - 0.5 + (c >> 1), u, v);
+  }
+ }
+ kiran_sample(worker);
+ for(unsigned int s = 0; s < worker->samples.size(); s++)
+  worker->corners[worker->cornerIndex[s]] = worker->samples[s].color;
+
+ for(unsigned int e = 0; e < worker->edges.size(); e++)
+ {
+  int u = worker->edges[e].u0, v = worker->edges[e].v0;
+  for(int c = 0; c < 4; c++)
+   corners[c] = worker->corners[(u - tile.u0 + (c & 1)) * rows + 
+                                (v - tile.v0 + (c >> 1))];
+  (*job->outputImage)(u, v) = 
+   kiran_adaptive_sample(worker, u, v, 1.0, centers[(v-1) * width + (u-1)],
+                         corners, u, v, 0);
+ }
+}
+
+
+//==================================================================
+// kiran_render_tile
+//==================================================================
+void kiran_render_tile(render_worker_t *worker, const tile_t &tile)
+{
+ render_job_t *job = worker->job;
+ rgb_t color, color1, color2, color3, color4;
+ bool superSample = job->antiAlias && !job->adaptiveAntiAlias;
+ int s;
+
+ if(job->adaptiveAntiAlias && job->pass == 1)
+ {
+  kiran_render_tile_adaptive(worker, tile);
+  return;
+ }
+
+ for(int u = tile.u0; u <= tile.u1; u++)
+ {
+  // Super-sampling for anti-aliasing. The two upper corners of a 
+  // pixel are the lower corners of the pixel above it, so they 
+  // are only traced at the top of each column in the tile.
+  worker->samples.clear();
+  for(int v = tile.v0; v <= tile.v1; v++)
+  {
+   kiran_add_sample(worker, u, v, u, v);
+   if(superSample)
+   {
+    if(v == tile.v0)
+    {
+     kiran_add_sample(worker, u-0.5, v-0.5, u, v);
+     kiran_add_sample(worker, u+0.5, v-0.5, u, v);
+    }
+    kiran_add_sample(worker, u-0.5, v+0.5, u, v);
+    kiran_add_sample(worker, u+0.5, v+0.5, u, v);
+   }
+  }
+  kiran_sample(worker);
+
+  s = 0;
+  for(int v = tile.v0; v <= tile.v1; v++)
+  {
+   color = worker->samples[s++].color;
+   if(superSample)
+   {
+    if(v == tile.v0)
+    {
+     color1 = worker->samples[s++].color;
+     color4 = worker->samples[s++].color;
+    }
+    color2 = worker->samples[s++].color;
+    color3 = worker->samples[s++].color;
+
+    color = 0.5 * color + 0.125 * color1 + 0.125 * color2 + 
+            0.125 * color3 + 0.125 * color4; 
+    color1 = color2;
+    color4 = color3;
+   }
+   (*job->outputImage)(u, v) = color;
+   if(job->adaptiveAntiAlias)
+    (*job->centers)[(v-1) * job->imageWidth + (u-1)] = color;
+  }
+ }
+}
+
+
+//==================================================================
+// kiran_render_worker - render thread, runs until out of tiles
+//==================================================================
+void *kiran_render_worker(void *arg)
+{
+ render_worker_t *worker = (render_worker_t *)arg;
+ render_job_t *job = worker->job;
+ tile_t tile;
+
+ while(job->scheduler->getTile(worker->id, tile))
+ {
+  kiran_render_tile(worker, tile);
+
+  if(job->quiet)
+   continue;
+  pthread_mutex_lock(&job->progressLock);
+  job->tilesDone++;
+  render_stats_progress(cout, job->tilesDone, 
+                        job->scheduler->getNumTiles() * job->numPasses);
+  pthread_mutex_unlock(&job->progressLock);
+ }
+
+ pthread_mutex_lock(&job->progressLock);
+ render_stats_add(job->stats, render_stats());
+ pthread_mutex_unlock(&job->progressLock);
+ memset(&render_stats(), 0, sizeof(render_stats_t));
+ return NULL;
+}
+
+
 //==================================================================
 // main
 //==================================================================
@@ -216,17 +717,27 @@ int main(int argc, char *argv[])
  int imageHeight = 480; // default height
  int numShadowRays = 1; // no. of rays from an intercept to light
  bool antiAlias = false;
+ bool adaptiveAntiAlias = false;
+ double aaThreshold;    // from the scene file, see SceneReader
  Pixmap *outputImage;   // output image
  char *outputFile = "output.ppm";
  char *inputFile = NULL;
  SceneReader sceneReader; // Scene file reader
  int maxDepth = 5;
+ int numThreads = 1;    // no. of render threads
+ bool usePackets = false; // trace camera rays in packets
+ bool bench = false;    // print statistics only
+ int benchWidth = 0;    // image size from the command line
+ int benchHeight = 0;
+ char *statsFile = NULL; // JSON statistics output
+ double stageStart;     // start of the current stage, in seconds
+ double wallTime;
   
 //------------------------------------------------------------------
 // Read command line options, initialize
 //------------------------------------------------------------------
  int opt;
- while( (opt = getopt(argc, argv, "o:i:s:a")) != -1)
+ while( (opt = getopt(argc, argv, "o:i:s:aj:pbr:J:m:")) != -1)
  {
   switch(opt)
   {
@@ -236,12 +747,45 @@ int main(int argc, char *argv[])
    case 'i': // set input scene file name
     inputFile = optarg;
     break;
+   case 'j': // set number of render threads, 0 for one per cpu
+    numThreads = atoi(optarg);
+    if(numThreads <= 0)
+     numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(numThreads <= 0)
+     numThreads = 1;
+    break;
+   case 'p': // trace camera rays in packets
+    usePackets = true;
+    break;
+   case 'b': // benchmark, print one line of statistics and nothing else
+    bench = true;
+    break;
+   case 'r': // override image size, as WIDTHxHEIGHT
+    if(sscanf(optarg, "%dx%d", &benchWidth, &benchHeight) != 2 ||
+       benchWidth <= 0 || benchHeight <= 0)
+    {
+     cerr << "kiran: ERROR image size must be given as WIDTHxHEIGHT" << endl;
+     exit(-1);
+    }
+    break;
+   case 'J': // write statistics to a JSON file
+    statsFile = optarg;
+    break;
+   case 'm': // memory for texture tiles, in MB
+    if(atof(optarg) <= 0)
+    {
+     cerr << "kiran: ERROR texture memory must be more than 0 MB" << endl;
+     exit(-1);
+    }
+    texture_cache_set_memory((size_t)(atof(optarg) * (1 << 20)));
+    break;
    default:
     break;
    }
  }
 
  
+ stageStart = render_stats_time();
  if (sceneReader.open(inputFile) != 0)
  {
   cerr << "kiran: ERROR opening input scene description file." << endl;
@@ -250,15 +794,33 @@ int main(int argc, char *argv[])
  imageWidth = sceneReader.getImageWidth();
  imageHeight = sceneReader.getImageHeight();
  antiAlias = sceneReader.isAntiAliasEnabled();
+ adaptiveAntiAlias = sceneReader.isAntiAliasAdaptive();
+ aaThreshold = sceneReader.getAntiAliasThreshold();
  numShadowRays = sceneReader.getNumShadowRays();
+ if(benchWidth > 0)
+ {
+  imageWidth = benchWidth;
+  imageHeight = benchHeight;
+ }
 
- sceneReader.printSceneInfo();
- cout << "Image size   : " << imageWidth << " x " << imageHeight << endl;
- cout << "Output file  : " << outputFile << endl;
- cout << "Antialias    : "; 
-         (antiAlias)?(cout << "enabled"):(cout << "disabled");
- cout << endl;
- cout << "Shadow rays  : " << numShadowRays << " per intercept" << endl; 
+ if(!bench)
+ {
+  sceneReader.printSceneInfo();
+  cout << "Image size   : " << imageWidth << " x " << imageHeight << endl;
+  cout << "Output file  : " << outputFile << endl;
+  cout << "Antialias    : "; 
+          (antiAlias)?(cout << "enabled"):(cout << "disabled");
+  if(adaptiveAntiAlias)
+   cout << ", adaptive with threshold " << aaThreshold;
+  cout << endl;
+  cout << "Shadow rays  : " << numShadowRays << " per intercept" << endl; 
+  cout << "Threads      : " << numThreads << endl; 
+  cout << "Packets      : "; 
+          (usePackets)?(cout << KIRAN_PACKET_SIZE << " camera rays"):(cout << "disabled");
+  cout << endl;
+  cout << "Texture mem. : " << texture_cache_get_memory()/(double)(1 << 20)
+       << " MB" << endl;
+ }
  
 
 //------------------------------------------------------------------
@@ -286,86 +848,132 @@ int main(int argc, char *argv[])
 
  objectList = sceneReader.getObjectList();
  lightList = sceneReader.getLightList();
+ double loadTime = render_stats_time() - stageStart;
+
+ // bounding volume hierarchy over all objects
+ stageStart = render_stats_time();
+ BVH scene;
+ scene.build(objectList);
+ double buildTime = render_stats_time() - stageStart;
+ if(!bench)
+  cout << "Objects      : " << scene.getNumBoundedObjects() << " bounded, " 
+       << scene.getNumUnboundedObjects() << " unbounded" << endl;
 
 
 //------------------------------------------------------------------
 // scan the scene
 //------------------------------------------------------------------
- rgb_t color, color1, color2, color3, color4;
- double progress = 0, pfactor;
- ray_list_t *rayList;
+ render_job_t job;
+ vector<render_worker_t> workers(numThreads);
 
  outputImage = new Pixmap(imageWidth, imageHeight);
- pfactor = 100.0/(imageWidth * imageHeight);
-
  camera->setCcdSize(imageWidth, imageHeight);
- for(int u = 1; u <= imageWidth; u++)
+
+ vector<rgb_t> centers;
+ job.sceneReader = &sceneReader;
+ job.camera = camera;
+ job.scene = &scene;
+ job.lightList = &lightList;
+ job.ambient = (Light *)(aLight);
+ job.outputImage = outputImage;
+ job.imageWidth = imageWidth;
+ job.imageHeight = imageHeight;
+ job.maxDepth = maxDepth;
+ job.numShadowRays = numShadowRays;
+ job.antiAlias = antiAlias;
+ job.adaptiveAntiAlias = adaptiveAntiAlias;
+ job.aaThreshold = aaThreshold;
+ job.centers = &centers;
+ job.numPasses = 1;
+ job.usePackets = usePackets;
+ job.quiet = bench;
+ job.tilesDone = 0;
+ memset(&job.stats, 0, sizeof(job.stats));
+ pthread_mutex_init(&job.progressLock, NULL);
+ stageStart = render_stats_time();
+
+ // adaptive anti-aliasing needs every pixel center before it can 
+ // look for edges, so it renders the image in two passes.
+ if(adaptiveAntiAlias)
+ {
+  centers.resize(imageWidth * imageHeight);
+  job.numPasses = 2;
+ }
+
+ // the main thread is worker 0
+ for(int i = 0; i < numThreads; i++)
+ {
+  workers[i].job = &job;
+  workers[i].id = i;
+ }
+ for(job.pass = 0; job.pass < job.numPasses; job.pass++)
  {
-  for(int v = 1; v <= imageHeight; v++)
+  TileScheduler scheduler(imageWidth, imageHeight, KIRAN_TILE_SIZE, 
+                          numThreads);
+  job.scheduler = &scheduler;
+  for(int i = 1; i < numThreads; i++)
   {
-   rayList = camera->getRays(u, v);
-   color = sceneReader.getBackGroundColor(u,v);
-   (*outputImage)(u, v) = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-
-   // Super-sampling for anti-aliasing
-   if(antiAlias)
+   if(pthread_create(&workers[i].thread, NULL, kiran_render_worker, 
+                     &workers[i]) != 0)
    {
-    if(u == 1)
-    {
-     color1 = color2 = color3 = color4 = sceneReader.getBackGroundColor(u,v);
-
-     rayList = camera->getRays(u-0.5, v-0.5);
-     color1 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color1, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-                  
-     rayList = camera->getRays(u-0.5, v+0.5);
-     color2 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color2, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-
-     rayList = camera->getRays(u+0.5, v+0.5);
-     color3 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color3, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-
-     rayList = camera->getRays(u+0.5, v-0.5);
-     color4 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color4, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-    }
-    else
-    {
-     color1 = color4;
-     color2 = color3;
-     color3 = color4 = sceneReader.getBackGroundColor(u,v);
-
-     rayList = camera->getRays(u+0.5, v+0.5);
-     color3 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color3, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-
-     rayList = camera->getRays(u+0.5, v-0.5);
-     color4 = kiran_trace(rayList, lightList, (Light *)(aLight),
-                  objectList, color4, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
-    }
-    (*outputImage)(u, v) = 0.5 * (*outputImage)(u, v) + 0.125 * color1 + 
-                           0.125 * color2 + 0.125 * color3 + 0.125 * color4; 
+    cerr << "kiran: ERROR creating render thread" << endl;
+    exit(-1);
    }
-   progress++;
-   cout << "\rRendering    : " << (ceil)(progress * pfactor) << " % done";
   }
+  kiran_render_worker(&workers[0]);
+  for(int i = 1; i < numThreads; i++)
+   pthread_join(workers[i].thread, NULL);
+ }
+ pthread_mutex_destroy(&job.progressLock);
+ wallTime = render_stats_time() - stageStart;
+ job.stats.loadTime = loadTime;
+ job.stats.buildTime = buildTime;
+ job.stats.renderTime = wallTime;
+
+ if(!bench)
+  cout << endl << flush;
+ else
+ {
+  // one line of key=value pairs, see bench/compare.sh
+  unsigned long numRays = render_stats_rays(job.stats);
+  cout << "scene=" << inputFile
+       << " size=" << imageWidth << "x" << imageHeight
+       << " threads=" << numThreads
+       << " wall_ms=" << (long)(wallTime * 1000 + 0.5)
+       << " primary=" << job.stats.primaryRays
+       << " secondary=" << job.stats.secondaryRays
+       << " shadow=" << job.stats.shadowRays
+       << " rays_per_sec=" << (long)(numRays/(wallTime > 0 ? wallTime : 1e-6))
+       << " tests=" << job.stats.intersectionTests
+       << " tests_per_ray=" 
+       << (numRays ? (double)job.stats.intersectionTests/numRays : 0)
+       << endl;
  }
- cout << endl << flush;
 //------------------------------------------------------------------
 // write output, clean up and exit
 //------------------------------------------------------------------
 	
+ stageStart = render_stats_time();
  outputImage->write(outputFile, P6);
  delete outputImage;
+ job.stats.writeTime = render_stats_time() - stageStart;
+
+ if(!bench)
+ {
+  unsigned long tileLoads, tileEvictions;
+  size_t tileMemory;
+  render_stats_print(cout, job.stats);
+  texture_cache_stats(tileLoads, tileEvictions, tileMemory);
+  cout << "Texture tiles: " << tileLoads << " loaded, " << tileEvictions 
+       << " dropped, " << tileMemory/1024 << " KB in memory" << endl;
+ }
+ if(statsFile)
+ {
+  ofstream json(statsFile);
+  if(!json)
+   cerr << "kiran: ERROR writing statistics to " << statsFile << endl;
+  render_stats_write_json(json, job.stats);
+ }
 
  return 0;
 }
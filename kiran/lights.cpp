@@ -118,7 +118,8 @@ rgb_t PointLight::calculateLight(intercept_t intercept) const
  kr = intercept.object->getReflectivity();
  kt = intercept.object->getTransmittivity();
  specRefExp = intercept.object->getSpecLtExp();
- objectColor = intercept.object->getColor(intercept.coord);
+ objectColor = intercept.object->getColor(intercept.coord, 
+                                          intercept.footprint);
  fatt = getAttnFactor( norm(intercept.coord - d_pos) );
 
  lightDir = getPosition();
@@ -186,7 +187,8 @@ rgb_t AmbientLight::calculateLight(intercept_t intercept) const
  ka = intercept.object->getAmbLtCoeff();
  kr = intercept.object->getReflectivity();
  kt = intercept.object->getTransmittivity();
- objectColor = intercept.object->getColor(intercept.coord);
+ objectColor = intercept.object->getColor(intercept.coord, 
+                                          intercept.footprint);
  
  result.r = d_intensity.x * ka * (1 - kr - kt) * (double)objectColor.r;
  if(result.r > 1.0) result.r = 1.0;
@@ -26,11 +26,7 @@ Object::Object()
 
 Object::~Object()
 {
- if (d_texture)
-  delete d_texture;
-  
- if(d_bumpMap)
-  delete d_bumpMap;
+ // textures belong to the texture cache
 }
 
 
@@ -71,16 +67,54 @@ void Object::rotate(double x, double y, double z)
 }
 
 
+bool Object::isOccluding(const ray_t &ray, double tooClose, 
+                         double tooFar) const
+{
+ intercept_t intercept;
+ double distance;
+
+ intercept = getIntercept(ray);
+ if(intercept.object == NULL)
+  return false;
+
+ distance = norm(intercept.coord - ray.orig);
+ return ( (distance >= tooClose) && (distance <= tooFar) );
+}
+
+
+void Object::getPacketDistances(const ray_packet_t &packet, 
+                                real_t *distance) const
+{
+ intercept_t intercept;
+ ray_t ray;
+
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+  distance[i] = -1;
+
+ for(int i = 0; i < packet.size; i++)
+ {
+  ray = ray_packet_get(packet, i);
+  intercept = getIntercept(ray);
+  if(intercept.object != NULL)
+   distance[i] = norm(intercept.coord - ray.orig);
+ }
+}
+
+
 void Object::setTexture(char *ppmFileName)
 {
- d_texture = new Pixmap(ppmFileName);
+ d_texture = texture_cache_open(ppmFileName);
+ if(d_texture == NULL)
+  exit(-1);
  d_hasTextureMap = true;
 }
 
 
 void Object::setBumpMap(char *ppmFileName)
 {
- d_bumpMap = new Pixmap(ppmFileName);
+ d_bumpMap = texture_cache_open_derivatives(ppmFileName);
+ if(d_bumpMap == NULL)
+  exit(-1);
  d_hasBumpMap = true;
 }
 
@@ -98,7 +132,7 @@ ZCylinder::ZCylinder(vector3d_t c, double r, double e, char *name)
 }
 
 
-rgb_t ZCylinder::getColor(vector3d_t pos) const
+rgb_t ZCylinder::getColor(vector3d_t pos, double footprint) const
 {
  return d_color;
 }
@@ -156,6 +190,8 @@ intercept_t ZCylinder::getIntercept(const ray_t &ray) const
     intercept.normal = vector3d_t(0,0, 1);
    intercept.normal = normalize(intercept.normal);
    intercept.object = (Object *)this;
+   intercept.footprint = ray_footprint(ray, te);
+   intercept.spread = ray.spread;
   }
   return intercept;
  }
@@ -184,6 +220,7 @@ intercept_t ZCylinder::getIntercept(const ray_t &ray) const
  {
   ve = ray.orig + ray.dir * te;
   intercept.coord = ve;
+  intercept.footprint = ray_footprint(ray, te);
    if(fabs(ve.z - zmin) < 1e-5)
     intercept.normal = vector3d_t(0,0, -1);
    else
@@ -192,17 +229,29 @@ intercept_t ZCylinder::getIntercept(const ray_t &ray) const
  else
  {
   intercept.coord = ray.orig + ray.dir * ts;
+  intercept.footprint = ray_footprint(ray, ts);
   intercept.normal.x = intercept.coord.x - d_center.x;
   intercept.normal.y = intercept.coord.y - d_center.y;
   intercept.normal.z = 0;
  }
  intercept.normal = normalize(intercept.normal);
  intercept.object = (Object *)this;
+ intercept.spread = ray.spread;
 
  return intercept;
 }
 
 
+bool ZCylinder::getBoundingBox(bbox_t &box) const
+{
+ box.lo = vector3d_t(d_center.x - fabs(d_radius), d_center.y - fabs(d_radius), 
+                     d_center.z);
+ box.hi = vector3d_t(d_center.x + fabs(d_radius), d_center.y + fabs(d_radius), 
+                     d_center.z + d_length);
+ return true;
+}
+
+
 void ZCylinder::setEndCapsOn()
 {
  d_hasEndCaps = true;
@@ -9,7 +9,7 @@
 #define _OBJECTS_HPP_INCLUDED
 
 #include "data_types.hpp"
-#include "Pixmap.hpp"
+#include "TextureCache.hpp"
 
 //==================================================================
 // class Object  A pure virtual base class for geometric objects in 
@@ -83,8 +83,11 @@ class Object
   virtual string getName() const {return d_name;}
    //  return  The name of the object.
    
-  virtual rgb_t getColor(vector3d_t pos) const = 0;
-   //  return  The color of the object.
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const = 0;
+   //  return     The color of the object.
+   //  pos        A point on the surface.
+   //  footprint  Width of the area around pos seen through one
+   //             pixel. Texture maps are filtered over it.
  
   virtual double getDiffuseLtCoeff() const {return d_kd;};
    //  return  The diffuse light reflection coefficient.
@@ -111,6 +114,33 @@ class Object
    //  return  The intercept of a ray on the object.
    //  ray     A ray from light source to the object.
 
+  virtual void getPacketDistances(const ray_packet_t &packet, 
+                                  real_t *distance) const;
+   // Packet version of getIntercept. Only finds how far along 
+   // each ray the intercept is. The default calls getIntercept 
+   // once per ray, objects override it with SIMD friendly code.
+   //  distance  Array of KIRAN_PACKET_SIZE, set to the distance 
+   //            from each ray origin to its intercept, or to a 
+   //            negative value if the ray misses.
+
+  virtual bool isOccluding(const ray_t &ray, double tooClose, 
+                           double tooFar) const;
+   // Any-hit test used for shadow rays. Cheaper than getIntercept
+   // because no surface normal is computed.
+   //  return  true if the ray hits the object at a distance in the
+   //          range [tooClose, tooFar] from the ray origin.
+
+  virtual bool getBoundingBox(bbox_t &box) const {return false;}
+   // Axis aligned bounds of the object in world coordinates.
+   //  box     Set to the bounds of the object.
+   //  return  false if the object is unbounded (box is then 
+   //          left untouched).
+
+  virtual void finalize() {}
+   // Called once after all properties and transforms of the object
+   // have been set, before any ray is traced. Objects precompute
+   // whatever their intersection tests need here.
+
  protected:
   string d_name;             // Name of the object
   rgb_t d_color;             // Color of the object
@@ -122,8 +152,10 @@ class Object
   double d_refrInd;          // Refractive index
   double d_kRef;             // Light reflection coefficient
   double d_bumpiness;        // Surface bumpiness factor
-  Pixmap *d_texture;         // Surface texture
-  Pixmap *d_bumpMap;         // Surface bump map
+  Texture *d_texture;        // Surface texture, shared with other 
+                             // objects that use the same file
+  Texture *d_bumpMap;        // Derivative map of the surface bump
+                             // map, also shared
   bool d_hasTextureMap;      
   bool d_hasBumpMap;
   transform_t d_transform;   // Trasformation matrix of object w.r.t
@@ -132,6 +164,18 @@ class Object
 };
 
 
+//==================================================================
+// struct _sphere_record  Everything Sphere::getIntercept needs, 
+//                        packed into two cache lines.
+//==================================================================
+typedef struct _sphere_record
+{
+ real_t m[3][4];    // affine part of the inverse transform
+ vector3d_t center; // center in world coordinates
+ real_t r2;         // squared radius
+}__attribute__((aligned(64))) sphere_record_t;
+
+
 //==================================================================
 // class Sphere  A class for sperical geometric objects in 
 //               the scene.
@@ -142,14 +186,23 @@ class Sphere : public Object
   Sphere(double radius = 0);
   ~Sphere() {};
   void setRadius(double r) {d_radius = r;}
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
+  virtual void getPacketDistances(const ray_packet_t &packet, 
+                                  real_t *distance) const;
+  virtual bool isOccluding(const ray_t &ray, double tooClose, 
+                           double tooFar) const;
+  virtual bool getBoundingBox(bbox_t &box) const;
+  virtual void finalize();
  private:
   void doInverseSphereMap(const vector3d_t pos, double &u, double &v) const;
   vector3d_t doSphereMap(double u, double v) const;
   vector3d_t getBumpedNormal(const intercept_t &intercept) const;
 
   double d_radius;
+  sphere_record_t d_record; // set by finalize
+  transform_t d_rotation;   // d_transform without the translation,
+                            // set by finalize
 };
 
 
@@ -166,8 +219,12 @@ class InfinitePlane : public Object
   virtual void rotate(double x, double y, double z);
   vector3d_t getNormal() const {return d_normal;}
   double getDistanceFromOrigin() const {return d_distance;}
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
+  virtual void getPacketDistances(const ray_packet_t &packet, 
+                                  real_t *distance) const;
+  virtual bool isOccluding(const ray_t &ray, double tooClose, 
+                           double tooFar) const;
  protected:
   vector3d_t d_normal;
   double d_distance;
@@ -186,7 +243,7 @@ class CheckerBoard : public InfinitePlane
   virtual void setColor(rgb_t color) {d_color = color;}
   virtual void setColor2(rgb_t color) {d_color2 = color;}
   void setCheckerSize(double side) {d_checkerScale = side;}
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
  private:
   double d_checkerScale;
   rgb_t d_color2;
@@ -202,7 +259,7 @@ class PlanarPolygon : public InfinitePlane
   PlanarPolygon(vector3d_t *v1=NULL, int numPoints = 0, char *name="Polygon");
   ~PlanarPolygon();
   vector3d_t getNormal() {return d_normal;}
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
  private:
   vector3d_t d_normal;
@@ -227,11 +284,20 @@ class PlanarConvexQuad : public InfinitePlane
   virtual void translate(double x, double y, double z);
   virtual void rotate(double x, double y, double z);
   void setVertices(vector3d_t v1, vector3d_t v2, vector3d_t v3, vector3d_t v4);
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
+  virtual void getPacketDistances(const ray_packet_t &packet, 
+                                  real_t *distance) const;
+  virtual bool isOccluding(const ray_t &ray, double tooClose, 
+                           double tooFar) const;
+  virtual bool getBoundingBox(bbox_t &box) const;
  private:
   vector3d_t findCog() const;
+  bool isInside(const vector3d_t &pos) const;
   void doInverseConvQuadMap(const vector3d_t pos, double &u, double &v) const;
+  double getTextureWidth(const Texture *texture, double footprint) const;
+   //  return  Width in texels of an area on the quad as wide as
+   //          footprint.
   vector3d_t getBumpedNormal(const intercept_t &intercept) const;
 
   vector3d_t d_v1, d_v2, d_v3, d_v4;
@@ -249,9 +315,15 @@ class Box : public Object
       char *name="Box");
   ~Box();
   void setVertices(vector3d_t lo, vector3d_t hi);
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
+  virtual void getPacketDistances(const ray_packet_t &packet, 
+                                  real_t *distance) const;
+  virtual bool isOccluding(const ray_t &ray, double tooClose, 
+                           double tooFar) const;
+  virtual bool getBoundingBox(bbox_t &box) const;
  private:
+  bool getSlabDistance(const ray_t &ray, double &tnear) const;
   vector3d_t d_vl;
   vector3d_t d_vh;
 };
@@ -269,8 +341,9 @@ class ZCylinder : public Object
   virtual void setPosition(vector3d_t pos) {d_center = pos;}
   virtual void setRadius(double r) {d_radius = r;}
   virtual void setLength(double l) {d_length = fabs(l);}
-  virtual rgb_t getColor(vector3d_t pos) const;
+  virtual rgb_t getColor(vector3d_t pos, double footprint) const;
   virtual intercept_t getIntercept(const ray_t &ray) const;
+  virtual bool getBoundingBox(bbox_t &box) const;
   void setEndCapsOn();
  private:
   vector3d_t d_center;
@@ -7,6 +7,7 @@
 
 
 #include "objects.hpp"
+#include "RenderStats.hpp"
 
 //==================================================================
 // class InfinitePlane
@@ -43,7 +44,7 @@ void InfinitePlane::rotate(double x, double y, double z)
 }
 
 
-rgb_t InfinitePlane::getColor(vector3d_t pos) const
+rgb_t InfinitePlane::getColor(vector3d_t pos, double footprint) const
 {
  return d_color;
 }
@@ -79,6 +80,8 @@ intercept_t InfinitePlane::getIntercept(const ray_t &ray) const
  intercept.object = (Object *)this;
  intercept.coord = ray.orig + ray.dir * t;
  intercept.incidentRay = ray.dir;
+ intercept.footprint = ray_footprint(ray, t);
+ intercept.spread = ray.spread;
 
  if( nDotR > 0 )
   intercept.normal = d_normal * (-1.0);
@@ -89,16 +92,89 @@ intercept_t InfinitePlane::getIntercept(const ray_t &ray) const
 }
 
 
+bool InfinitePlane::isOccluding(const ray_t &ray, double tooClose, 
+                                double tooFar) const
+{
+ double t, nDotR, nDotE, distance;
+ vector3d_t ldir;
+ const real_t (*tr)[4] = d_iTransform.t;
+
+ // only the local x components of the ray are needed
+ ldir.x = tr[0][0] * ray.dir.x + tr[0][1] * ray.dir.y + tr[0][2] * ray.dir.z;
+ ldir.y = tr[1][0] * ray.dir.x + tr[1][1] * ray.dir.y + tr[1][2] * ray.dir.z;
+ ldir.z = tr[2][0] * ray.dir.x + tr[2][1] * ray.dir.y + tr[2][2] * ray.dir.z;
+ nDotR = ldir.x/norm(ldir);
+ nDotE = tr[0][0] * ray.orig.x + tr[0][1] * ray.orig.y + 
+         tr[0][2] * ray.orig.z + tr[0][3];
+
+ if( fabsf(nDotR) <= 1e-5 ) // ray parallel to plane
+  return false;
+
+ t = (-1.0) * (nDotE / nDotR);
+ if( t < 0.0001 ) // intercept behind eye
+  return false;
+
+ distance = t * norm(ray.dir);
+ return ( (distance >= tooClose) && (distance <= tooFar) );
+}
+
+
+void InfinitePlane::getPacketDistances(const ray_packet_t &packet, 
+                                       real_t *__restrict__ distance) const
+{
+ real_t dx, dy, dz, nDotR, nDotE, t;
+ bool miss;
+ const real_t (*tr)[4] = d_iTransform.t;
+ const real_t m00 = tr[0][0], m01 = tr[0][1], m02 = tr[0][2], m03 = tr[0][3];
+ const real_t m10 = tr[1][0], m11 = tr[1][1], m12 = tr[1][2];
+ const real_t m20 = tr[2][0], m21 = tr[2][1], m22 = tr[2][2];
+
+ // branch free version of isOccluding, one ray per lane
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  dx = m00 * packet.dx[i] + m01 * packet.dy[i] + m02 * packet.dz[i];
+  dy = m10 * packet.dx[i] + m11 * packet.dy[i] + m12 * packet.dz[i];
+  dz = m20 * packet.dx[i] + m21 * packet.dy[i] + m22 * packet.dz[i];
+  nDotR = dx/sqrt(dx * dx + dy * dy + dz * dz);
+  nDotE = m00 * packet.ox[i] + m01 * packet.oy[i] + m02 * packet.oz[i] + m03;
+
+  t = (-1.0) * (nDotE / nDotR);
+  t *= sqrt(packet.dx[i] * packet.dx[i] + packet.dy[i] * packet.dy[i] + 
+            packet.dz[i] * packet.dz[i]);
+  miss = (fabs(nDotR) <= 1e-5) | (t < 0.0001);
+  distance[i] = miss ? -1 : t;
+ }
+}
+
+
+//==================================================================
+// checker_floor  floor() of a position in units of checks. Rounding
+//                to float first hides the noise of intercepts computed
+//                in double. In single precision the noise is larger, 
+//                so the position is snapped to 1/4096 of a check. A 
+//                plane lying on a check boundary then stays on one 
+//                side of it.
+//==================================================================
+static inline double checker_floor(double x)
+{
+#ifdef KIRAN_SINGLE_PRECISION
+ return floor(rint(x * 4096) / 4096);
+#else
+ return floorf(x);
+#endif
+}
+
+
 //==================================================================
 // class CheckerBoard
 //==================================================================
 
-rgb_t CheckerBoard::getColor(vector3d_t pos) const
+rgb_t CheckerBoard::getColor(vector3d_t pos, double footprint) const
 {
  double color;
- color = floorf(d_checkerScale * pos.x) + 
-         floorf(d_checkerScale * pos.y) + 
-         floorf(d_checkerScale * pos.z);
+ color = checker_floor(d_checkerScale * pos.x) + 
+         checker_floor(d_checkerScale * pos.y) + 
+         checker_floor(d_checkerScale * pos.z);
 
  if((int)color & 0x1) 
   return d_color2;
@@ -192,7 +268,7 @@ void PlanarConvexQuad::setVertices(vector3d_t v1, vector3d_t v2,
 }
 
 
-rgb_t PlanarConvexQuad::getColor(vector3d_t pos) const
+rgb_t PlanarConvexQuad::getColor(vector3d_t pos, double footprint) const
 {
  rgb_t color;
  double u, v;
@@ -200,12 +276,21 @@ rgb_t PlanarConvexQuad::getColor(vector3d_t pos) const
   return d_color;
 
  doInverseConvQuadMap(pos, u, v);
- color = (*d_texture)((int)(u * (d_texture->width()-1) + 1), 
-                      (int)((1-v) * (d_texture->height()-1))+1);
+ color = d_texture->lookup(u, 1-v, getTextureWidth(d_texture, footprint));
  return color;
 }
 
 
+double PlanarConvexQuad::getTextureWidth(const Texture *texture,
+                                         double footprint) const
+{
+ // the texture is stretched over the sides from v2 to v3 and v1
+ double across = texture->width()/norm(d_v3 - d_v2);
+ double down = texture->height()/norm(d_v1 - d_v2);
+ return footprint * ((across > down) ? across : down);
+}
+
+
 void PlanarConvexQuad::doInverseConvQuadMap(const vector3d_t pos, 
                              double &u, double &v) const
 {
@@ -292,13 +377,7 @@ intercept_t PlanarConvexQuad::getIntercept(const ray_t &ray) const
 
  // ray intersects infinite plane. check whether intersection
  // inside quad
- vector3d_t n1, n2, n3, n4;
- n1 = cross((d_v2 - d_v1), (intercept.coord - d_v1));
- n2 = cross((intercept.coord - d_v1), (d_v4 - d_v1));
- n3 = cross((intercept.coord - d_v3), (d_v2 - d_v3));
- n4 = cross((d_v4 - d_v3), (intercept.coord - d_v3));
- 
- if(dot(n1, n2) > 0 && dot(n3, n4) > 0 && dot(n2, n3) > 0) 
+ if( isInside(intercept.coord) ) 
  { // intersection inside plane
   intercept.normal = getBumpedNormal(intercept);
   intercept.object = (Object *)this;
@@ -309,63 +388,101 @@ intercept_t PlanarConvexQuad::getIntercept(const ray_t &ray) const
 }
 
 
+bool PlanarConvexQuad::getBoundingBox(bbox_t &box) const
+{
+ box = bbox_t();
+ bbox_extend(box, d_v1);
+ bbox_extend(box, d_v2);
+ bbox_extend(box, d_v3);
+ bbox_extend(box, d_v4);
+ return true;
+}
+
+
+bool PlanarConvexQuad::isOccluding(const ray_t &ray, double tooClose, 
+                                   double tooFar) const
+{
+ intercept_t intercept;
+ double distance;
+
+ // the plane intercept carries no bumped normal, so it is cheap
+ intercept = InfinitePlane::getIntercept(ray);
+ if(intercept.object == NULL)
+  return false;
+
+ distance = norm(intercept.coord - ray.orig);
+ if( (distance < tooClose) || (distance > tooFar) )
+  return false;
+
+ return isInside(intercept.coord);
+}
+
+
+void PlanarConvexQuad::getPacketDistances(const ray_packet_t &packet, 
+                                          real_t *distance) const
+{
+ ray_t ray;
+
+ // plane distances in bulk, the inside test only for the hits
+ InfinitePlane::getPacketDistances(packet, distance);
+ for(int i = 0; i < packet.size; i++)
+ {
+  if(distance[i] < 0)
+   continue;
+  ray = ray_packet_get(packet, i);
+  if( !isInside(ray.orig + ray.dir * (distance[i]/norm(ray.dir))) )
+   distance[i] = -1;
+ }
+}
+
+
+bool PlanarConvexQuad::isInside(const vector3d_t &pos) const
+{
+ vector3d_t n1, n2, n3, n4;
+ n1 = cross((d_v2 - d_v1), (pos - d_v1));
+ n2 = cross((pos - d_v1), (d_v4 - d_v1));
+ n3 = cross((pos - d_v3), (d_v2 - d_v3));
+ n4 = cross((d_v4 - d_v3), (pos - d_v3));
+ 
+ return (dot(n1, n2) > 0 && dot(n3, n4) > 0 && dot(n2, n3) > 0);
+}
+
+
 vector3d_t PlanarConvexQuad::getBumpedNormal(const intercept_t &intercept) const
 {
  if(!d_hasBumpMap)
   return intercept.normal;
+ KIRAN_STAT(render_stats().bumpLookups++);
  
- vector3d_t bumpedNormal, tmp, n1, n2, n3, n4;
+ vector3d_t bumpedNormal, a, b, gu, gv, slope;
  rgb_t bump;
- double bumpiness, u, v;
- 
- // look at 0.1mm along +y
- tmp.x = d_transform.t[0][1];
- tmp.y = d_transform.t[1][1];
- tmp.z = d_transform.t[2][1];
- tmp = intercept.coord + (tmp * 0.001);
- doInverseConvQuadMap(tmp, u, v);
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- n1 = bumpiness * (tmp - intercept.coord);
-
- // look at 0.1mm along -y
- tmp.x = d_transform.t[0][1];
- tmp.y = d_transform.t[1][1];
- tmp.z = d_transform.t[2][1];
- tmp = intercept.coord - (tmp * 0.001);
- doInverseConvQuadMap(tmp, u, v);
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- n2 = bumpiness * (tmp - intercept.coord);
-
- // look at 0.1mm along +z
- tmp.x = d_transform.t[0][2];
- tmp.y = d_transform.t[1][2];
- tmp.z = d_transform.t[2][2];
- tmp = intercept.coord + (tmp * 0.001);
- doInverseConvQuadMap(tmp, u, v);
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- n3 = bumpiness * (tmp - intercept.coord);
-
- // look at 0.1mm along -z
- tmp.x = d_transform.t[0][2];
- tmp.y = d_transform.t[1][2];
- tmp.z = d_transform.t[2][2];
- tmp = intercept.coord - (tmp * 0.001);
- doInverseConvQuadMap(tmp, u, v);
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- n4 = bumpiness * (tmp - intercept.coord);
-
- bumpedNormal = (d_bumpiness * 100000.0 * (n1+n2+n3+n4)) + d_normal;
+ double u, v, aa, ab, bb, det;
+
+ doInverseConvQuadMap(intercept.coord, u, v);
+ bump = d_bumpMap->lookup(u, 1-v, getTextureWidth(d_bumpMap, 
+                                                  intercept.footprint));
+
+ // change of u and v across the quad, exact for a parallelogram
+ // with u along v2 to v3 and v along v2 to v1
+ a = d_v3 - d_v2;
+ b = d_v1 - d_v2;
+ aa = dot(a, a);
+ ab = dot(a, b);
+ bb = dot(b, b);
+ det = aa * bb - ab * ab;
+ if(fabs(det) < 1e-12)
+  return d_normal;
+ gu = (1.0/det) * (bb * a - ab * b);
+ gv = (1.0/det) * (aa * b - ab * a);
+
+ // gradient of the height, texture rows go down as v goes up
+ slope = (bump.g * (d_bumpMap->width() - 1)) * gu - 
+         (bump.b * (d_bumpMap->height() - 1)) * gv;
+
+ // heights read 1 mm either way along the local y and z axes and 
+ // scaled by 100000 add up to 0.2 times the gradient
+ bumpedNormal = (d_bumpiness * 0.2 * slope) + d_normal;
  bumpedNormal = normalize(bumpedNormal);
- //cout << "bumped: " << bumpedNormal.x << " " << bumpedNormal.y << " " << bumpedNormal.z << endl;
- //cout << "orig: " << d_transform.t[0][1] << " " << d_transform.t[1][1] << " " << d_transform.t[2][1] << endl;
  return bumpedNormal;
 }
 
@@ -1,4 +1,5 @@
 #include "objects.hpp"
+#include "RenderStats.hpp"
 
 //==================================================================
 // class Sphere
@@ -6,11 +7,58 @@
 
 Sphere::Sphere(double radius)
 {
- setRadius(d_radius);
+ setRadius(radius);
+ finalize();
 }
 
 
-rgb_t Sphere::getColor(vector3d_t pos) const
+void Sphere::finalize()
+{
+ for(int i = 0; i < 3; i++)
+  for(int j = 0; j < 4; j++)
+   d_record.m[i][j] = d_iTransform.t[i][j];
+ d_record.center = get_translation(d_transform);
+ d_record.r2 = d_radius * d_radius;
+ d_rotation = d_transform;
+ d_rotation.t[0][3] = d_rotation.t[1][3] = d_rotation.t[2][3] = 0.0;
+}
+
+
+//==================================================================
+// sphere_texture_width  Width in texels of an area on a sphere. The
+//                       texture wraps once around the equator and
+//                       once from pole to pole.
+//==================================================================
+static inline double sphere_texture_width(const Texture *texture, 
+                                          double radius, double footprint)
+{
+ double across = texture->width()/(2 * M_PI * radius);
+ double down = texture->height()/(M_PI * radius);
+ return footprint * ((across > down) ? across : down);
+}
+
+
+//==================================================================
+// sphere_local_ray  Bring a ray into the local frame of a sphere
+//                   using the affine inverse in its record.
+//==================================================================
+static inline void sphere_local_ray(const sphere_record_t &rec, 
+                                    const ray_t &ray, ray_t &lray)
+{
+ const real_t (*m)[4] = rec.m;
+ const vector3d_t &o = ray.orig;
+ const vector3d_t &d = ray.dir;
+
+ lray.orig.x = m[0][0] * o.x + m[0][1] * o.y + m[0][2] * o.z + m[0][3];
+ lray.orig.y = m[1][0] * o.x + m[1][1] * o.y + m[1][2] * o.z + m[1][3];
+ lray.orig.z = m[2][0] * o.x + m[2][1] * o.y + m[2][2] * o.z + m[2][3];
+ lray.dir.x = m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z;
+ lray.dir.y = m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z;
+ lray.dir.z = m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z;
+}
+
+
+rgb_t Sphere::getColor(vector3d_t pos, double footprint) const
 {
  rgb_t color;
  double u, v;
@@ -18,8 +66,8 @@ rgb_t Sphere::getColor(vector3d_t pos) const
   return d_color;
 
  doInverseSphereMap(pos, u, v);
- color = (*d_texture)((int)(u * (d_texture->width()-1) + 1), 
-                      (int)((1-v) * (d_texture->height()-1))+1);
+ color = d_texture->lookup(u, 1-v, 
+                           sphere_texture_width(d_texture, d_radius, footprint));
  return color;
 }
 
@@ -29,28 +77,22 @@ intercept_t Sphere::getIntercept(const ray_t &ray) const
  intercept_t intercept;
  intercept.object = NULL;
  
- double a, b, c, dsq, t1, t2, t;
- vector3d_t center;
+ double a, b, c, dsq, sq, t1, t2, t;
  ray_t lray;
- transform_t tr;
- 
- tr = d_iTransform;
- lray.orig = tr * ray.orig;
- tr.t[0][3] = tr.t[1][3] = tr.t[2][3] = 0;
- lray.dir = tr * ray.dir;
  
- center = get_translation(d_transform);
+ sphere_local_ray(d_record, ray, lray);
 
- a = pow( norm(lray.dir), 2);
+ a = dot(lray.dir, lray.dir);
  b = 2 * (dot(lray.dir, lray.orig));
- c = pow( norm(lray.orig), 2) - pow(d_radius, 2);
+ c = dot(lray.orig, lray.orig) - d_record.r2;
 
  dsq = b * b - 4 * a * c;
  if(dsq < 0 )
   return intercept;
  
- t1 = (-b + sqrt(dsq))/(2 * a); 
- t2 = (-b - sqrt(dsq))/(2 * a); 
+ sq = sqrt(dsq);
+ t1 = (-b + sq)/(2 * a); 
+ t2 = (-b - sq)/(2 * a); 
 
  if( t1 < 0.0001 && t2 < 0.0001) // both intercepts negative or small
   return intercept;
@@ -59,19 +101,14 @@ intercept_t Sphere::getIntercept(const ray_t &ray) const
  intercept.incidentRay = ray.dir;
  
  if( t1 > 0.0001 && t2 > 0.0001 ) // sphere in front of eye
- {
   (t1 < t2) ? (t = t1) : (t = t2);
-  intercept.coord = ray.orig + ray.dir * t;
-  intercept.normal = intercept.coord - center;
-  intercept.normal = normalize(intercept.normal);
-  if(d_hasBumpMap)
-   intercept.normal = getBumpedNormal(intercept);
-  return intercept;
- }
- 
- (t1 > 0.0001 ) ? (t = t1) : (t = t2); // eye inside sphere
+ else
+  (t1 > 0.0001 ) ? (t = t1) : (t = t2); // eye inside sphere
+
  intercept.coord = ray.orig + ray.dir * t;
- intercept.normal = intercept.coord - center;
+ intercept.footprint = ray_footprint(ray, t);
+ intercept.spread = ray.spread;
+ intercept.normal = intercept.coord - d_record.center;
  intercept.normal = normalize(intercept.normal);
  if(d_hasBumpMap)
   intercept.normal = getBumpedNormal(intercept);
@@ -79,6 +116,87 @@ intercept_t Sphere::getIntercept(const ray_t &ray) const
 }
 
 
+bool Sphere::isOccluding(const ray_t &ray, double tooClose, 
+                         double tooFar) const
+{
+ double a, b, c, dsq, sq, t1, t2, t, distance;
+ ray_t lray;
+ 
+ sphere_local_ray(d_record, ray, lray);
+
+ a = dot(lray.dir, lray.dir);
+ b = 2 * (dot(lray.dir, lray.orig));
+ c = dot(lray.orig, lray.orig) - d_record.r2;
+
+ dsq = b * b - 4 * a * c;
+ if(dsq < 0 )
+  return false;
+ 
+ sq = sqrt(dsq);
+ t1 = (-b + sq)/(2 * a); 
+ t2 = (-b - sq)/(2 * a); 
+
+ if( t1 < 0.0001 && t2 < 0.0001) // both intercepts negative or small
+  return false;
+
+ // same choice of root as getIntercept
+ if( t1 > 0.0001 && t2 > 0.0001 )
+  (t1 < t2) ? (t = t1) : (t = t2);
+ else
+  (t1 > 0.0001 ) ? (t = t1) : (t = t2);
+
+ distance = t * norm(ray.dir);
+ return ( (distance >= tooClose) && (distance <= tooFar) );
+}
+
+
+void Sphere::getPacketDistances(const ray_packet_t &packet, 
+                                real_t *__restrict__ distance) const
+{
+ real_t ox, oy, oz, dx, dy, dz, a, b, c, dsq, sq, t1, t2, t;
+ const real_t (*tr)[4] = d_record.m;
+ const real_t m00 = tr[0][0], m01 = tr[0][1], m02 = tr[0][2], m03 = tr[0][3];
+ const real_t m10 = tr[1][0], m11 = tr[1][1], m12 = tr[1][2], m13 = tr[1][3];
+ const real_t m20 = tr[2][0], m21 = tr[2][1], m22 = tr[2][2], m23 = tr[2][3];
+ const real_t r2 = d_record.r2;
+
+ // branch free version of isOccluding, one ray per lane
+ for(int i = 0; i < KIRAN_PACKET_SIZE; i++)
+ {
+  ox = m00 * packet.ox[i] + m01 * packet.oy[i] + m02 * packet.oz[i] + m03;
+  oy = m10 * packet.ox[i] + m11 * packet.oy[i] + m12 * packet.oz[i] + m13;
+  oz = m20 * packet.ox[i] + m21 * packet.oy[i] + m22 * packet.oz[i] + m23;
+  dx = m00 * packet.dx[i] + m01 * packet.dy[i] + m02 * packet.dz[i];
+  dy = m10 * packet.dx[i] + m11 * packet.dy[i] + m12 * packet.dz[i];
+  dz = m20 * packet.dx[i] + m21 * packet.dy[i] + m22 * packet.dz[i];
+
+  a = dx * dx + dy * dy + dz * dz;
+  b = 2 * (dx * ox + dy * oy + dz * oz);
+  c = ox * ox + oy * oy + oz * oz - r2;
+  dsq = b * b - 4 * a * c;
+  sq = sqrt( (dsq < 0) ? 0 : dsq );
+  t1 = (-b + sq)/(2 * a); 
+  t2 = (-b - sq)/(2 * a); 
+
+  t = (t1 > 0.0001 && t2 > 0.0001) ? ((t1 < t2) ? t1 : t2) 
+                                   : ((t1 > 0.0001) ? t1 : t2);
+  t *= sqrt(packet.dx[i] * packet.dx[i] + packet.dy[i] * packet.dy[i] + 
+            packet.dz[i] * packet.dz[i]);
+  distance[i] = (dsq < 0 || (t1 < 0.0001 && t2 < 0.0001)) ? -1 : t;
+ }
+}
+
+
+bool Sphere::getBoundingBox(bbox_t &box) const
+{
+ vector3d_t extent;
+ extent = vector3d_t(fabs(d_radius), fabs(d_radius), fabs(d_radius));
+ box.lo = d_record.center - extent;
+ box.hi = d_record.center + extent;
+ return true;
+}
+
+
 void Sphere::doInverseSphereMap(const vector3d_t pos, double &u, double &v) const
 {
  vector3d_t sn, sp, se;
@@ -140,55 +258,32 @@ vector3d_t Sphere::getBumpedNormal(const intercept_t &intercept) const
 {
  if(!d_hasBumpMap)
   return intercept.normal;
-  
- vector3d_t newNormal, pu, pd, pl, pr;
- vector3d_t center;
- double u, v, ut, vt;
+ KIRAN_STAT(render_stats().bumpLookups++);
+
+ vector3d_t sn, d, du, dv, sum;
  rgb_t bump;
- double bumpiness;
- 
- center = get_translation(d_transform);
+ double u, v, sinPhi;
+
  doInverseSphereMap(intercept.coord, u, v); // get u, v for a intersection
+ bump = d_bumpMap->lookup(u, 1-v, sphere_texture_width(d_bumpMap, d_radius,
+                                                       intercept.footprint));
 
- // create 4 new normals depending respectively on 
- // pixels values up, down, left and right of this pixel
- // in the bump map.
- ut = u-2.0/d_bumpMap->width();
- if(ut < 0.0) ut = 0.0;
- bump = (*d_bumpMap)((int)(ut * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- pl = doSphereMap(ut, v);
- pl = bumpiness * normalize(pl - center);
-
- ut = u+2.0/d_bumpMap->width();
- if(ut > 1.0) ut = 1.0;
- bump = (*d_bumpMap)((int)(ut * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-v) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- pr = doSphereMap(ut, v);
- pr = bumpiness * normalize(pr - center);
- 
- vt = v+2.0/d_bumpMap->height();
- if(vt > 1.0) vt = 1.0;
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-vt) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- pu = doSphereMap(u, vt);
- pu = bumpiness * normalize(pu - center);
- 
- vt = v-2.0/d_bumpMap->height();
- if(vt < 0.0) vt = 0.0;
- bump = (*d_bumpMap)((int)(u * (d_bumpMap->width()-1) + 1), 
-                      (int)((1-vt) * (d_bumpMap->height()-1))+1);
- bumpiness = 0.33 * (bump.r + bump.g + bump.b) - 0.5;
- pd = doSphereMap(u, vt);
- pd = bumpiness * normalize(pd - center);
-
- newNormal = d_bumpiness * (pl + pr + pu + pd);
- newNormal = normalize(intercept.normal + newNormal);
- 
- return newNormal;
+ // The normal was bent by the heights 2 texels left, right, up and 
+ // down of u, v, each times the direction doSphereMap gives for 
+ // where it was read. doSphereMap has its pole on z and 
+ // doInverseSphereMap on x, so in the local frame that direction 
+ // is the normal sn with its axes turned, d below, and the sum is 
+ // kept here to first order in the distance to the four texels.
+ sn = normalize(d_iTransform * intercept.coord);
+ d = vector3d_t(sn.y, sn.z, sn.x);
+ du = vector3d_t(-sn.z, sn.y, 0);  // change of d with u, over 2 pi
+ sinPhi = sqrt(sn.y * sn.y + sn.z * sn.z);
+ if(sinPhi > 1e-6)                 // change of d with v, over -pi
+  dv = vector3d_t(sn.x * sn.y/sinPhi, sn.x * sn.z/sinPhi, -sinPhi);
+
+ sum = (4 * bump.r) * d + (16 * M_PI * bump.g/d_bumpMap->width()) * du +
+       (8 * M_PI * bump.b/d_bumpMap->height()) * dv;
+ return normalize(intercept.normal + d_bumpiness * (d_rotation * sum));
 }
 
 
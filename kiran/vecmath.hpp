@@ -0,0 +1,406 @@
+//==================================================================
+// vecmath.hpp  Vector, color and transformation matrix templates.
+//              Everything here is inline so that the compiler can
+//              optimize arithmetic across translation units.
+//
+//              real_t is the scalar type the renderer stores its
+//              geometry and colors in. It is double by default.
+//              Build with -DKIRAN_SINGLE_PRECISION for float, which
+//              halves the memory traffic and doubles the number of
+//              lanes in the packet kernels. Add -DKIRAN_SSE to use
+//              SSE instructions for float vectors and colors.
+//==================================================================
+
+#ifndef _VECMATH_HPP_INCLUDED
+#define _VECMATH_HPP_INCLUDED
+
+#include <math.h>
+
+#ifdef KIRAN_SINGLE_PRECISION
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
+
+#ifdef KIRAN_SSE
+#ifndef KIRAN_SINGLE_PRECISION
+#error "KIRAN_SSE requires KIRAN_SINGLE_PRECISION"
+#endif
+#include <xmmintrin.h>
+#endif
+
+
+//==================================================================
+// struct _vector3d  A simple structure for 3D vectors.
+//==================================================================
+template <class T>
+struct _vector3d
+{
+ typedef T value_type;
+ _vector3d(T X = 0, T Y = 0, T Z = 0) : x(X), y(Y), z(Z) {};
+ T x;
+ T y;
+ T z;
+};
+
+
+//==================================================================
+// struct _rgb  A simple structure to represent colors. Components
+//              are kept in the range [0.0 1.0] by the operators.
+//==================================================================
+template <class T>
+struct _rgb
+{
+ typedef T value_type;
+ _rgb(T R = 0, T G = 0, T B = 0) : r(R), g(G), b(B) {};
+ T r;
+ T g;
+ T b;
+};
+
+
+//==================================================================
+// struct _transform  Homogeneous transformation matrix. Constructed
+//                    from a translation and rotations about the X,
+//                    Y and Z axes.
+//==================================================================
+template <class T>
+struct _transform
+{
+ typedef T value_type;
+ T t[4][4];
+ _transform(double x = 0, double y = 0, double z = 0, double rx = 0,
+            double ry = 0, double rz = 0)
+ {
+  double cx, cy, cz, sx, sy, sz;
+  cx = cos(rx); cy = cos(ry); cz = cos(rz);
+  sx = sin(rx); sy = sin(ry); sz = sin(rz);
+
+  t[0][3] = x;
+  t[1][3] = y;
+  t[2][3] = z;
+  t[3][3] = 1;
+
+  t[0][0] = cz * cy;
+  t[0][1] = cz * sy * sx - sz * cx;
+  t[0][2] = sz * sx + cz * sy * cx;
+
+  t[1][0] = sz * cy;
+  t[1][1] = sz * sy * sx + cz * cx;
+  t[1][2] = -cz * sx + sz * sy * cx;
+
+  t[2][0] = -sy;
+  t[2][1] = cy * sx;
+  t[2][2] = cy * cx;
+
+  t[3][0] = 0.0;
+  t[3][1] = 0.0;
+  t[3][2] = 0.0;
+ }
+}__attribute__((aligned(64)));
+
+
+#ifdef KIRAN_SSE
+//==================================================================
+// SSE layout for float vectors and colors. The fourth lane is kept
+// at zero so that dot products can sum all four lanes.
+//==================================================================
+template <>
+struct __attribute__((aligned(16))) _vector3d<float>
+{
+ typedef float value_type;
+ _vector3d(float X = 0, float Y = 0, float Z = 0)
+  : v(_mm_set_ps(0, Z, Y, X)) {};
+ _vector3d(__m128 V) : v(V) {};
+ union
+ {
+  __m128 v;
+  struct { float x, y, z, w; };
+ };
+};
+
+
+template <>
+struct __attribute__((aligned(16))) _rgb<float>
+{
+ typedef float value_type;
+ _rgb(float R = 0, float G = 0, float B = 0)
+  : v(_mm_set_ps(0, B, G, R)) {};
+ _rgb(__m128 V) : v(V) {};
+ union
+ {
+  __m128 v;
+  struct { float r, g, b, a; };
+ };
+};
+#endif // KIRAN_SSE
+
+
+//==================================================================
+// Operators for _vector3d
+//==================================================================
+template <class T>
+inline _vector3d<T> operator+(const _vector3d<T> &v1,
+                              const _vector3d<T> &v2)
+{
+ return _vector3d<T>(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
+}
+
+
+template <class T>
+inline _vector3d<T> operator-(const _vector3d<T> &v1,
+                              const _vector3d<T> &v2)
+{
+ return _vector3d<T>(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
+}
+
+
+template <class T>
+inline _vector3d<T> operator*(const _vector3d<T> &vector,
+                              typename _vector3d<T>::value_type scalar)
+{
+ return _vector3d<T>(vector.x * scalar, vector.y * scalar,
+                     vector.z * scalar);
+}
+
+
+template <class T>
+inline _vector3d<T> operator*(typename _vector3d<T>::value_type scalar,
+                              const _vector3d<T> &vector)
+{
+ return vector * scalar;
+}
+
+
+template <class T>
+inline T dot(const _vector3d<T> &v1, const _vector3d<T> &v2)
+{
+ return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z);
+}
+
+
+template <class T>
+inline _vector3d<T> cross(const _vector3d<T> &v1, const _vector3d<T> &v2)
+{
+ return _vector3d<T>(v1.y * v2.z - v2.y * v1.z,
+                     v2.x * v1.z - v1.x * v2.z,
+                     v1.x * v2.y - v2.x * v1.y);
+}
+
+
+template <class T>
+inline T norm(const _vector3d<T> &vector)
+{
+ return sqrt(dot(vector, vector));
+}
+
+
+template <class T>
+inline _vector3d<T> normalize(const _vector3d<T> &vector)
+{
+ return (vector * (1/norm(vector)));
+}
+
+
+#ifdef KIRAN_SSE
+inline _vector3d<float> operator+(const _vector3d<float> &v1,
+                                  const _vector3d<float> &v2)
+{
+ return _vector3d<float>(_mm_add_ps(v1.v, v2.v));
+}
+
+
+inline _vector3d<float> operator-(const _vector3d<float> &v1,
+                                  const _vector3d<float> &v2)
+{
+ return _vector3d<float>(_mm_sub_ps(v1.v, v2.v));
+}
+
+
+inline _vector3d<float> operator*(const _vector3d<float> &vector,
+                                  float scalar)
+{
+ return _vector3d<float>(_mm_mul_ps(vector.v, _mm_set1_ps(scalar)));
+}
+
+
+inline _vector3d<float> operator*(float scalar,
+                                  const _vector3d<float> &vector)
+{
+ return _vector3d<float>(_mm_mul_ps(vector.v, _mm_set1_ps(scalar)));
+}
+
+
+inline float dot(const _vector3d<float> &v1, const _vector3d<float> &v2)
+{
+ __m128 p = _mm_mul_ps(v1.v, v2.v);
+ p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+ p = _mm_add_ss(p, _mm_shuffle_ps(p, p, 1));
+ return _mm_cvtss_f32(p);
+}
+
+
+inline _vector3d<float> cross(const _vector3d<float> &v1,
+                              const _vector3d<float> &v2)
+{
+ // (y, z, x) * (z, x, y) - (z, x, y) * (y, z, x)
+ __m128 a = _mm_shuffle_ps(v1.v, v1.v, _MM_SHUFFLE(3, 0, 2, 1));
+ __m128 b = _mm_shuffle_ps(v2.v, v2.v, _MM_SHUFFLE(3, 1, 0, 2));
+ __m128 c = _mm_shuffle_ps(v1.v, v1.v, _MM_SHUFFLE(3, 1, 0, 2));
+ __m128 d = _mm_shuffle_ps(v2.v, v2.v, _MM_SHUFFLE(3, 0, 2, 1));
+ return _vector3d<float>(_mm_sub_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d)));
+}
+#endif // KIRAN_SSE
+
+
+//==================================================================
+// Operators for _rgb. Results are clipped at 1.0
+//==================================================================
+template <class T>
+inline _rgb<T> operator+(const _rgb<T> &c1, const _rgb<T> &c2)
+{
+ _rgb<T> color(c1.r + c2.r, c1.g + c2.g, c1.b + c2.b);
+ if(color.r > 1.0) color.r = 1.0;
+ if(color.g > 1.0) color.g = 1.0;
+ if(color.b > 1.0) color.b = 1.0;
+ return color;
+}
+
+
+template <class T>
+inline _rgb<T> operator*(const _rgb<T> &c,
+                         typename _rgb<T>::value_type scalar)
+{
+ T factor = fabs(scalar);
+ _rgb<T> color(c.r * factor, c.g * factor, c.b * factor);
+ if(color.r > 1.0) color.r = 1.0;
+ if(color.g > 1.0) color.g = 1.0;
+ if(color.b > 1.0) color.b = 1.0;
+ return color;
+}
+
+
+template <class T>
+inline _rgb<T> operator*(typename _rgb<T>::value_type scalar,
+                         const _rgb<T> &c)
+{
+ return c * scalar;
+}
+
+
+#ifdef KIRAN_SSE
+inline _rgb<float> operator+(const _rgb<float> &c1, const _rgb<float> &c2)
+{
+ return _rgb<float>(_mm_min_ps(_mm_add_ps(c1.v, c2.v), _mm_set1_ps(1.0f)));
+}
+
+
+inline _rgb<float> operator*(const _rgb<float> &c, float scalar)
+{
+ __m128 factor = _mm_set1_ps(fabsf(scalar));
+ return _rgb<float>(_mm_min_ps(_mm_mul_ps(c.v, factor), _mm_set1_ps(1.0f)));
+}
+
+
+inline _rgb<float> operator*(float scalar, const _rgb<float> &c)
+{
+ return c * scalar;
+}
+#endif // KIRAN_SSE
+
+
+//==================================================================
+// Operators for _transform
+//==================================================================
+template <class T>
+inline _vector3d<T> operator*(const _transform<T> &t, const _vector3d<T> &v)
+{
+ return _vector3d<T>(
+  t.t[0][0] * v.x + t.t[0][1] * v.y + t.t[0][2] * v.z + t.t[0][3],
+  t.t[1][0] * v.x + t.t[1][1] * v.y + t.t[1][2] * v.z + t.t[1][3],
+  t.t[2][0] * v.x + t.t[2][1] * v.y + t.t[2][2] * v.z + t.t[2][3]);
+}
+
+
+template <class T>
+inline _transform<T> operator*(const _transform<T> &t1,
+                               const _transform<T> &t2)
+{
+ _transform<T> t;
+ for(int i = 0; i < 4; i++)
+  for(int j = 0; j < 4; j++)
+  {
+   t.t[i][j] = 0;
+   for(int k = 0; k < 4; k++)
+    t.t[i][j] += (t1.t[i][k] * t2.t[k][j]);
+  }
+ return t;
+}
+
+
+template <class T>
+inline _vector3d<T> get_translation(const _transform<T> &t)
+{
+ return _vector3d<T>(t.t[0][3], t.t[1][3], t.t[2][3]);
+}
+
+
+template <class T>
+inline void get_rotation(const _transform<T> &t, double &rx, double &ry,
+                         double &rz)
+{
+ ry = -asin(t.t[2][0]);
+ rx = asin((t.t[2][1])/cos(ry));
+ rz = asin((t.t[1][0])/cos(ry));
+}
+
+
+template <class T>
+inline _transform<T> inverse(const _transform<T> &t)
+{
+ // transpose the rotation, rotate the translation back
+ _transform<T> it;
+ _vector3d<T> c1(t.t[0][0], t.t[1][0], t.t[2][0]),
+              c2(t.t[0][1], t.t[1][1], t.t[2][1]),
+              c3(t.t[0][2], t.t[1][2], t.t[2][2]);
+ _vector3d<T> p(t.t[0][3], t.t[1][3], t.t[2][3]);
+
+ for(int i = 0; i < 3; i++)
+  for(int j = 0; j < 3; j++)
+   it.t[i][j] = t.t[j][i];
+
+ it.t[0][3] = -dot(p, c1);
+ it.t[1][3] = -dot(p, c2);
+ it.t[2][3] = -dot(p, c3);
+ it.t[3][3] = 1;
+
+ return it;
+}
+
+
+template <class T>
+inline _transform<T> set_rotation_about(const _vector3d<T> &u,
+                                        double theta)
+{
+ _transform<T> t;
+ double ct, st;
+ double vt;
+
+ ct = cos(theta);
+ st = sin(theta);
+ vt = 1 - ct;
+
+ t.t[0][0] = u.x * u.x * vt + ct;
+ t.t[0][1] = u.x * u.y * vt - u.z * st;
+ t.t[0][2] = u.x * u.z * vt + u.y * st;
+ t.t[1][0] = u.x * u.y * vt + u.z * st;
+ t.t[1][1] = u.y * u.y * vt + ct;
+ t.t[1][2] = u.y * u.z * vt - u.x * st;
+ t.t[2][0] = u.x * u.z * vt - u.y * st;
+ t.t[2][1] = u.y * u.z * vt + u.x * st;
+ t.t[2][2] = u.z * u.z * vt + ct;
+
+ return t;
+}
+
+#endif // _VECMATH_HPP_INCLUDED
@@ -0,0 +1,183 @@
+//==================================================================
+// IrradianceCache.cpp  Ward style irradiance cache
+//==================================================================
+
+#include "IrradianceCache.hpp"
+
+#define IRRADIANCECACHE_MAX_DEPTH 24 // octree levels below the root
+
+
+//==================================================================
+// IrradianceCache::IrradianceCache
+//==================================================================
+IrradianceCache::IrradianceCache()
+{
+ init(0.2, vector3d_t(-1,-1,-1), vector3d_t(1,1,1));
+}
+
+
+//==================================================================
+// IrradianceCache::init
+//==================================================================
+void IrradianceCache::init(double maxError, vector3d_t bboxMin,
+                           vector3d_t bboxMax)
+{
+ cache_node_t root;
+ double size;
+
+ d_maxError = maxError;
+ d_records.clear();
+ d_nodes.clear();
+
+ // the root is the smallest cube around the region
+ root.center = 0.5 * (bboxMin + bboxMax);
+ size = bboxMax.x - bboxMin.x;
+ if(bboxMax.y - bboxMin.y > size)
+  size = bboxMax.y - bboxMin.y;
+ if(bboxMax.z - bboxMin.z > size)
+  size = bboxMax.z - bboxMin.z;
+ root.halfSize = (size > 0) ? 0.5 * size : 1;
+ for(int i = 0; i < 8; i++)
+  root.child[i] = -1;
+ d_nodes.push_back(root);
+}
+
+
+//==================================================================
+// IrradianceCache::weight
+//==================================================================
+double IrradianceCache::weight(const irradiance_record_t &record,
+                               const vector3d_t &pos,
+                               const vector3d_t &normal) const
+{
+ vector3d_t d = pos - record.pos;
+ double nDotN, error;
+
+ // skip records in front of pos
+ if(dot(d, normal + record.normal) < -0.1 * record.radius)
+  return 0;
+
+ nDotN = dot(normal, record.normal);
+ error = norm(d)/record.radius + sqrt((nDotN < 1) ? 1 - nDotN : 0);
+ if(error >= d_maxError)
+  return 0;
+ if(error < 1e-9)
+  return 1e9;
+ return 1.0/error;
+}
+
+
+//==================================================================
+// IrradianceCache::lookupNode
+//==================================================================
+void IrradianceCache::lookupNode(int node, const vector3d_t &pos,
+                                 const vector3d_t &normal, rgb_t &sum,
+                                 double &sumWeight) const
+{
+ const cache_node_t &n = d_nodes[node];
+ double w;
+
+ for(unsigned int i = 0; i < n.records.size(); i++)
+ {
+  const irradiance_record_t &record = d_records[n.records[i]];
+  w = weight(record, pos, normal);
+  if(w > 0)
+  {
+   sum.r += w * record.irradiance.r;
+   sum.g += w * record.irradiance.g;
+   sum.b += w * record.irradiance.b;
+   sumWeight += w;
+  }
+ }
+
+ // records of a child are valid up to a half size beyond its cube
+ for(int i = 0; i < 8; i++)
+ {
+  if(n.child[i] < 0)
+   continue;
+  const cache_node_t &c = d_nodes[n.child[i]];
+  double reach = 2 * c.halfSize;
+  if(fabs(pos.x - c.center.x) <= reach &&
+     fabs(pos.y - c.center.y) <= reach &&
+     fabs(pos.z - c.center.z) <= reach)
+   lookupNode(n.child[i], pos, normal, sum, sumWeight);
+ }
+}
+
+
+//==================================================================
+// IrradianceCache::lookup
+//==================================================================
+bool IrradianceCache::lookup(const vector3d_t &pos, const vector3d_t &normal,
+                             rgb_t &irradiance) const
+{
+ rgb_t sum;
+ double sumWeight = 0;
+
+ lookupNode(0, pos, normal, sum, sumWeight);
+ if(sumWeight <= 0)
+  return false;
+
+ irradiance.r = sum.r/sumWeight;
+ irradiance.g = sum.g/sumWeight;
+ irradiance.b = sum.b/sumWeight;
+ return true;
+}
+
+
+//==================================================================
+// IrradianceCache::insert
+//==================================================================
+void IrradianceCache::insert(const vector3d_t &pos, const vector3d_t &normal,
+                             const rgb_t &irradiance, double radius)
+{
+ irradiance_record_t record;
+ double validRadius;
+ int node = 0, octant, depth = 0;
+
+ if(radius <= 0)
+  return;
+ record.pos = pos;
+ record.normal = normal;
+ record.irradiance = irradiance;
+ record.radius = radius;
+ d_records.push_back(record);
+
+ // the record is used within maxError * radius of pos
+ validRadius = d_maxError * radius;
+
+ // records outside the root stay in the root
+ const cache_node_t &root = d_nodes[0];
+ if(fabs(pos.x - root.center.x) > root.halfSize ||
+    fabs(pos.y - root.center.y) > root.halfSize ||
+    fabs(pos.z - root.center.z) > root.halfSize)
+ {
+  d_nodes[0].records.push_back(d_records.size() - 1);
+  return;
+ }
+
+ // go down while the child is still large enough
+ while(0.5 * d_nodes[node].halfSize >= validRadius &&
+       depth < IRRADIANCECACHE_MAX_DEPTH)
+ {
+  vector3d_t center = d_nodes[node].center;
+  double quarter = 0.5 * d_nodes[node].halfSize;
+  octant = ((pos.x > center.x) ? 1 : 0) | ((pos.y > center.y) ? 2 : 0) |
+           ((pos.z > center.z) ? 4 : 0);
+  if(d_nodes[node].child[octant] < 0)
+  {
+   cache_node_t child;
+   child.center.x = center.x + ((octant & 1) ? quarter : -quarter);
+   child.center.y = center.y + ((octant & 2) ? quarter : -quarter);
+   child.center.z = center.z + ((octant & 4) ? quarter : -quarter);
+   child.halfSize = quarter;
+   for(int i = 0; i < 8; i++)
+    child.child[i] = -1;
+   d_nodes.push_back(child);
+   d_nodes[node].child[octant] = d_nodes.size() - 1;
+  }
+  node = d_nodes[node].child[octant];
+  depth++;
+ }
+ d_nodes[node].records.push_back(d_records.size() - 1);
+}
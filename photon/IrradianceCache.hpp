@@ -0,0 +1,92 @@
+//==================================================================
+// IrradianceCache.hpp  Ward style irradiance cache. Irradiance
+//                      estimates are kept at sparse surface points
+//                      and interpolated at nearby points, so the
+//                      photon maps are searched only where no cached
+//                      record is close enough.
+//==================================================================
+
+#ifndef _IRRADIANCECACHE_HPP_INCLUDED
+#define _IRRADIANCECACHE_HPP_INCLUDED
+
+#include <vector>
+#include "data_types.hpp"
+
+using namespace std;
+
+//==================================================================
+// struct _irradiance_record  A cached irradiance estimate
+//==================================================================
+typedef struct _irradiance_record
+{
+ vector3d_t pos;     // surface position
+ vector3d_t normal;  // surface normal at pos
+ rgb_t irradiance;   // irradiance at pos
+ double radius;      // distance over which irradiance varies (R)
+}irradiance_record_t;
+
+
+//==================================================================
+// struct _cache_node  A node of the octree. Each record is held by
+//                     the smallest node that is at least twice as
+//                     large as the region the record is valid in.
+//==================================================================
+typedef struct _cache_node
+{
+ vector3d_t center;     // center of the cube
+ double halfSize;       // half the side of the cube
+ int child[8];          // index of child nodes, -1 if none
+ vector<int> records;   // index of records held by this node
+}cache_node_t;
+
+
+//==================================================================
+// class IrradianceCache
+//==================================================================
+class IrradianceCache
+{
+ public:
+  IrradianceCache();
+   // The default constructor. Creates an empty cache.
+
+  ~IrradianceCache() {}
+   // The destructor.
+
+  void init(double maxError, vector3d_t bboxMin, vector3d_t bboxMax);
+   // Empty the cache and set it up for a scene.
+   //  maxError  Allowed error (Ward's a). A record is used at
+   //            points where its weight exceeds 1/maxError.
+   //  bboxMin, bboxMax  Region where most records will be. Records
+   //            outside it are still cached, but searched linearly.
+
+  bool lookup(const vector3d_t &pos, const vector3d_t &normal,
+              rgb_t &irradiance) const;
+   // Interpolate irradiance from the cached records.
+   //  pos, normal  Surface position and normal
+   //  irradiance   Set to the weighted average of the records that
+   //               are valid at pos.
+   //  return       false if no record is valid at pos.
+
+  void insert(const vector3d_t &pos, const vector3d_t &normal,
+              const rgb_t &irradiance, double radius);
+   // Add a record to the cache.
+   //  radius  Distance over which the irradiance is expected to
+   //          change significantly, e.g. the radius of the photon
+   //          map search that computed it.
+
+  int getNumRecords() const {return d_records.size();}
+   //  return  Number of records in the cache.
+
+ private:
+  void lookupNode(int node, const vector3d_t &pos,
+                  const vector3d_t &normal, rgb_t &sum,
+                  double &sumWeight) const;
+  double weight(const irradiance_record_t &record, const vector3d_t &pos,
+                const vector3d_t &normal) const;
+
+  double d_maxError;
+  vector<cache_node_t> d_nodes;          // d_nodes[0] is the root
+  vector<irradiance_record_t> d_records;
+};
+
+#endif // _IRRADIANCECACHE_HPP_INCLUDED
@@ -1,11 +1,22 @@
 #include "PhotonMap.hpp"
 #include <iostream>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 //==================================================================
 PhotonMap::PhotonMap(const int maxPhot)
 //==================================================================
 {
  d_photons = NULL;
+ d_precomputed = NULL;
+ d_mapped = false;
+ d_estimateRadius = 0.2;
+ d_estimateCount = 1500;
+#ifdef PHOTON_COMPACT
+ d_compact = NULL;
+ d_quantStep = 1;
+#endif
  
  if(init(maxPhot) == -1)
   exit(-1);
@@ -32,12 +43,7 @@ int PhotonMap::init(const int maxPhot)
  d_storedPhotons = 0;
  d_prevScale = 1;
  d_maxPhotons = maxPhot;
- 
- if(d_photons)
- {
-  free(d_photons);
-  d_photons = NULL;
- }
+ release();
   
  d_photons = (photon_t *)malloc( (d_maxPhotons + 1) * sizeof(photon_t) );
  if(d_photons == NULL)
@@ -54,53 +60,101 @@ int PhotonMap::init(const int maxPhot)
 PhotonMap::~PhotonMap()
 //==================================================================
 {
- free(d_photons);
+ release();
 }
 
 
 //==================================================================
-void PhotonMap::store(const rgb_t powe, const vector3d_t posi, 
-                      const vector3d_t direc)
+void PhotonMap::release()
 //==================================================================
 {
- float power[3], pos[3], dir[3];
- power[0] = powe.r; power[1] = powe.g; power[2] = powe.b;
- pos[0] = posi.x; pos[1] = posi.y; pos[2] = posi.z;
- dir[0] = direc.x; dir[1] = direc.y; dir[2] = direc.z;
- 
- if(d_storedPhotons > d_maxPhotons)
-  return;
+ if(!d_mapped)
+  free(d_photons);
+ d_mapped = false;
+ d_photons = NULL;
+#ifdef PHOTON_COMPACT
+ d_compact = NULL;
+#endif
+ free(d_precomputed);
+ d_precomputed = NULL;
+ d_numPrecomputed = 0;
+}
+
+
+//==================================================================
+void PhotonMap::store(const rgb_t power, const vector3d_t pos, 
+                      const vector3d_t dir)
+//==================================================================
+{
+ // the surface is taken to face the incoming photon
+ photon_t photon = makePhoton(power, pos, dir, -1 * dir);
+ store(&photon, 1);
+}
+
+
+//==================================================================
+void PhotonMap::store(const photon_t *photons, const int count)
+//==================================================================
+{
+ for(int n = 0; n < count; n++)
+ {
+  if(d_storedPhotons >= d_maxPhotons)
+   return;
  
- d_storedPhotons++;
+  d_storedPhotons++;
  
- photon_t *const node = &d_photons[d_storedPhotons];
- for (int i=0; i<3; i++) 
- {
-  node->pos[i] = pos[i];
-  if (node->pos[i] < d_bboxMin[i])
-   d_bboxMin[i] = node->pos[i];
-  if (node->pos[i] > d_bboxMax[i])
-   d_bboxMax[i] = node->pos[i];
-  node->power[i] = power[i];
+  photon_t *const node = &d_photons[d_storedPhotons];
+  *node = photons[n];
+  for (int i=0; i<3; i++) 
+  {
+   if (node->pos[i] < d_bboxMin[i])
+    d_bboxMin[i] = node->pos[i];
+   if (node->pos[i] > d_bboxMax[i])
+    d_bboxMax[i] = node->pos[i];
+  }
  }
-  
- int theta = int( acos(dir[2])*(256.0/M_PI) );
- if (theta>255)
-  node->theta = 255;
+}
+
+
+//==================================================================
+photon_t PhotonMap::makePhoton(const rgb_t power, const vector3d_t pos, 
+                               const vector3d_t dir, const vector3d_t normal)
+//==================================================================
+{
+ photon_t photon;
+
+ photon.pos[0] = pos.x; photon.pos[1] = pos.y; photon.pos[2] = pos.z;
+ photon.power[0] = power.r; photon.power[1] = power.g; 
+ photon.power[2] = power.b;
+ photon.plane = 0;
+ encodeDir(dir, photon.theta, photon.phi);
+ encodeDir(normal, photon.normalTheta, photon.normalPhi);
+
+ return photon;
+}
+
+
+//==================================================================
+void PhotonMap::encodeDir(const vector3d_t dir, unsigned char &theta,
+                          unsigned char &phi)
+//==================================================================
+{
+ int t = int( acos((float)dir.z)*(256.0/M_PI) );
+ if (t>255)
+  theta = 255;
  else
-  node->theta = (unsigned char)theta;
+  theta = (unsigned char)t;
   
- int phi = int( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
- if (phi>255)
-  node->phi = 255;
- else if (phi<0)
-  node->phi = (unsigned char)(phi+256);
+ int p = int( atan2((float)dir.y,(float)dir.x)*(256.0/(2.0*M_PI)) );
+ if (p>255)
+  phi = 255;
+ else if (p<0)
+  phi = (unsigned char)(p+256);
  else
-  node->phi = (unsigned char)phi;
+  phi = (unsigned char)p;
 }
 
 
-
 //==================================================================
 void PhotonMap::scalePhotonPower(const float scale)
 //==================================================================
@@ -111,99 +165,230 @@ void PhotonMap::scalePhotonPower(const float scale)
   d_photons[i].power[1] *= scale;
   d_photons[i].power[2] *= scale;
  }
- d_prevScale = d_storedPhotons;
+ d_prevScale = d_storedPhotons + 1;
 }
 
 
 //==================================================================
-void PhotonMap::balance(void)
+void PhotonMap::balance(int numThreads)
 //==================================================================
 {
-  if (d_storedPhotons > 1) {
-    // allocate two temporary arrays for the balancing procedure
-    photon_t **pa1 = (photon_t**)malloc(sizeof(photon_t*)*(d_storedPhotons+1));
-    photon_t **pa2 = (photon_t**)malloc(sizeof(photon_t*)*(d_storedPhotons+1));
+  if (d_mapped)   // loaded maps are balanced, and read only
+    return;
 
-    for (int i=0; i<= d_storedPhotons; i++)
-      pa2[i] = &d_photons[i];
-
-    balanceSegment( pa1, pa2, 1, 1, d_storedPhotons );
-    free(pa2);
+  if (d_storedPhotons > 1) {
+    // order[i] is the position in d_photons of heap node i
+    int *order = (int *)malloc(sizeof(int)*(d_storedPhotons+1));
+    if (order == NULL) {
+      cerr << "PhotonMap: ERROR allocating memory for balancing." << endl;
+      exit(-1);
+    }
 
-    // reorganize balanced kd-tree (make a heap)
-    int d, j=1, foo=1;
-    photon_t foo_photon = d_photons[j];
+    balance_task_t task;
+    task.map = this;
+    task.order = order;
+    task.index = 1;
+    task.start = 1;
+    task.end = d_storedPhotons;
+    task.numThreads = (numThreads < 1) ? 1 : numThreads;
+    for (int i=0; i<3; i++) {
+      task.bboxMin[i] = d_bboxMin[i];
+      task.bboxMax[i] = d_bboxMax[i];
+    }
+    balanceSegment( &task );
 
+    // reorganize balanced kd-tree (make a heap), following each
+    // cycle of the permutation and marking visited nodes with 0
     for (int i=1; i<= d_storedPhotons; i++) {
-      d=pa1[j]-d_photons;
-      pa1[j] = NULL;
-      if (d != foo)
-        d_photons[j] = d_photons[d];
-      else {
-        d_photons[j] = foo_photon;
-
-        if (i<d_storedPhotons) {
-          for (;foo<=d_storedPhotons; foo++)
-            if (pa1[foo] != NULL)
-              break;
-          foo_photon = d_photons[foo];
-          j = foo;
-        }
+      if (order[i] == 0)
         continue;
+      photon_t foo_photon = d_photons[i];
+      int j = i;
+      for (;;) {
+        int d = order[j];
+        order[j] = 0;
+        if (d == i) {
+          d_photons[j] = foo_photon;
+          break;
+        }
+        d_photons[j] = d_photons[d];
+        j = d;
       }
-      j = d;
     }
-    free(pa1);
+    free(order);
   }
 
   d_halfStoredPhotons = d_storedPhotons/2-1;
+#ifdef PHOTON_COMPACT
+  compact();
+#endif
+}
+
+
+#ifdef PHOTON_COMPACT
+//==================================================================
+void PhotonMap::compact()
+//==================================================================
+{
+ const unsigned int maxCoord = (1 << 21) - 1;
+ float extent = 0;
+ 
+ // one step size for all axes keeps distances isotropic
+ for(int i = 0; i < 3; i++)
+  if(d_bboxMax[i] - d_bboxMin[i] > extent)
+   extent = d_bboxMax[i] - d_bboxMin[i];
+ d_quantStep = (extent > 0) ? extent/maxCoord : 1;
+ 
+ // a compact photon never extends past the photon it replaces 
+ // (16i+16 <= 32(i+1)), so a forward pass can convert in place
+ compact_photon_t *c = (compact_photon_t *)d_photons;
+ for(int i = 1; i <= d_storedPhotons; i++)
+ {
+  const photon_t p = d_photons[i];
+  compact_photon_t cp;
+  
+  cp.pos = 0;
+  for(int j = 0; j < 3; j++)
+  {
+   float q = (p.pos[j] - d_bboxMin[j])/d_quantStep + 0.5f;
+   unsigned long long coord = (q <= 0) ? 0 : 
+                              (q >= maxCoord) ? maxCoord : (unsigned int)q;
+   cp.pos |= coord << (21 * j);
+  }
+  
+  // Ward's RGBE: mantissas share the exponent of the largest component
+  float v = p.power[0];
+  if(p.power[1] > v) v = p.power[1];
+  if(p.power[2] > v) v = p.power[2];
+  if(v < 1e-32f)
+  {
+   cp.rgbe[0] = cp.rgbe[1] = cp.rgbe[2] = cp.rgbe[3] = 0;
+  }
+  else
+  {
+   int e;
+   v = frexp(v, &e) * 256.0f/v;
+   for(int j = 0; j < 3; j++)
+    cp.rgbe[j] = (p.power[j] > 0) ? (unsigned char)(p.power[j] * v) : 0;
+   cp.rgbe[3] = (unsigned char)(e + 128);
+  }
+  
+  cp.theta = p.theta;
+  cp.phi = p.phi;
+  cp.plane = p.plane;
+  cp.normal = (p.normalTheta >> 1) | ((p.normalPhi >> 1) << 7);
+  c[i] = cp;
+ }
+ 
+ d_compact = (compact_photon_t *)realloc(d_photons, 
+                          (d_storedPhotons + 1) * sizeof(compact_photon_t));
+ if(d_compact == NULL)
+  d_compact = c;
+ d_photons = (photon_t *)d_compact;
+}
+#endif
+
+
+//==================================================================
+inline const stored_photon_t *PhotonMap::storedPhoton(const int index) const
+//==================================================================
+{
+#ifdef PHOTON_COMPACT
+ return &d_compact[index];
+#else
+ return &d_photons[index];
+#endif
+}
+
+
+//==================================================================
+inline float PhotonMap::photonPos(const stored_photon_t *p, const int axis)
+//==================================================================
+{
+#ifdef PHOTON_COMPACT
+ return (float)((p->pos >> (21 * axis)) & ((1 << 21) - 1));
+#else
+ return p->pos[axis];
+#endif
+}
+
+
+//==================================================================
+inline int PhotonMap::photonPlane(const stored_photon_t *p)
+//==================================================================
+{
+ return p->plane;
+}
+
+
+//==================================================================
+inline void PhotonMap::photonPower(const stored_photon_t *p, rgb_t &power)
+//==================================================================
+{
+#ifdef PHOTON_COMPACT
+ if(p->rgbe[3] == 0)
+  return;
+ const float f = ldexp(1.0f, (int)p->rgbe[3] - (128 + 8));
+ power.r += (p->rgbe[0] + 0.5f) * f;
+ power.g += (p->rgbe[1] + 0.5f) * f;
+ power.b += (p->rgbe[2] + 0.5f) * f;
+#else
+ power.r += p->power[0];
+ power.g += p->power[1];
+ power.b += p->power[2];
+#endif
 }
 
 
 //==================================================================
 rgb_t PhotonMap::irradianceEstimate(const vector3d_t pos, 
                           const vector3d_t normal, const float maxDist, 
-                          const int nPhotons) const
+                          const int nPhotons, float *radius) const
 //==================================================================
 {
  rgb_t irrad;
  
  nearest_photons_t np;
  np.dist2 = (float *)alloca( sizeof(float) * (nPhotons + 1) );
- np.index = (const photon_t **)alloca( sizeof(photon_t *) * (nPhotons + 1) );
+ np.index = (const stored_photon_t **)alloca( sizeof(stored_photon_t *) * 
+                                             (nPhotons + 1) );
  
- np.pos[0] = pos.x; np.pos[1] = pos.y; np.pos[2] = pos.z;
  np.max = nPhotons;
  np.found = 0;
  np.got_heap = 0;
- np.dist2[0] = maxDist * maxDist;
+ setQuery(&np, pos, maxDist);
  
  // locate the nearest d_photons
  locatePhotons( &np, 1 );
  
  // if less than 8 d_photons return
  if( np.found < 8 )
+ {
+  if(radius)
+   *radius = maxDist;
   return irrad;
+ }
  
  vector3d_t pDir;
  
  // sum irradiance from all d_photons
  for(int i = 1; i <= np.found; i++)
  {
-  const photon_t *p = np.index[i];
+  const stored_photon_t *p = np.index[i];
   
   // the photonDir() call and the following if can be 
   // omitted for speed if the scene does not have any
   // thin surfaces
   pDir = photonDir(p);
   if( dot(pDir, normal) < 0.0f )
-  {
-   irrad.r += p->power[0];
-   irrad.g += p->power[1];
-   irrad.b += p->power[2];
-  }
+   photonPower(p, irrad);
  }
  
+#ifdef PHOTON_COMPACT
+ np.dist2[0] *= d_quantStep * d_quantStep;
+#endif
+ if(radius)
+  *radius = sqrt(np.dist2[0]);
  const float tmp = (1.0f/M_PI)/(np.dist2[0]); // estimate of density
  
  irrad = irrad * tmp;
@@ -211,38 +396,210 @@ rgb_t PhotonMap::irradianceEstimate(const vector3d_t pos,
 }
 
 
+//==================================================================
+int PhotonMap::gatherPhotons(const vector3d_t pos, const vector3d_t normal,
+                             const float maxDist, rgb_t &power) const
+//==================================================================
+{
+  nearest_photons_t np;
+  float maxDist2;
+  int stack[PHOTONMAP_MAX_DEPTH + 1];
+  int top = 0, count = 0;
+
+  np.dist2 = &maxDist2;
+  setQuery( &np, pos, maxDist );
+  if (d_storedPhotons < 1)
+    return 0;
+
+  // depth first through every subtree within reach. Unlike 
+  // locatePhotons this also visits the children of the few nodes 
+  // just above d_halfStoredPhotons
+  stack[top++] = 1;
+  while (top > 0) {
+    const int node = stack[--top];
+    const stored_photon_t *p = storedPhoton(node);
+    if (2*node <= d_storedPhotons) {
+      const int plane = photonPlane(p);
+      const float dist1 = np.pos[ plane ] - photonPos(p, plane);
+      const int nearChild = (dist1 > 0.0) ? 2*node+1 : 2*node;
+      const int farChild = (dist1 > 0.0) ? 2*node : 2*node+1;
+      if (dist1*dist1 < maxDist2 && farChild <= d_storedPhotons)
+        stack[top++] = farChild;
+      if (nearChild <= d_storedPhotons)
+        stack[top++] = nearChild;
+    }
+    if (photonDist2( &np, node ) < maxDist2 && 
+        dot( photonDir(p), normal ) < 0.0f) {
+      photonPower( p, power );
+      count++;
+    }
+  }
+  return count;
+}
+
+
 //==================================================================
 void PhotonMap::locatePhotons(nearest_photons_t *const np, 
                               const int index) const
 //==================================================================
 {
-  const photon_t *p = &d_photons[index];
-  float dist1;
+  // Nodes below d_halfStoredPhotons are split nodes. The stack holds 
+  // the split nodes on the path to the current node. Each is visited 
+  // after its near subtree and, if within reach, its far subtree, as 
+  // in the recursive version.
+  struct {
+    int index;
+    float dist1;  // signed distance of np->pos from the split plane
+    bool farDone; // far subtree has been searched
+  } stack[PHOTONMAP_MAX_DEPTH];
+  int top = 0;
+  int node = index;
 
-  if (index < d_halfStoredPhotons) {
-    dist1 = np->pos[ p->plane ] - p->pos[ p->plane ];
+  for (;;) {
+    // walk down the near side
+    while (node < d_halfStoredPhotons) {
+      if (2*node+1 < d_halfStoredPhotons && 4*node >= d_halfStoredPhotons) {
+        locateQuad( np, node );
+        break;
+      }
+      if (2*node >= d_halfStoredPhotons) {
+        float childDist2[2];
+        childDist2[0] = photonDist2( np, 2*node );
+        childDist2[1] = photonDist2( np, 2*node+1 );
+        locatePair( np, node, childDist2 );
+        break;
+      }
+      const stored_photon_t *p = storedPhoton(node);
+      const int plane = photonPlane(p);
+      stack[top].index = node;
+      stack[top].dist1 = np->pos[ plane ] - photonPos(p, plane);
+      stack[top].farDone = false;
+      node = (stack[top].dist1 > 0.0) ? 2*node+1 : 2*node;
+      top++;
+    }
+    if (node >= d_halfStoredPhotons)
+      insertPhoton( np, node, photonDist2(np, node) );
 
-    if (dist1>0.0) { // if dist1 is positive search right plane
-      locatePhotons( np, 2*index+1 );
-      if ( dist1*dist1 < np->dist2[0] )
-        locatePhotons( np, 2*index );
-    } else {         // dist1 is negative search left first
-      locatePhotons( np, 2*index );
-      if ( dist1*dist1 < np->dist2[0] )
-        locatePhotons( np, 2*index+1 );
+    // climb until a far subtree needs searching
+    node = 0;
+    while (top > 0) {
+      const float dist1 = stack[top-1].dist1;
+      if (!stack[top-1].farDone) {
+        stack[top-1].farDone = true;
+        if ( dist1*dist1 < np->dist2[0] ) {
+          node = (dist1 > 0.0) ? 2*stack[top-1].index : 
+                                 2*stack[top-1].index+1;
+          break;
+        }
+      }
+      top--;
+      insertPhoton( np, stack[top].index, 
+                    photonDist2(np, stack[top].index) );
     }
+    if (node == 0)
+      return;
+  }
+}
+
+
+//==================================================================
+void PhotonMap::locateQuad(nearest_photons_t *const np, 
+                           const int index) const
+//==================================================================
+{
+  float leafDist2[4];
+  quadDist2( np, 4*index, leafDist2 );
+
+  const stored_photon_t *p = storedPhoton(index);
+  const int plane = photonPlane(p);
+  const float dist1 = np->pos[ plane ] - photonPos(p, plane);
+
+  if (dist1>0.0) {
+    locatePair( np, 2*index+1, leafDist2+2 );
+    if ( dist1*dist1 < np->dist2[0] )
+      locatePair( np, 2*index, leafDist2 );
+  } else {
+    locatePair( np, 2*index, leafDist2 );
+    if ( dist1*dist1 < np->dist2[0] )
+      locatePair( np, 2*index+1, leafDist2+2 );
+  }
+  insertPhoton( np, index, photonDist2(np, index) );
+}
+
+
+//==================================================================
+void PhotonMap::locatePair(nearest_photons_t *const np, 
+                           const int index, const float *childDist2) const
+//==================================================================
+{
+  const stored_photon_t *p = storedPhoton(index);
+  const int plane = photonPlane(p);
+  const float dist1 = np->pos[ plane ] - photonPos(p, plane);
+
+  if (dist1>0.0) {
+    insertPhoton( np, 2*index+1, childDist2[1] );
+    if ( dist1*dist1 < np->dist2[0] )
+      insertPhoton( np, 2*index, childDist2[0] );
+  } else {
+    insertPhoton( np, 2*index, childDist2[0] );
+    if ( dist1*dist1 < np->dist2[0] )
+      insertPhoton( np, 2*index+1, childDist2[1] );
   }
+  insertPhoton( np, index, photonDist2(np, index) );
+}
 
-  // compute squared distance between current photon and np->pos
 
-  dist1 = p->pos[0] - np->pos[0];
+//==================================================================
+inline float PhotonMap::photonDist2(const nearest_photons_t *np, 
+                                    const int index) const
+//==================================================================
+{
+  const stored_photon_t *p = storedPhoton(index);
+  float dist1 = photonPos(p, 0) - np->pos[0];
   float dist2 = dist1*dist1;
-  dist1 = p->pos[1] - np->pos[1];
+  dist1 = photonPos(p, 1) - np->pos[1];
   dist2 += dist1*dist1;
-  dist1 = p->pos[2] - np->pos[2];
+  dist1 = photonPos(p, 2) - np->pos[2];
   dist2 += dist1*dist1;
-  
+  return dist2;
+}
+
+
+//==================================================================
+inline void PhotonMap::quadDist2(const nearest_photons_t *np, 
+                                 const int first, float *dist2) const
+//==================================================================
+{
+#if defined(__SSE__) && !defined(PHOTON_COMPACT)
+  // same operations as photonDist2, four photons at a time. Each load 
+  // takes pos and the word after it, which the transpose leaves in w
+  __m128 x = _mm_loadu_ps( d_photons[first].pos );
+  __m128 y = _mm_loadu_ps( d_photons[first+1].pos );
+  __m128 z = _mm_loadu_ps( d_photons[first+2].pos );
+  __m128 w = _mm_loadu_ps( d_photons[first+3].pos );
+  _MM_TRANSPOSE4_PS( x, y, z, w );
+  __m128 d = _mm_sub_ps( x, _mm_set1_ps(np->pos[0]) );
+  __m128 sum = _mm_mul_ps( d, d );
+  d = _mm_sub_ps( y, _mm_set1_ps(np->pos[1]) );
+  sum = _mm_add_ps( sum, _mm_mul_ps(d, d) );
+  d = _mm_sub_ps( z, _mm_set1_ps(np->pos[2]) );
+  sum = _mm_add_ps( sum, _mm_mul_ps(d, d) );
+  _mm_storeu_ps( dist2, sum );
+#else
+  for (int i=0; i<4; i++)
+    dist2[i] = photonDist2( np, first+i );
+#endif
+}
+
+
+//==================================================================
+inline void PhotonMap::insertPhoton(nearest_photons_t *const np, 
+                                    const int index, 
+                                    const float dist2) const
+//==================================================================
+{
   if ( dist2 < np->dist2[0] ) {
+    const stored_photon_t *p = storedPhoton(index);
     // we found a photon  [:)] Insert it in the candidate list
 
     if ( np->found < np->max ) {
@@ -256,7 +613,7 @@ void PhotonMap::locatePhotons(nearest_photons_t *const np,
       if (np->got_heap==0) { // Do we need to build the heap?
         // Build heap
         float dst2;
-        const photon_t *phot;
+        const stored_photon_t *phot;
         int half_found = np->found>>1;
         for ( int k=half_found; k>=1; k--) {
           parent=k;
@@ -303,7 +660,25 @@ void PhotonMap::locatePhotons(nearest_photons_t *const np,
 
 
 //==================================================================
-vector3d_t PhotonMap::photonDir(const photon_t *p) const
+void PhotonMap::getBoundingBox(vector3d_t &bboxMin, vector3d_t &bboxMax) const
+//==================================================================
+{
+ bboxMin = vector3d_t(d_bboxMin[0], d_bboxMin[1], d_bboxMin[2]);
+ bboxMax = vector3d_t(d_bboxMax[0], d_bboxMax[1], d_bboxMax[2]);
+}
+
+
+//==================================================================
+void PhotonMap::setEstimateSize(const float maxDist, const int nPhotons)
+//==================================================================
+{
+ d_estimateRadius = maxDist;
+ d_estimateCount = nPhotons;
+}
+
+
+//==================================================================
+vector3d_t PhotonMap::photonDir(const stored_photon_t *p) const
 //==================================================================
 {
  vector3d_t dir;
@@ -315,11 +690,364 @@ vector3d_t PhotonMap::photonDir(const photon_t *p) const
 
 
 //==================================================================
-void PhotonMap::balanceSegment(photon_t **pbal, photon_t **porg, 
-                               const int index, const int start, 
-                               const int end)
+vector3d_t PhotonMap::photonNormal(const stored_photon_t *p) const
+//==================================================================
+{
+#ifdef PHOTON_COMPACT
+ const int theta = ((p->normal & 127) << 1) | 1;
+ const int phi = ((p->normal >> 7) << 1) | 1;
+#else
+ const int theta = p->normalTheta;
+ const int phi = p->normalPhi;
+#endif
+ vector3d_t normal;
+ normal.x = d_sinTheta[theta] * d_cosPhi[phi];
+ normal.y = d_sinTheta[theta] * d_sinPhi[phi];
+ normal.z = d_cosTheta[theta];
+ return normal;
+}
+
+
+//==================================================================
+vector3d_t PhotonMap::photonPosition(const stored_photon_t *p) const
+//==================================================================
+{
+#ifdef PHOTON_COMPACT
+ return vector3d_t(d_bboxMin[0] + photonPos(p, 0) * d_quantStep,
+                   d_bboxMin[1] + photonPos(p, 1) * d_quantStep,
+                   d_bboxMin[2] + photonPos(p, 2) * d_quantStep);
+#else
+ return vector3d_t(p->pos[0], p->pos[1], p->pos[2]);
+#endif
+}
+
+
+//==================================================================
+void PhotonMap::setQuery(nearest_photons_t *const np, const vector3d_t pos, 
+                         const float maxDist) const
+//==================================================================
+{
+ np->pos[0] = pos.x; np->pos[1] = pos.y; np->pos[2] = pos.z;
+ np->dist2[0] = maxDist * maxDist;
+#ifdef PHOTON_COMPACT
+ // search in the fixed point units of the stored photons
+ for(int i = 0; i < 3; i++)
+  np->pos[i] = (np->pos[i] - d_bboxMin[i])/d_quantStep;
+ np->dist2[0] /= d_quantStep * d_quantStep;
+#endif
+}
+
+
+//==================================================================
+int PhotonMap::writeAligned(FILE *file, const void *data, const size_t size)
+//==================================================================
+{
+ static const char zeros[PHOTONMAP_FILE_ALIGN] = {0};
+ long pad;
+
+ if(size > 0 && fwrite(data, size, 1, file) != 1)
+  return -1;
+ pad = ftell(file) % PHOTONMAP_FILE_ALIGN;
+ if(pad < 0)
+  return -1;
+ if(pad > 0 && fwrite(zeros, PHOTONMAP_FILE_ALIGN - pad, 1, file) != 1)
+  return -1;
+ return 0;
+}
+
+
+//==================================================================
+int PhotonMap::save(FILE *file) const
+//==================================================================
+{
+ photon_file_header_t header;
+
+ memset(&header, 0, sizeof(header));
+ memcpy(header.magic, PHOTONMAP_FILE_MAGIC, sizeof(PHOTONMAP_FILE_MAGIC));
+ header.version = PHOTONMAP_FILE_VERSION;
+ header.photonSize = sizeof(stored_photon_t);
+ header.storedPhotons = d_storedPhotons;
+ header.numPrecomputed = d_numPrecomputed;
+ for(int i = 0; i < 3; i++)
+ {
+  header.bboxMin[i] = d_bboxMin[i];
+  header.bboxMax[i] = d_bboxMax[i];
+ }
+#ifdef PHOTON_COMPACT
+ header.quantStep = d_quantStep;
+#else
+ header.quantStep = 1;
+#endif
+ header.estimateRadius = d_estimateRadius;
+ header.estimateCount = d_estimateCount;
+
+ // photon 0 is unused, but saved to keep kd-tree indices
+ if(writeAligned(file, &header, sizeof(header)) != 0 ||
+    writeAligned(file, d_photons, 
+                 (d_storedPhotons + 1) * sizeof(stored_photon_t)) != 0 ||
+    writeAligned(file, d_precomputed, (d_numPrecomputed > 0) ? 
+         (d_numPrecomputed + 1) * sizeof(precomputed_irradiance_t) : 0) != 0)
+ {
+  cerr << "PhotonMap: ERROR writing photon map." << endl;
+  return -1;
+ }
+ return 0;
+}
+
+
+//==================================================================
+static inline long photon_file_aligned(const long bytes)
+//==================================================================
+{
+ // bytes taken in the file by a part of a map, see PhotonMap::save
+ return (bytes + PHOTONMAP_FILE_ALIGN - 1) & ~(long)(PHOTONMAP_FILE_ALIGN - 1);
+}
+
+
+//==================================================================
+int PhotonMap::load(const char *data, const long size, long &offset)
+//==================================================================
+{
+ const photon_file_header_t *header;
+ long headerBytes, photonBytes, precomputedBytes;
+ 
+ if(offset < 0 || offset % PHOTONMAP_FILE_ALIGN != 0 || 
+    offset + (long)sizeof(photon_file_header_t) > size)
+ {
+  cerr << "PhotonMap: ERROR photon map file is truncated." << endl;
+  return -1;
+ }
+ header = (const photon_file_header_t *)(data + offset);
+ if(memcmp(header->magic, PHOTONMAP_FILE_MAGIC, 
+           sizeof(PHOTONMAP_FILE_MAGIC)) != 0 ||
+    header->version != PHOTONMAP_FILE_VERSION)
+ {
+  cerr << "PhotonMap: ERROR not a photon map file, or an old one." << endl;
+  return -1;
+ }
+ if(header->photonSize != (int)sizeof(stored_photon_t))
+ {
+  cerr << "PhotonMap: ERROR photon map file was saved by a build with "
+       << "another photon format." << endl;
+  return -1;
+ }
+ if(header->storedPhotons < 0 || header->numPrecomputed < 0 || 
+    header->numPrecomputed > header->storedPhotons)
+ {
+  cerr << "PhotonMap: ERROR photon map file is damaged." << endl;
+  return -1;
+ }
+ headerBytes = photon_file_aligned(sizeof(photon_file_header_t));
+ photonBytes = photon_file_aligned((header->storedPhotons + 1L) * 
+                                   sizeof(stored_photon_t));
+ precomputedBytes = (header->numPrecomputed > 0) ? 
+                    photon_file_aligned((header->numPrecomputed + 1L) * 
+                                        sizeof(precomputed_irradiance_t)) : 0;
+ if(offset + headerBytes + photonBytes + precomputedBytes > size)
+ {
+  cerr << "PhotonMap: ERROR photon map file is truncated." << endl;
+  return -1;
+ }
+
+ release();
+ offset += headerBytes;
+ d_mapped = true;
+ d_photons = (photon_t *)(data + offset);
+#ifdef PHOTON_COMPACT
+ d_compact = (compact_photon_t *)d_photons;
+ d_quantStep = header->quantStep;
+#endif
+ offset += photonBytes;
+ 
+ // the precomputed irradiance is small, and may be recomputed
+ d_numPrecomputed = header->numPrecomputed;
+ if(d_numPrecomputed > 0)
+ {
+  d_precomputed = (precomputed_irradiance_t *)malloc(precomputedBytes);
+  if(d_precomputed == NULL)
+  {
+   cerr << "PhotonMap: ERROR allocating memory for irradiance." << endl;
+   exit(-1);
+  }
+  memcpy(d_precomputed, data + offset, precomputedBytes);
+  offset += precomputedBytes;
+ }
+
+ d_storedPhotons = header->storedPhotons;
+ d_halfStoredPhotons = d_storedPhotons/2 - 1;
+ d_maxPhotons = d_storedPhotons;
+ d_prevScale = d_storedPhotons + 1;
+ for(int i = 0; i < 3; i++)
+ {
+  d_bboxMin[i] = header->bboxMin[i];
+  d_bboxMax[i] = header->bboxMax[i];
+ }
+ d_estimateRadius = header->estimateRadius;
+ d_estimateCount = header->estimateCount;
+ return 0;
+}
+
+
+//==================================================================
+void PhotonMap::precomputeIrradiance(const int count, const float maxDist,
+                                     const int nPhotons, int numThreads)
+//==================================================================
+{
+ free(d_precomputed);
+ d_precomputed = NULL;
+ d_numPrecomputed = (count < d_storedPhotons) ? count : d_storedPhotons;
+ if(d_numPrecomputed <= 0)
+ {
+  d_numPrecomputed = 0;
+  return;
+ }
+ 
+ d_precomputed = (precomputed_irradiance_t *)malloc( (d_numPrecomputed + 1)
+                                     * sizeof(precomputed_irradiance_t) );
+ if(d_precomputed == NULL)
+ {
+  cerr << "PhotonMap: ERROR allocating memory for irradiance." << endl;
+  exit(-1);
+ }
+ 
+ // each thread takes an equal share of the photons
+ if(numThreads < 1)
+  numThreads = 1;
+ if(numThreads > d_numPrecomputed)
+  numThreads = d_numPrecomputed;
+ precompute_task_t *tasks = new precompute_task_t[numThreads];
+ pthread_t *threads = new pthread_t[numThreads];
+ bool *spawned = new bool[numThreads];
+ for(int t = 0; t < numThreads; t++)
+ {
+  tasks[t].map = this;
+  tasks[t].first = 1 + (long long)d_numPrecomputed * t/numThreads;
+  tasks[t].last = (long long)d_numPrecomputed * (t + 1)/numThreads;
+  tasks[t].maxDist = maxDist;
+  tasks[t].nPhotons = nPhotons;
+  spawned[t] = (t > 0) && 
+       (pthread_create(&threads[t], NULL, precomputeThread, &tasks[t]) == 0);
+ }
+ for(int t = 0; t < numThreads; t++)
+  if(!spawned[t])
+   precomputeThread(&tasks[t]);
+ for(int t = 1; t < numThreads; t++)
+  if(spawned[t])
+   pthread_join(threads[t], NULL);
+ delete [] tasks;
+ delete [] threads;
+ delete [] spawned;
+}
+
+
+//==================================================================
+void *PhotonMap::precomputeThread(void *task)
+//==================================================================
+{
+ precompute_task_t *t = (precompute_task_t *)task;
+ const PhotonMap *map = t->map;
+ 
+ for(int i = t->first; i <= t->last; i++)
+ {
+  const stored_photon_t *p = map->storedPhoton(i);
+  precomputed_irradiance_t &pre = map->d_precomputed[i];
+  rgb_t irrad = map->irradianceEstimate(map->photonPosition(p), 
+                      map->photonNormal(p), t->maxDist, t->nPhotons, 
+                      &pre.radius);
+  pre.irradiance[0] = irrad.r;
+  pre.irradiance[1] = irrad.g;
+  pre.irradiance[2] = irrad.b;
+ }
+ return NULL;
+}
+
+
+//==================================================================
+rgb_t PhotonMap::precomputedIrradiance(const vector3d_t pos, 
+                          const vector3d_t normal, const float maxDist, 
+                          const int nPhotons, float *radius) const
+//==================================================================
+{
+ // nearest neighbour search over the top of the kd-tree, visiting 
+ // the near side of each split first
+ struct {
+   int index;
+   float dist2;  // squared distance of the node's region from pos
+ } stack[2*PHOTONMAP_MAX_DEPTH];
+ int top = 0, best = 0;
+ float bestDist2;
+ nearest_photons_t np;
+ 
+ if (d_numPrecomputed == 0)
+   return irradianceEstimate(pos, normal, maxDist, nPhotons, radius);
+ np.dist2 = &bestDist2;
+ setQuery(&np, pos, maxDist);
+
+ stack[top].index = 1;
+ stack[top].dist2 = 0;
+ top++;
+ while (top > 0) {
+   top--;
+   const int node = stack[top].index;
+   const float bound = stack[top].dist2;
+   if (bound >= bestDist2)
+     continue;
+   const stored_photon_t *p = storedPhoton(node);
+   
+   if (2*node <= d_numPrecomputed) {
+     const int plane = photonPlane(p);
+     const float dist1 = np.pos[ plane ] - photonPos(p, plane);
+     const int nearChild = (dist1 > 0.0) ? 2*node+1 : 2*node;
+     const int farChild = (dist1 > 0.0) ? 2*node : 2*node+1;
+     if (farChild <= d_numPrecomputed) {
+       stack[top].index = farChild;
+       stack[top].dist2 = (dist1*dist1 > bound) ? dist1*dist1 : bound;
+       top++;
+     }
+     if (nearChild <= d_numPrecomputed) {
+       stack[top].index = nearChild;
+       stack[top].dist2 = bound;
+       top++;
+     }
+   }
+   
+   const float dist2 = photonDist2(&np, node);
+   if (dist2 < bestDist2 && dot(normal, photonNormal(p)) >= 0.9) {
+     bestDist2 = dist2;
+     best = node;
+   }
+ }
+ 
+ if (best == 0)
+   return irradianceEstimate(pos, normal, maxDist, nPhotons, radius);
+ 
+ const precomputed_irradiance_t &pre = d_precomputed[best];
+ if (radius)
+   *radius = pre.radius;
+ return rgb_t(pre.irradiance[0], pre.irradiance[1], pre.irradiance[2]);
+}
+
+
+//==================================================================
+void *PhotonMap::balanceThread(void *task)
+//==================================================================
+{
+ balance_task_t *t = (balance_task_t *)task;
+ t->map->balanceSegment(t);
+ return NULL;
+}
+
+
+//==================================================================
+void PhotonMap::balanceSegment(balance_task_t *task)
 //==================================================================
 {
+  const int index = task->index;
+  const int start = task->start;
+  const int end = task->end;
+  const float *bboxMin = task->bboxMin;
+  const float *bboxMax = task->bboxMax;
+
   //--------------------
   // compute new median
   //--------------------
@@ -339,80 +1067,96 @@ void PhotonMap::balanceSegment(photon_t **pbal, photon_t **porg,
   //--------------------------
 
   int axis=2;
-  if ((d_bboxMax[0]-d_bboxMin[0])>(d_bboxMax[1]-d_bboxMin[1]) &&
-(d_bboxMax[0]-d_bboxMin[0])>(d_bboxMax[2]-d_bboxMin[2]))
+  if ((bboxMax[0]-bboxMin[0])>(bboxMax[1]-bboxMin[1]) &&
+(bboxMax[0]-bboxMin[0])>(bboxMax[2]-bboxMin[2]))
     axis=0;
-  else if ((d_bboxMax[1]-d_bboxMin[1])>(d_bboxMax[2]-d_bboxMin[2]))
+  else if ((bboxMax[1]-bboxMin[1])>(bboxMax[2]-bboxMin[2]))
     axis=1;
 
   //------------------------------------------
   // partition photon block around the median
   //------------------------------------------
 
-  medianSplit( porg, start, end, median, axis );
+  medianSplit( start, end, median, axis );
 
-  pbal[ index ] = porg[ median ];
-  pbal[ index ]->plane = axis;
+  task->order[ index ] = median;
+  d_photons[ median ].plane = axis;
 
   //----------------------------------------------
   // recursively balance the left and right block
   //----------------------------------------------
 
+  balance_task_t left = *task, right = *task;
+  bool hasLeft = false, hasRight = false;
+
   if ( median > start ) {
     // balance left segment
     if ( start < median-1 ) {
-      const float tmp=d_bboxMax[axis];
-      d_bboxMax[axis] = pbal[index]->pos[axis];
-      balanceSegment( pbal, porg, 2*index, start, median-1 );
-      d_bboxMax[axis] = tmp;
+      left.index = 2*index;
+      left.end = median-1;
+      left.bboxMax[axis] = d_photons[median].pos[axis];
+      hasLeft = true;
     } else {
-      pbal[ 2*index ] = porg[start];
+      task->order[ 2*index ] = start;
     }
   }
 
   if ( median < end ) {
     // balance right segment
     if ( median+1 < end ) {
-      const float tmp = d_bboxMin[axis];		
-      d_bboxMin[axis] = pbal[index]->pos[axis];
-      balanceSegment( pbal, porg, 2*index+1, median+1, end );
-      d_bboxMin[axis] = tmp;
+      right.index = 2*index+1;
+      right.start = median+1;
+      right.bboxMin[axis] = d_photons[median].pos[axis];
+      hasRight = true;
     } else {
-      pbal[ 2*index+1 ] = porg[end];
+      task->order[ 2*index+1 ] = end;
     }
-  }	
-}
+  }
 
+  // the two segments are disjoint, so large ones are balanced by 
+  // separate threads, each side taking its share of the threads
+  pthread_t thread;
+  bool spawned = false;
+  if ( hasLeft && hasRight && task->numThreads > 1 && 
+       end-start+1 >= PHOTONMAP_PARALLEL_SEGMENT ) {
+    left.numThreads = task->numThreads/2;
+    right.numThreads = task->numThreads - left.numThreads;
+    spawned = (pthread_create(&thread, NULL, balanceThread, &left) == 0);
+  }
+  if ( hasLeft && !spawned )
+    balanceSegment( &left );
+  if ( hasRight )
+    balanceSegment( &right );
+  if ( spawned )
+    pthread_join(thread, NULL);
+}
 
-void swap(photon_t **ph, int a, int b) 
-{ 
- photon_t *ph2 = ph[a]; ph[a] = ph[b]; ph[b] = ph2; 
-} 
 
 //==================================================================
-void PhotonMap::medianSplit(photon_t **p, const int start, 
-                            const int end, const int median, 
-                            const int axis)
+void PhotonMap::medianSplit(const int start, const int end, 
+                            const int median, const int axis)
 //==================================================================
 {
+  photon_t *p = d_photons;
+  photon_t tmp;
   int left = start;
   int right = end;
 
   while ( right > left ) {
-    const float v = p[right]->pos[axis];
+    const float v = p[right].pos[axis];
     int i=left-1;
     int j=right;
     for (;;) {
-      while ( p[++i]->pos[axis] < v )
+      while ( p[++i].pos[axis] < v )
         ;
-      while ( p[--j]->pos[axis] > v && j>left )
+      while ( p[--j].pos[axis] > v && j>left )
         ;
       if ( i >= j )
         break;
-      swap(p,i,j);
+      tmp = p[i]; p[i] = p[j]; p[j] = tmp;
     }
 
-    swap(p,i,right);
+    tmp = p[i]; p[i] = p[right]; p[right] = tmp;
     if ( i >= median )
       right=i-1;
     if ( i <= median )
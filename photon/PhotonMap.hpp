@@ -13,13 +13,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "data_types.hpp"
 
 
 //==================================================================
 // struct _photon 
 // This is the photon. The power is not compressed, 
-// hence size is 28 bytes
+// hence size is 32 bytes
 //==================================================================
 typedef struct _photon
 {
@@ -27,13 +28,38 @@ typedef struct _photon
  short plane;                 // splitting plane for kd-tree
  unsigned char theta, phi;    // incoming direction
  float power[3];            // photon power (uncompressed)
+ unsigned char normalTheta, normalPhi; // surface normal at position
 }photon_t;
 
 
 
+#ifdef PHOTON_COMPACT
+//==================================================================
+// struct _compact_photon 
+// The photon in 16 bytes, used once the map is balanced. The 
+// position is stored as 21 bit fixed point coordinates within the 
+// bounds of the map and the power in Ward's RGBE format (8 bit 
+// mantissas and a shared exponent). Build with -DPHOTON_COMPACT.
+//==================================================================
+typedef struct _compact_photon
+{
+ unsigned long long pos;      // x, y, z in bits 0-20, 21-41, 42-62
+ unsigned char rgbe[4];       // photon power
+ unsigned char theta, phi;    // incoming direction
+ unsigned short plane : 2;    // splitting plane for kd-tree
+ unsigned short normal : 14;  // surface normal, 7 bit theta and phi
+}compact_photon_t;
+
+typedef compact_photon_t stored_photon_t;
+#else
+typedef photon_t stored_photon_t;
+#endif
+
+
 //==================================================================
 // struct _nearest_photons  
-// This structure is used only to locate the nearest photons
+// This structure is used only to locate the nearest photons. 
+// Positions and distances are in the units of the stored photons.
 //==================================================================
 typedef struct _nearest_photons
 {
@@ -42,10 +68,82 @@ typedef struct _nearest_photons
  int got_heap;
  float pos[3];
  float *dist2;
- const photon_t **index;
+ const stored_photon_t **index;
 }nearest_photons_t;
 
 
+//==================================================================
+// struct _balance_task  
+// A segment of the photon array to be balanced into a subtree
+//==================================================================
+class PhotonMap;
+typedef struct _balance_task
+{
+ PhotonMap *map;
+ int *order;        // heap node -> position in the photon array
+ int index;         // heap node of the subtree root
+ int start, end;    // segment of the photon array
+ float bboxMin[3];  // bounds of the segment
+ float bboxMax[3];
+ int numThreads;    // threads this subtree may use
+}balance_task_t;
+
+#define PHOTONMAP_PARALLEL_SEGMENT 65536 // smallest segment given a thread
+#define PHOTONMAP_MAX_DEPTH 64           // kd-tree search stack size
+
+
+//==================================================================
+// struct _photon_file_header  
+// Written ahead of each photon map saved by PhotonMap::save. The 
+// photons and precomputed irradiance follow, each 
+// padded to a multiple of PHOTONMAP_FILE_ALIGN bytes, so a file 
+// mapped into memory can be searched in place.
+//==================================================================
+typedef struct _photon_file_header
+{
+ char magic[8];          // PHOTONMAP_FILE_MAGIC
+ int version;            // PHOTONMAP_FILE_VERSION
+ int photonSize;         // sizeof(stored_photon_t), differs for 
+                         // compact builds
+ int storedPhotons;
+ int numPrecomputed;
+ float bboxMin[3];       // bounds of the photons
+ float bboxMax[3];
+ float quantStep;        // fixed point step of compact photons, else 1
+ float estimateRadius;   // see setEstimateSize
+ int estimateCount;
+}photon_file_header_t;
+
+#define PHOTONMAP_FILE_MAGIC "KIRANPM"
+#define PHOTONMAP_FILE_VERSION 2
+#define PHOTONMAP_FILE_ALIGN 64
+
+
+//==================================================================
+// struct _precomputed_irradiance  
+// Irradiance estimate stored for one of the photons at the top of 
+// the kd-tree (Christensen's precomputed irradiance)
+//==================================================================
+typedef struct _precomputed_irradiance
+{
+ float irradiance[3];  // irradiance at the photon position
+ float radius;         // radius the photons were gathered from
+}precomputed_irradiance_t;
+
+
+//==================================================================
+// struct _precompute_task  
+// A range of photons whose irradiance is computed by one thread
+//==================================================================
+typedef struct _precompute_task
+{
+ PhotonMap *map;
+ int first, last;   // range of kd-tree nodes
+ float maxDist;     // arguments for irradianceEstimate
+ int nPhotons;
+}precompute_task_t;
+
+
 //==================================================================
 // class PhotonMap  The photon map class
 //==================================================================
@@ -66,51 +164,206 @@ class PhotonMap
    // Puts a photon into the flat array that will form the final kd-tree
    // Call this function to store a photon
    
+  static photon_t makePhoton(const rgb_t power, const vector3d_t pos,
+                             const vector3d_t dir, const vector3d_t normal);
+   // Packs power, position, incoming direction and the surface normal
+   // into a photon without storing it. Safe to call from several 
+   // threads, e.g. to fill per-thread photon buffers.
+
+  void store(const photon_t *photons, const int count);
+   // Appends photons made by makePhoton to the flat array, up to
+   // the max number of photons. Call from one thread at a time.
+
   void scalePhotonPower(const float scale); 
    // Scale the power of all photons once they have been 
    // emitted from the light source. scale = 1/(number of emitted photons)
    // Call this function after each light source is processed
    
-  void balance(void); 
+  void balance(int numThreads = 1); 
    // Creates a left-handed kd-tree from the flat photon array
    // Call this function before using the photon map for rendering
+   // numThreads: max number of threads that balance subtrees
    
   rgb_t irradianceEstimate(const vector3d_t pos, 
                           const vector3d_t normal, const float maxDist, 
-                          const int nPhotons) const;
+                          const int nPhotons, float *radius = NULL) const;
    // Computes an irradiance estimate at a given surface position
    // return: irradiance
    // pos: surface position
    // normal: surface normal at pos
    // maxDist: max distance to look for photons
    // nPhotons: number of photons to use
+   // radius: if not NULL, set to the radius of the region the
+   //         photons were gathered from
+  
+  int gatherPhotons(const vector3d_t pos, const vector3d_t normal, 
+                    const float maxDist, rgb_t &power) const;
+   // Adds the power of all photons within maxDist of pos that hit 
+   // the front of the surface to power, however many there are. 
+   // Used by progressive photon mapping, where the radius, not the 
+   // number of photons, sets the size of an estimate.
+   // return: number of photons added
+  
+  void getBoundingBox(vector3d_t &bboxMin, vector3d_t &bboxMax) const;
+   // Bounds of the stored photons
+  
+  int getNumPhotons() const {return d_storedPhotons;}
+   // return: number of stored photons
+  
+  void setEstimateSize(const float maxDist, const int nPhotons);
+   // Sets the gather radius and number of photons the renderer 
+   // should use for estimates from this map (default 0.2 and 1500)
+  
+  float getEstimateRadius() const {return d_estimateRadius;}
+   // return: gather radius for estimates from this map
+  
+  int getEstimateCount() const {return d_estimateCount;}
+   // return: number of photons for estimates from this map
+  
+  int getNumPrecomputed() const {return d_numPrecomputed;}
+   // return: number of photons with precomputed irradiance
+  
+  int save(FILE *file) const;
+   // Writes the balanced map at the current position of file, which
+   // must be a multiple of PHOTONMAP_FILE_ALIGN. Several maps can be 
+   // saved one after another. Call this function after balance()
+   // return: 0 if success, else -1
+  
+  int load(const char *data, const long size, long &offset);
+   // Takes over a map written by save from memory, usually a mapped 
+   // file. The photons are searched where they are, not copied, so 
+   // data must stay valid and unchanged while the map is in use. The 
+   // map is balanced and full, and cannot take more photons.
+   // data: start of the saved file, aligned to PHOTONMAP_FILE_ALIGN
+   // size: size of data
+   // offset: where the map starts in data. Set to the end of the map
+   // return: 0 if success, else -1
+  
+  void precomputeIrradiance(const int count, const float maxDist, 
+                            const int nPhotons, int numThreads = 1);
+   // Computes an irradiance estimate at each of the first count 
+   // photons of the balanced kd-tree, using the surface normals 
+   // stored with them. The top of a left-balanced kd-tree is itself 
+   // a kd-tree over photons spread like the whole map, so 
+   // precomputedIrradiance can search it alone. 
+   // Call this function after balance()
+   // count: number of photons to compute irradiance at
+   // maxDist, nPhotons: as for irradianceEstimate
+   // numThreads: max number of threads to use
+  
+  rgb_t precomputedIrradiance(const vector3d_t pos, 
+                          const vector3d_t normal, const float maxDist, 
+                          const int nPhotons, float *radius = NULL) const;
+   // Returns the precomputed irradiance of the nearest photon whose 
+   // normal is close to normal. Falls back to irradianceEstimate 
+   // when there is no such photon within maxDist, or nothing was 
+   // precomputed. Arguments as for irradianceEstimate
   
   void locatePhotons(nearest_photons_t *const np, const int index) const;
    // Finds the nearest photons in the photon 
    // map given np
    // call with index = 1  
+   // The search is iterative and visits photons in the same order as 
+   // the recursive search in Jensen's book, so results are identical.
    
-  vector3d_t photonDir(const photon_t *p) const;
+  vector3d_t photonDir(const stored_photon_t *p) const;
    // return: direction of photon
    // p: the photon
+  
+  vector3d_t photonNormal(const stored_photon_t *p) const;
+   // return: surface normal at photon
+   // p: the photon
 
  private:
-  void balanceSegment(photon_t **pbal, photon_t **porg, const int index,
-                      const int start, const int end);
+  void balanceSegment(balance_task_t *task);
    // See book "Realistic Image Synthesis using 
-   // Photon Mapping" chapter 6 for explanation of this function
+   // Photon Mapping" chapter 6 for explanation of this function.
+   // Balances d_photons[start..end] in place and records the
+   // position of each heap node in task->order.
+  
+  void release();
+   // Frees the photon arrays, unless they belong to a loaded file
+  
+  static int writeAligned(FILE *file, const void *data, const size_t size);
+   // Writes data followed by zeros up to the next multiple of 
+   // PHOTONMAP_FILE_ALIGN. return: 0 if success, else -1
+  
+  static void *balanceThread(void *task);
+   // Thread entry that calls balanceSegment
   
-  void medianSplit(photon_t **p, const int start, const int end, 
+  static void *precomputeThread(void *task);
+   // Thread entry that computes irradiance for a range of photons
+  
+  static void encodeDir(const vector3d_t dir, unsigned char &theta, 
+                        unsigned char &phi);
+   // Quantizes a unit vector to 8 bit spherical angles
+  
+  void medianSplit(const int start, const int end, 
                    const int median, const int axis);
-   // Splits the photon array into two separate pieces around 
+   // Splits the photon array in place into two separate pieces around 
    // the median, with all photons below the median in the lower half 
    // and all photons above the median in the upper half. The 
    // comparison criteria is the axis (indicated by the axis parameter)
    // (inspired by routine in "Algorithms in C++" by Sedgewick)
+
+  const stored_photon_t *storedPhoton(const int index) const;
+   // return: photon at a node of the balanced kd-tree
+  
+  static float photonPos(const stored_photon_t *p, const int axis);
+   // return: position of photon along axis, in stored units
+  
+  vector3d_t photonPosition(const stored_photon_t *p) const;
+   // return: position of photon in world units
+  
+  void setQuery(nearest_photons_t *const np, const vector3d_t pos, 
+                const float maxDist) const;
+   // Sets the search position and radius of np, in stored units
+  
+  static int photonPlane(const stored_photon_t *p);
+   // return: splitting plane of photon
+  
+  static void photonPower(const stored_photon_t *p, rgb_t &power);
+   // Adds the power of the photon to power
+  
+  float photonDist2(const nearest_photons_t *np, const int index) const;
+   // return: squared distance from photon to np->pos
+  
+  void quadDist2(const nearest_photons_t *np, const int first, 
+                 float *dist2) const;
+   // Squared distances from np->pos to the four photons starting at 
+   // first (a multiple of 4), computed together
+  
+  void insertPhoton(nearest_photons_t *const np, const int index, 
+                    const float dist2) const;
+   // Adds photon to the nearest photons if it is close enough
+  
+  void locatePair(nearest_photons_t *const np, const int index, 
+                  const float *childDist2) const;
+   // Searches node index whose two children are leaves
+   // childDist2: squared distances to the children
+  
+  void locateQuad(nearest_photons_t *const np, const int index) const;
+   // Searches the subtree of node index whose grandchildren 
+   // are leaves
+
+#ifdef PHOTON_COMPACT
+  void compact();
+   // Packs the balanced photons into compact_photon_t, in place,
+   // and shrinks the photon array
+  
+  compact_photon_t *d_compact;  // the photons once compacted
+  float d_quantStep;            // world units per fixed point step
+#endif
   
   photon_t *d_photons;
+  precomputed_irradiance_t *d_precomputed; // for the top of the kd-tree
+  int d_numPrecomputed;
+  bool d_mapped;        // d_photons points into data passed to 
+                        // load, and is not freed
   int d_storedPhotons;
   int d_halfStoredPhotons;
+  float d_estimateRadius;
+  int d_estimateCount;
   int d_maxPhotons;
   int d_prevScale;
   float d_cosTheta[256];
@@ -1,4 +1,6 @@
 #include "Pixmap.hpp"
+#include <ctype.h>
+#include <string.h>
 
 
 Pixmap::Pixmap(int width, int height, rgb_t bkColor)
@@ -42,14 +44,39 @@ Pixmap::~Pixmap()
 }
 
 
+int Pixmap::readHeaderValue(FILE *source, int &value)
+{
+ int c = getc(source);
+
+ // skip white space and comments
+ while(c == '#' || isspace(c))
+ {
+  if(c == '#')
+   while(c != '\n' && c != EOF)
+    c = getc(source);
+  c = getc(source);
+ }
+ if(!isdigit(c))
+  return -1;
+ for(value = 0; isdigit(c); c = getc(source))
+  value = 10 * value + (c - '0');
+ // one white space character ends the header
+ if(!isspace(c))
+  return -1;
+ return 0;
+}
+
+
 int Pixmap::open(const char *fileName)
 {
  FILE *source;
- char header[80];
  int maxPixVal = 0;
  int pixVal;
- unsigned char cPixVal;
- char fileType;
+ int fileType;
+ int channels;
+ size_t size, read;
+ unsigned char *data;
+ double scale[256];  // pixel byte -> color value
  
  d_pixel = NULL;
 	
@@ -60,20 +87,27 @@ int Pixmap::open(const char *fileName)
   return(-1);
  }
 	
- // Read the header
- fgets(header, 80, source);
- fileType = header[1]; // indicates whether type is P2, P3, P5 or P6
-	
- while( fgets(header, 80, source) != NULL && header[0] == '#' ); // ignore comments
- sscanf( header, "%d %d", &d_width, &d_height );
- while( fgets(header, 80, source) != NULL && header[0] == '#' ); // ignore comments
- sscanf( header, "%d", &maxPixVal );
+ // Read the header. Values may be split by any white space or 
+ // comments, so both one line and GIMP style headers are read
+ fileType = (getc(source) == 'P') ? getc(source) : EOF;
+ if( fileType < '2' || fileType > '6' || fileType == '4' ||
+     readHeaderValue(source, d_width) != 0 || 
+     readHeaderValue(source, d_height) != 0 ||
+     readHeaderValue(source, maxPixVal) != 0 || 
+     d_width <= 0 || d_height <= 0 )
+ {
+  cerr << "Pixmap: ERROR reading image header." << endl;
+  fclose(source);
+  return(-1);
+ }
  
  if ( maxPixVal != 255 )
  {
   cerr << "Pixmap: ERROR reading image header." << endl;
   exit(1);
  }
+ d_fileType = (fileType == '2') ? P2 : (fileType == '3') ? P3 :
+              (fileType == '5') ? P5 : P6;
  
  // Allocate memory for the image data
  d_pixel = (rgb_t *) realloc( d_pixel, d_width * d_height * sizeof(rgb_t) );
@@ -84,45 +118,70 @@ int Pixmap::open(const char *fileName)
  }
  
  // Read the pixel values into memory
- for (int i = 0; i < d_width * d_height; i++)
+ if( d_fileType == P2 || d_fileType == P3 ) // ascii
  {
-  if( d_fileType == '2' ) // 8bpp ascii
-  {
-   fscanf( source, "%d", &pixVal );
-   d_pixel[i].r =
-   d_pixel[i].g = 
-   d_pixel[i].b = pixVal/255.0;
-  }
-  
-  if( fileType == '3' ) // 24bpp ascii
+  for (int i = 0; i < d_width * d_height; i++)
   {
-   fscanf( source, "%d", &pixVal );
-   d_pixel[i].r = pixVal/255.0;
-   fscanf( source, "%d", &pixVal );
-   d_pixel[i].g = pixVal/255.0;
-   fscanf( source, "%d", &pixVal );
-   d_pixel[i].b = pixVal/255.0;
+   if( d_fileType == P2 ) // 8bpp ascii
+   {
+    fscanf( source, "%d", &pixVal );
+    d_pixel[i].r =
+    d_pixel[i].g = 
+    d_pixel[i].b = pixVal/255.0;
+   }
+   else // 24bpp ascii
+   {
+    fscanf( source, "%d", &pixVal );
+    d_pixel[i].r = pixVal/255.0;
+    fscanf( source, "%d", &pixVal );
+    d_pixel[i].g = pixVal/255.0;
+    fscanf( source, "%d", &pixVal );
+    d_pixel[i].b = pixVal/255.0;
+   }
   }
-	
-  if( fileType == '5' ) // 8bpp binary
+  fclose(source);
+  return 0;
+ }
+
+ // binary images are read in one block and converted through a table
+ channels = (d_fileType == P5) ? 1 : 3;
+ size = (size_t)d_width * d_height * channels;
+ data = (unsigned char *)malloc(size);
+ if(data == NULL)
+ {
+  cout << "Pixmap: ERROR allocating memory." << endl;
+  exit(-1);
+ }
+ read = fread(data, 1, size, source);
+ if(read != size)
+ {
+  cerr << "Pixmap: ERROR image file is truncated." << endl;
+  memset(data + read, 0, size - read); // missing pixels are black
+ }
+ fclose(source);
+
+ for (int v = 0; v < 256; v++)
+  scale[v] = v/255.0;
+ if( d_fileType == P5 ) // 8bpp binary
+ {
+  for (int i = 0; i < d_width * d_height; i++)
   {
-   fscanf( source, "%c", &cPixVal );
    d_pixel[i].r = 
    d_pixel[i].g =
-   d_pixel[i].b = cPixVal/255.0;
+   d_pixel[i].b = scale[data[i]];
   }
-  
-  if( fileType == '6' ) // 24bpp binary
+ }
+ else // 24bpp binary
+ {
+  const unsigned char *c = data;
+  for (int i = 0; i < d_width * d_height; i++, c += 3)
   {
-   fscanf( source, "%c", &cPixVal );
-   d_pixel[i].r = cPixVal/255.0;
-   fscanf( source, "%c", &cPixVal );
-   d_pixel[i].g = cPixVal/255.0;
-   fscanf( source, "%c", &cPixVal );
-   d_pixel[i].b = cPixVal/255.0;
+   d_pixel[i].r = scale[c[0]];
+   d_pixel[i].g = scale[c[1]];
+   d_pixel[i].b = scale[c[2]];
   }
  }
- fclose(source);
+ free(data);
  return 0;
 }
 
@@ -132,8 +191,10 @@ int Pixmap::write(char *fileName, fileType_t type)
  FILE *destination;
  char *header = 0;
  int val, r, g, b;
+ unsigned char *data = NULL, *c;
+ size_t size = 0;
 	
- destination = fopen(fileName, "w+");
+ destination = fopen(fileName, "wb");
 
  if ( destination == NULL)
  {
@@ -153,6 +214,20 @@ int Pixmap::write(char *fileName, fileType_t type)
 		
  fprintf(destination, "%s %d %d %d\n", header, d_width, d_height, 255);
 
+ // binary images are encoded into one block and written at once
+ if(type == P5 || type == P6)
+ {
+  size = (size_t)d_width * d_height * ((type == P5) ? 1 : 3);
+  data = (unsigned char *)malloc(size + 1);
+  if(data == NULL)
+  {
+   cerr << "Pixmap: ERROR allocating memory." << endl;
+   fclose(destination);
+   return -1;
+  }
+ }
+ c = data;
+
  for (int i = 0; i < d_width * d_height; i++)
  {
   if(type == P2) // 8bpp ascii
@@ -168,7 +243,7 @@ int Pixmap::write(char *fileName, fileType_t type)
    {
     val = (int)((d_pixel[i].r + d_pixel[i].g + d_pixel[i].b) * 85);
     if(val > 0xFF) val = 0xFF;
-    fprintf(destination, "%c", (unsigned char)val);
+    *c++ = (unsigned char)val;
    }
    
    if(type == P3) // 24bpp ascii
@@ -186,12 +261,24 @@ int Pixmap::write(char *fileName, fileType_t type)
     r = (int)(d_pixel[i].r * 255); if (r > 0xFF) r = 0xFF;
     g = (int)(d_pixel[i].g * 255); if (g > 0xFF) g = 0xFF;
     b = (int)(d_pixel[i].b * 255); if (b > 0xFF) b = 0xFF;
-    fprintf( destination, "%c%c%c", (unsigned char)r, 
-                                    (unsigned char)g, 
-                                    (unsigned char)b);
+    c[0] = (unsigned char)r;
+    c[1] = (unsigned char)g;
+    c[2] = (unsigned char)b;
+    c += 3;
   }
  }
+
+ if(data != NULL)
+ {
+  if(fwrite(data, 1, size, destination) != size)
+  {
+   cerr << "Pixmap: ERROR writing image file." << endl;
+   free(data);
+   fclose(destination);
+   return -1;
+  }
+  free(data);
+ }
  fclose(destination);
  return 0;
 }
-
@@ -56,6 +56,11 @@ class Pixmap
   // ========== END OF INTERFACE ==========
   
  private:
+  static int readHeaderValue(FILE *source, int &value);
+   // Reads a number of the PPM header, skipping white space and 
+   // comments before it and one white space character after it.
+   //  return  0 on success, -1 if there is no number
+
   int d_width;
   int d_height;
   fileType_t d_fileType;
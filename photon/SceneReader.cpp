@@ -17,6 +17,15 @@ SceneReader::SceneReader( char *sceneFile )
  d_imageHeight = 480;
  d_isAntiAliasEnabled = false;
  d_numPhotons = 0;
+ d_irradianceCacheError = 0;
+ d_precomputeRatio = 0;
+ d_photonRadius = 0.2;
+ d_photonEstimate = 1500;
+ d_numCausticPhotons = 0;
+ d_causticRadius = 0.1;
+ d_causticEstimate = 100;
+ d_progressivePasses = 0;
+ d_progressiveAlpha = 0.7;
  d_recursionDepth = 5;
  d_numShadowRays = 1;
  
@@ -289,6 +298,87 @@ int SceneReader::getNumPhotons()
 }
 
 
+//==================================================================
+// SceneReader::getIrradianceCacheError
+//==================================================================
+double SceneReader::getIrradianceCacheError()
+{
+ return d_irradianceCacheError;
+}
+
+
+//==================================================================
+// SceneReader::getPrecomputeRatio
+//==================================================================
+int SceneReader::getPrecomputeRatio()
+{
+ return d_precomputeRatio;
+}
+
+
+//==================================================================
+// SceneReader::getPhotonRadius
+//==================================================================
+double SceneReader::getPhotonRadius()
+{
+ return d_photonRadius;
+}
+
+
+//==================================================================
+// SceneReader::getPhotonEstimate
+//==================================================================
+int SceneReader::getPhotonEstimate()
+{
+ return d_photonEstimate;
+}
+
+
+//==================================================================
+// SceneReader::getNumCausticPhotons
+//==================================================================
+int SceneReader::getNumCausticPhotons()
+{
+ return d_numCausticPhotons;
+}
+
+
+//==================================================================
+// SceneReader::getCausticRadius
+//==================================================================
+double SceneReader::getCausticRadius()
+{
+ return d_causticRadius;
+}
+
+
+//==================================================================
+// SceneReader::getCausticEstimate
+//==================================================================
+int SceneReader::getCausticEstimate()
+{
+ return d_causticEstimate;
+}
+
+
+//==================================================================
+// SceneReader::getProgressivePasses
+//==================================================================
+int SceneReader::getProgressivePasses()
+{
+ return d_progressivePasses;
+}
+
+
+//==================================================================
+// SceneReader::getProgressiveAlpha
+//==================================================================
+double SceneReader::getProgressiveAlpha()
+{
+ return d_progressiveAlpha;
+}
+
+
 //==================================================================
 // SceneReader::getRecursionDepth
 //==================================================================
@@ -677,6 +767,33 @@ void SceneReader::readGlobalSettings(section_t *section)
  getScalarRecord(section, "photons", sc, 0);
   d_numPhotons = (int)sc;
 
+ getScalarRecord(section, "irradiance_cache", sc, 0);
+  d_irradianceCacheError = (sc > 0) ? sc : 0;
+
+ getScalarRecord(section, "precompute_irradiance", sc, 0);
+  d_precomputeRatio = (sc > 0) ? (int)sc : 0;
+
+ getScalarRecord(section, "photon_radius", sc, 0.2);
+  d_photonRadius = sc;
+
+ getScalarRecord(section, "photon_estimate", sc, 1500);
+  d_photonEstimate = (int)sc;
+
+ getScalarRecord(section, "caustic_photons", sc, 0);
+  d_numCausticPhotons = (sc > 0) ? (int)sc : 0;
+
+ getScalarRecord(section, "caustic_radius", sc, 0.1);
+  d_causticRadius = sc;
+
+ getScalarRecord(section, "caustic_estimate", sc, 100);
+  d_causticEstimate = (int)sc;
+
+ getScalarRecord(section, "progressive_passes", sc, 0);
+  d_progressivePasses = (sc > 0) ? (int)sc : 0;
+
+ getScalarRecord(section, "progressive_alpha", sc, 0.7);
+  d_progressiveAlpha = (sc > 0 && sc <= 1) ? sc : 0.7;
+
  getScalarRecord(section, "image_width", sc, 320);
   d_imageWidth = (int)sc;
 
@@ -10,6 +10,7 @@
 #ifndef _SCENEREADER_HPP_INCLUDED
 #define _SCENEREADER_HPP_INCLUDED
 
+#include <string.h>
 #include <fstream>
 #include <vector>
 #include <strstream>
@@ -88,6 +89,39 @@ class SceneReader
   // Number of photons to use for photon mapping. Specify 
   // 0 to disable photon mapping
   
+ double getIrradianceCacheError();
+  // Allowed error of interpolated photon map irradiance. 
+  // 0 (default) disables the irradiance cache
+  
+ int getPrecomputeRatio();
+  // Irradiance is precomputed at one in this many photons.
+  // 0 (default) disables precomputed irradiance
+  
+ double getPhotonRadius();
+  // Max distance to gather photons from for an estimate
+  
+ int getPhotonEstimate();
+  // Number of photons to use for an estimate
+  
+ int getNumCausticPhotons();
+  // Number of photons emitted for a separate caustic photon
+  // map. 0 (default) keeps caustics in the photon map
+  
+ double getCausticRadius();
+  // Max distance to gather caustic photons from for an estimate
+  
+ int getCausticEstimate();
+  // Number of caustic photons to use for an estimate
+  
+ int getProgressivePasses();
+  // Number of photon passes of progressive photon mapping. 
+  // 0 (default) renders from a single photon map
+  
+ double getProgressiveAlpha();
+  // Fraction of new photons kept after each progressive pass 
+  // (0 to 1, default 0.7). Smaller values shrink the gather 
+  // radius faster
+  
  void printSceneInfo();
   // Print information about the scene to the standard 
   // output. This includes information about lights, 
@@ -124,6 +158,15 @@ class SceneReader
   bool d_isAntiAliasEnabled;
   int d_recursionDepth;
   int d_numPhotons;
+  double d_irradianceCacheError;
+  int d_precomputeRatio;
+  double d_photonRadius;
+  int d_photonEstimate;
+  int d_numCausticPhotons;
+  double d_causticRadius;
+  int d_causticEstimate;
+  int d_progressivePasses;
+  double d_progressiveAlpha;
   int d_numShadowRays;
 };
 
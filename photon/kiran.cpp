@@ -10,14 +10,69 @@
 #include "objects.hpp"
 #include "Pixmap.hpp"
 #include "SceneReader.hpp"
+#include "PhotonMap.hpp"
+#include "IrradianceCache.hpp"
 
 #include <signal.h>
+#include <pthread.h>
 #include <vector>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <math.h>
 
 using namespace std;
 
+#define KIRAN_PHOTON_CHUNK 4096 // photons emitted per unit of work
+
+// bounces on a photon path, see kiran_recursive_photon_trace
+#define KIRAN_PATH_SPECULAR     1 // specular reflection or refraction
+#define KIRAN_PATH_DIFFUSE      2 // diffuse reflection
+#define KIRAN_PATH_CAUSTIC_ONLY 4 // end paths that cannot be caustics
+
+//==================================================================
+// struct _hit_point  A surface point seen from the camera, where 
+//                    progressive photon mapping gathers the photons 
+//                    of each pass (Hachisuka's hit point)
+//==================================================================
+typedef struct _hit_point
+{
+ vector3d_t pos;     // surface position
+ vector3d_t normal;  // surface normal at pos
+ int u, v;           // pixel the point is seen through
+ double weight;      // share of the pixel color
+ double radius2;     // squared gather radius, shrinks after each pass
+ double count;       // photons accumulated so far (N)
+ rgb_t flux;         // power of the accumulated photons (tau)
+}hit_point_t;
+
+
+//==================================================================
+// struct _photon_maps  The photon maps of the scene. Photons from all
+//                      lights are stored together, so each estimate
+//                      is a single search.
+//==================================================================
+typedef struct _photon_maps
+{
+ PhotonMap global;          // photon map (global photon map when 
+                            // caustics have their own)
+ PhotonMap caustic;         // photons that reached a diffuse surface 
+                            // through specular bounces only. Empty 
+                            // unless the scene asks for caustic photons
+ IrradianceCache *cache;    // cache for the global map, or NULL
+ vector<hit_point_t> *hitPoints; // in progressive mode, where the 
+                            // estimates are made later, else NULL
+ int u, v;                  // pixel and share of the pixel color of 
+ double weight;             // the rays traced, for new hit points
+}photon_maps_t;
+
+// photons kept by kiran_photon_trace
+#define KIRAN_STORE_ALL     0 // every stored photon
+#define KIRAN_STORE_GLOBAL  1 // all but caustic photons
+#define KIRAN_STORE_CAUSTIC 2 // caustic photons only
+
 //==================================================================
 // kiran_find_intercept
 //==================================================================
@@ -50,12 +105,58 @@ intercept_t kiran_find_intercept(ray_t ray, const vector<Object *> &sceneList,
 }
 
 
+//==================================================================
+// kiran_cached_irradiance - global photon map estimate through the 
+//                           irradiance cache
+//==================================================================
+rgb_t kiran_cached_irradiance(const intercept_t &intercept, 
+                              photon_maps_t *photonMaps)
+{
+ const PhotonMap &photonMap = photonMaps->global;
+ rgb_t irrad;
+ float radius;
+
+ if(photonMaps->cache->lookup(intercept.coord, intercept.normal, irrad))
+  return irrad;
+
+ irrad = photonMap.precomputedIrradiance(intercept.coord, intercept.normal,
+                   photonMap.getEstimateRadius(), 
+                   photonMap.getEstimateCount(), &radius);
+ photonMaps->cache->insert(intercept.coord, intercept.normal, irrad, radius);
+ return irrad;
+}
+
+
+//==================================================================
+// kiran_add_hit_point - remember an intercept for progressive photon 
+//                       mapping, in place of a photon map estimate
+//==================================================================
+void kiran_add_hit_point(const intercept_t &intercept, 
+                         photon_maps_t *photonMaps)
+{
+ hit_point_t hit;
+ double radius = photonMaps->global.getEstimateRadius();
+
+ if(photonMaps->weight <= 0)
+  return;
+ hit.pos = intercept.coord;
+ hit.normal = intercept.normal;
+ hit.u = photonMaps->u;
+ hit.v = photonMaps->v;
+ hit.weight = photonMaps->weight;
+ hit.radius2 = radius * radius;
+ hit.count = 0;
+ photonMaps->hitPoints->push_back(hit);
+}
+
+
 //==================================================================
 // kiran_do_lights
 //==================================================================
 rgb_t kiran_do_lights(intercept_t intercept, const vector< Light *> &lightList, 
                       const Light *ambient, const vector<Object *> &sceneList, 
-                      double tooClose, int numShadowRays)
+                      double tooClose, int numShadowRays, 
+                      photon_maps_t *photonMaps)
 {
  vector3d_t randVec = vector3d_t(0,0,0);
  int count;
@@ -89,9 +190,25 @@ rgb_t kiran_do_lights(intercept_t intercept, const vector< Light *> &lightList,
             interceptBeforelight.object->getTransmissionCoeff());
    count++;
   }while(count < numShadowRays);
-  color = color + // ** add estimate from PHOTON MAP for indirect lights**
-          (lightList[l])->d_photonMap.irradianceEstimate(intercept.coord, 
-                          intercept.normal, 0.2, 1500);
+ }
+
+ // ** add estimate from PHOTON MAP for indirect lights**
+ if(photonMaps != NULL && photonMaps->hitPoints != NULL)
+  kiran_add_hit_point(intercept, photonMaps);
+ else if(photonMaps != NULL)
+ {
+  const PhotonMap &photonMap = photonMaps->global;
+  const PhotonMap &causticMap = photonMaps->caustic;
+  if(photonMaps->cache != NULL)
+   color = color + kiran_cached_irradiance(intercept, photonMaps);
+  else
+   color = color + photonMap.precomputedIrradiance(intercept.coord, 
+                           intercept.normal, photonMap.getEstimateRadius(), 
+                           photonMap.getEstimateCount());
+  if(causticMap.getNumPhotons() > 0) // never cached or precomputed
+   color = color + causticMap.irradianceEstimate(intercept.coord, 
+                           intercept.normal, causticMap.getEstimateRadius(),
+                           causticMap.getEstimateCount());
  }
  
  // ambient lighting
@@ -108,7 +225,8 @@ rgb_t kiran_do_lights(intercept_t intercept, const vector< Light *> &lightList,
 int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
                           const Light *ambient, const vector<Object *> &sceneList, 
                           double tooClose, double tooFar, int maxDepth,
-                          int depth, rgb_t &color, int numShadowRays)
+                          int depth, rgb_t &color, int numShadowRays,
+                          photon_maps_t *photonMaps)
 {
  int newDepth;
  ray_t newRay;
@@ -120,6 +238,7 @@ int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
  static double mui = 1;
  double mur; //refractive indices of incident and refracted rays
  double mr;
+ double weight;  // share of the pixel color of this ray
  newDepth = depth+1;
 
  intercept = kiran_find_intercept(ray, sceneList, tooClose, tooFar);
@@ -128,7 +247,7 @@ int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
 
  // Direct illumination from light sources
  localColor = kiran_do_lights(intercept, lightList, ambient, sceneList, 
-                              tooClose, numShadowRays);
+                              tooClose, numShadowRays, photonMaps);
   
  if(newDepth >= maxDepth)
  {
@@ -137,15 +256,20 @@ int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
  }
  else
  {
+  weight = (photonMaps != NULL) ? photonMaps->weight : 0;
+
   // Estimate contribution from reflections
   if(intercept.object->getRefCoeff() > 0)
   {
+   if(photonMaps != NULL)
+    photonMaps->weight = weight * intercept.object->getRefCoeff();
    newRay.orig = intercept.coord;
    newRay.dir = normalize(intercept.incidentRay - 2 * 
                            dot(intercept.incidentRay, intercept.normal) 
                            * intercept.normal);
    kiran_recursive_trace(newRay, lightList, ambient, sceneList, tooClose, tooFar, 
-                           maxDepth, newDepth, reflColor, numShadowRays);
+                           maxDepth, newDepth, reflColor, numShadowRays, 
+                           photonMaps);
   }
 
   // Estimate contribution from refractions
@@ -168,11 +292,16 @@ int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
     newRay.dir = mr * intercept.incidentRay + intercept.normal
                  * (mr * fabs(iDotN) - sqrt(cosr));
     newRay.dir = normalize(newRay.dir);
+    if(photonMaps != NULL)
+     photonMaps->weight = weight * intercept.object->getTransmissionCoeff();
     kiran_recursive_trace(newRay, lightList, ambient, sceneList, tooClose, tooFar, 
-                                maxDepth, newDepth, refrColor, numShadowRays);
+                                maxDepth, newDepth, refrColor, numShadowRays,
+                                photonMaps);
     //mui = mur;
    }
   }
+  if(photonMaps != NULL)
+   photonMaps->weight = weight;
  }
  kr = intercept.object->getRefCoeff();
  kt = intercept.object->getTransmissionCoeff();
@@ -187,20 +316,32 @@ int kiran_recursive_trace(ray_t ray, const vector< Light *> &lightList,
 rgb_t kiran_trace(ray_list_t *rayList, const vector< Light *> &lightList,
                   const Light *ambient, const vector<Object *> &sceneList, rgb_t bkColor,
                   double tooClose, double tooFar, int maxDepth, int depth, 
-                  int numShadowRays)
+                  int numShadowRays, photon_maps_t *photonMaps)
 {
  rgb_t color, tmpColor;
  tmpColor = bkColor;
  double numRays = 0;
+ double weight = 0;
  ray_list_t *tmpPtr;
  
+ // the rays share the weight of the pixel sample equally
+ if(photonMaps != NULL)
+ {
+  weight = photonMaps->weight;
+  for(tmpPtr = rayList; tmpPtr != NULL; tmpPtr = tmpPtr->nxt)
+   numRays++;
+  if(numRays > 0)
+   photonMaps->weight = weight/numRays;
+  numRays = 0;
+ }
+
  tmpPtr = rayList;
  while(tmpPtr != NULL)
  {
   numRays++;
   kiran_recursive_trace(tmpPtr->ray, lightList, ambient, sceneList, 
                           tooClose, tooFar, maxDepth, 
-                          depth, tmpColor, numShadowRays);
+                          depth, tmpColor, numShadowRays, photonMaps);
 
   color.r = (1.0/numRays)*((numRays-1) * color.r + tmpColor.r);
   color.g = (1.0/numRays)*((numRays-1) * color.g + tmpColor.g);
@@ -208,6 +349,8 @@ rgb_t kiran_trace(ray_list_t *rayList, const vector< Light *> &lightList,
 
   tmpPtr = tmpPtr->nxt; 
  }
+ if(photonMaps != NULL)
+  photonMaps->weight = weight;
  
  // release rays from memory
  while(rayList != NULL)
@@ -223,29 +366,38 @@ rgb_t kiran_trace(ray_list_t *rayList, const vector< Light *> &lightList,
 
 //==================================================================
 // kiran_recursive_photon_trace
+//  path  KIRAN_PATH_ flags, set to the kinds of bounces on the path. 
+//        With KIRAN_PATH_CAUSTIC_ONLY set, paths that are not 
+//        caustics are ended early and not stored.
 //==================================================================
 int kiran_recursive_photon_trace(ray_t &ray, const vector<Object *> &sceneList,
-                                  double tooClose, double tooFar, rgb_t &color)
+                                  double tooClose, double tooFar, rgb_t &color,
+                                  vector3d_t &normal, int &path, int depth, 
+                                  unsigned int *seed)
 {
  intercept_t intercept;
  int returnVal = -1;
- static float recursionDepth;
- static double mui = 1;
+ float recursionDepth;
+ double mui = 1;
  double mur; //refractive indices of incident and refracted rays
  rgb_t objColor;
 
- if(recursionDepth > 5)
+ if(depth > 5)
   return returnVal;
   
  intercept = kiran_find_intercept(ray, sceneList, tooClose, tooFar);
  if(intercept.object == NULL)
   return returnVal;
  
- recursionDepth++;
+ recursionDepth = depth + 1;
 
- // Change ray properties
+ // Change ray properties, keep the normal on the side the photon 
+ // came from
  ray.orig = intercept.coord;
  ray.dir = intercept.incidentRay;
+ normal = intercept.normal;
+ if(dot(normal, ray.dir) > 0)
+  normal = -1 * normal;
  objColor = intercept.object->getColor(intercept.coord);
 
  color.r = (1.0/recursionDepth) * ((recursionDepth-1) * color.r + ray.pow.r * objColor.r);
@@ -258,14 +410,15 @@ int kiran_recursive_photon_trace(ray_t &ray, const vector<Object *> &sceneList,
  // specular reflections for caustics
  if( (p = intercept.object->getRefCoeff()) > 0)
  {
-  e = (float)rand()/(float)RAND_MAX;
+  e = (float)rand_r(seed)/(float)RAND_MAX;
   if(e < p)
   {
    ray.dir = normalize(intercept.incidentRay - 2 * 
                        dot(intercept.incidentRay, intercept.normal) 
                        * intercept.normal);
-   returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color);
-   recursionDepth = 0;
+   path |= KIRAN_PATH_SPECULAR;
+   returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color,
+                                            normal, path, depth + 1, seed);
    return returnVal;
   }
  }
@@ -273,7 +426,7 @@ int kiran_recursive_photon_trace(ray_t &ray, const vector<Object *> &sceneList,
  // specular refractions for caustics
  if( (p = intercept.object->getTransmissionCoeff()) > 0)
  {
-  e = (float)rand()/(float)RAND_MAX;
+  e = (float)rand_r(seed)/(float)RAND_MAX;
   if(e < p)
   {
    double iDotN, cosr, mr;
@@ -292,8 +445,9 @@ int kiran_recursive_photon_trace(ray_t &ray, const vector<Object *> &sceneList,
     ray.dir = mr * intercept.incidentRay + intercept.normal
               * (mr * fabs(iDotN) - sqrt(cosr));
     ray.dir = normalize(ray.dir);
-    returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color);
-    recursionDepth = 0;
+    path |= KIRAN_PATH_SPECULAR;
+    returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color,
+                                            normal, path, depth + 1, seed);
     return returnVal;
    }
   }
@@ -303,66 +457,374 @@ int kiran_recursive_photon_trace(ray_t &ray, const vector<Object *> &sceneList,
  // diffuse reflections and absorption
  if( (intercept.object->getRefCoeff() < 1) && (intercept.object->getTransmissionCoeff() < 1) )
  {
-  e = (float)rand()/(float)RAND_MAX;
+  if( (path & KIRAN_PATH_CAUSTIC_ONLY) && !(path & KIRAN_PATH_SPECULAR) )
+   return returnVal;
+  e = (float)rand_r(seed)/(float)RAND_MAX;
   if(e < 0.5)
   {
+   if(path & KIRAN_PATH_CAUSTIC_ONLY)
+    return returnVal;
    ray.dir = intercept.incidentRay - 2 * 
                        dot(intercept.incidentRay, intercept.normal) 
                        * intercept.normal;
-   ray.dir.x = 2.0 * ((float)rand()/(float)RAND_MAX - 0.5);
-   ray.dir.y = 2.0 * ((float)rand()/(float)RAND_MAX - 0.5);
-   ray.dir.z = 2.0 * ((float)rand()/(float)RAND_MAX - 0.5);
+   ray.dir.x = 2.0 * ((float)rand_r(seed)/(float)RAND_MAX - 0.5);
+   ray.dir.y = 2.0 * ((float)rand_r(seed)/(float)RAND_MAX - 0.5);
+   ray.dir.z = 2.0 * ((float)rand_r(seed)/(float)RAND_MAX - 0.5);
    ray.dir = normalize(ray.dir);
 
-   returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color);
-   recursionDepth = 0;
+   path |= KIRAN_PATH_DIFFUSE;
+   returnVal = kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color,
+                                            normal, path, depth + 1, seed);
    return returnVal;
   }
-  recursionDepth = 0;
   return 0;
  } 
 
- recursionDepth = 0;
  return returnVal;
 }
 
 
 //==================================================================
-// kiran_photon_trace - photon emission and storage
+// struct _photon_job  Photon emission from one light, shared by the
+//                     emission threads. Photons are emitted in chunks
+//                     that each have their own random number stream 
+//                     and photon buffer, so the photon map does not 
+//                     depend on the number of threads.
 //==================================================================
-void kiran_photon_trace(Light *light, int numPhotons, 
-                        const vector<Object *> &sceneList, double tooClose, 
-                        double tooFar)
+typedef struct _photon_job
 {
+ Light *light;
+ int store;                          // KIRAN_STORE_ selection
+ unsigned int seedOffset;            // separates streams of each map
+ const vector<Object *> *sceneList;
+ double tooClose;
+ double tooFar;
+ int numPhotons;
+ int numChunks;
+ int nextChunk;                      // next chunk to hand out
+ pthread_mutex_t lock;               // protects nextChunk
+ vector< vector<photon_t> > buffers; // photons stored by each chunk
+}photon_job_t;
+
+
+//==================================================================
+// kiran_photon_worker - thread entry, emits chunks until none are left
+//==================================================================
+void *kiran_photon_worker(void *arg)
+{
+ photon_job_t *job = (photon_job_t *)arg;
  ray_t ray;
  rgb_t color;
- vector3d_t power;
- int i = 0; 
+ vector3d_t normal;
  float x,y,z;
+ int chunk, first, last, path;
+ bool caustic;
+ unsigned int seed;
 
- light->d_photonMap.init(numPhotons);
-
- while (i < numPhotons)
+ for(;;)
  {
-  do
+  pthread_mutex_lock(&job->lock);
+  chunk = job->nextChunk++;
+  pthread_mutex_unlock(&job->lock);
+  if(chunk >= job->numChunks)
+   break;
+
+  first = chunk * KIRAN_PHOTON_CHUNK;
+  last = first + KIRAN_PHOTON_CHUNK;
+  if(last > job->numPhotons)
+   last = job->numPhotons;
+  seed = (unsigned int)(chunk + 1) * 2654435761u // spread the streams
+         + job->seedOffset;
+  vector<photon_t> &buffer = job->buffers[chunk];
+  buffer.reserve(last - first);
+
+  for(int i = first; i < last; i++)
   {
-   x = (float)rand()/(float)RAND_MAX - 0.5;
-   y = (float)rand()/(float)RAND_MAX - 0.5;
-   z = (float)rand()/(float)RAND_MAX - 0.5;
-  }while(x*x + y*y + z*z > 0.25);
-
-  // photon properties are set here
-  ray.dir = vector3d_t(x,y,z);
-  ray.dir = normalize(ray.dir);
-  ray.orig = light->getPosition();
-  ray.pow = light->getSourceIntensity();
+   do
+   {
+    x = (float)rand_r(&seed)/(float)RAND_MAX - 0.5;
+    y = (float)rand_r(&seed)/(float)RAND_MAX - 0.5;
+    z = (float)rand_r(&seed)/(float)RAND_MAX - 0.5;
+   }while(x*x + y*y + z*z > 0.25);
+
+   // photon properties are set here
+   ray.dir = vector3d_t(x,y,z);
+   ray.dir = normalize(ray.dir);
+   ray.orig = job->light->getPosition();
+   ray.pow = job->light->getSourceIntensity();
   
-  if(kiran_recursive_photon_trace(ray, sceneList, tooClose, tooFar, color) == 0)
-   light->d_photonMap.store(color, ray.orig, ray.dir);
-  i++;
+   path = (job->store == KIRAN_STORE_CAUSTIC) ? KIRAN_PATH_CAUSTIC_ONLY : 0;
+   if(kiran_recursive_photon_trace(ray, *job->sceneList, job->tooClose, 
+                          job->tooFar, color, normal, path, 0, &seed) != 0)
+    continue;
+   caustic = (path & KIRAN_PATH_SPECULAR) && !(path & KIRAN_PATH_DIFFUSE);
+   if( (job->store == KIRAN_STORE_ALL) || 
+       (caustic == (job->store == KIRAN_STORE_CAUSTIC)) )
+    buffer.push_back(PhotonMap::makePhoton(color, ray.orig, ray.dir, normal));
+  }
+ }
+ return NULL;
+}
+
+
+//==================================================================
+// kiran_photon_trace - photon emission from one light and storage
+//  photonMap  Map to add the photons to. Balance it once all lights
+//             are done.
+//  store      KIRAN_STORE_ selection of photons to keep
+//  stream     Selects the random numbers, use a different one for 
+//             each call
+//==================================================================
+void kiran_photon_trace(Light *light, PhotonMap &photonMap, int numPhotons, 
+                        int store, unsigned int stream, 
+                        const vector<Object *> &sceneList, 
+                        double tooClose, double tooFar, int numThreads)
+{
+ photon_job_t job;
+ vector<pthread_t> threads(numThreads);
+
+ job.light = light;
+ job.store = store;
+ job.seedOffset = stream * 0x9e3779b9u;
+ job.sceneList = &sceneList;
+ job.tooClose = tooClose;
+ job.tooFar = tooFar;
+ job.numPhotons = numPhotons;
+ job.numChunks = (numPhotons + KIRAN_PHOTON_CHUNK - 1)/KIRAN_PHOTON_CHUNK;
+ job.nextChunk = 0;
+ job.buffers.resize(job.numChunks);
+ pthread_mutex_init(&job.lock, NULL);
+
+ // the calling thread is one of the workers
+ for(int t = 1; t < numThreads; t++)
+ {
+  if(pthread_create(&threads[t], NULL, kiran_photon_worker, &job) != 0)
+  {
+   cerr << "kiran: ERROR creating photon thread" << endl;
+   exit(-1);
+  }
+ }
+ kiran_photon_worker(&job);
+ for(int t = 1; t < numThreads; t++)
+  pthread_join(threads[t], NULL);
+ pthread_mutex_destroy(&job.lock);
+
+ // merge the buffers in emission order
+ for(int c = 0; c < job.numChunks; c++)
+ {
+  if(!job.buffers[c].empty())
+   photonMap.store(&job.buffers[c][0], job.buffers[c].size());
+  vector<photon_t>().swap(job.buffers[c]);
+ }
+ photonMap.scalePhotonPower(1.0/(float)numPhotons);
+}
+
+
+//==================================================================
+// struct _gather_job  Hit points updated by one thread after a 
+//                     progressive photon pass
+//==================================================================
+typedef struct _gather_job
+{
+ vector<hit_point_t> *hitPoints;
+ const PhotonMap *photonMap;  // photons of the pass
+ double alpha;                // fraction of new photons kept
+ int first, last;             // range of hit points
+}gather_job_t;
+
+
+//==================================================================
+// kiran_gather_worker - thread entry, adds the photons of a pass to 
+//                       a range of hit points
+//==================================================================
+void *kiran_gather_worker(void *arg)
+{
+ gather_job_t *job = (gather_job_t *)arg;
+ rgb_t power;
+ int found;
+ double count, ratio;
+
+ for(int i = job->first; i < job->last; i++)
+ {
+  hit_point_t &hit = (*job->hitPoints)[i];
+  power = rgb_t(0,0,0);
+  found = job->photonMap->gatherPhotons(hit.pos, hit.normal, 
+                                        sqrt(hit.radius2), power);
+  if(found == 0)
+   continue;
+
+  // keep alpha of the new photons and shrink the radius to match 
+  // the density, which scales the flux by the change in area
+  count = hit.count + job->alpha * found;
+  ratio = count/(hit.count + found);
+  hit.radius2 *= ratio;
+  hit.count = count;
+  hit.flux = (hit.flux + power) * ratio;
+ }
+ return NULL;
+}
+
+
+//==================================================================
+// kiran_progressive_pass - emit a pass of photons from all lights 
+//                          and add them to the hit points
+//  photonMap  Holds the photons of the pass, which are discarded 
+//             by the next pass
+//  pass       Number of the pass, selects the random numbers
+//==================================================================
+void kiran_progressive_pass(vector<hit_point_t> &hitPoints, 
+                            PhotonMap &photonMap, 
+                            const vector<Light *> &lightList, 
+                            int numPhotons, int pass, double alpha,
+                            const vector<Object *> &sceneList, 
+                            double tooClose, double tooFar, int numThreads)
+{
+ vector<gather_job_t> jobs(numThreads);
+ vector<pthread_t> threads(numThreads);
+
+ // streams as for the photon map, so pass 0 emits the same photons
+ photonMap.init(numPhotons * lightList.size());
+ for(unsigned int i = 0; i < lightList.size(); i++)
+  kiran_photon_trace(lightList[i], photonMap, numPhotons, KIRAN_STORE_ALL, 
+                     2 * (pass * lightList.size() + i), sceneList, 
+                     tooClose, tooFar, numThreads);
+ photonMap.balance(numThreads);
+
+ // the calling thread takes the first range
+ for(int t = 0; t < numThreads; t++)
+ {
+  jobs[t].hitPoints = &hitPoints;
+  jobs[t].photonMap = &photonMap;
+  jobs[t].alpha = alpha;
+  jobs[t].first = (long long)hitPoints.size() * t/numThreads;
+  jobs[t].last = (long long)hitPoints.size() * (t + 1)/numThreads;
+  if(t > 0 && pthread_create(&threads[t], NULL, kiran_gather_worker, 
+                             &jobs[t]) != 0)
+  {
+   cerr << "kiran: ERROR creating gather thread" << endl;
+   exit(-1);
+  }
  }
- light->d_photonMap.scalePhotonPower(1.0/(float)numPhotons);
- light->d_photonMap.balance();
+ kiran_gather_worker(&jobs[0]);
+ for(int t = 1; t < numThreads; t++)
+  pthread_join(threads[t], NULL);
+}
+
+
+//==================================================================
+// kiran_progressive_image - the ray traced image plus the photon 
+//                           estimates of the hit points so far
+//  numPasses  Passes of photons added to the hit points
+//==================================================================
+void kiran_progressive_image(const Pixmap &directImage, 
+                             const vector<hit_point_t> &hitPoints, 
+                             int numPasses, Pixmap &image)
+{
+ double scale;
+
+ for(int u = 1; u <= image.width(); u++)
+  for(int v = 1; v <= image.height(); v++)
+   image(u, v) = directImage(u, v);
+
+ // photon powers are divided by the photons emitted in a pass
+ for(unsigned int i = 0; i < hitPoints.size(); i++)
+ {
+  const hit_point_t &hit = hitPoints[i];
+  scale = hit.weight/(M_PI * hit.radius2 * numPasses);
+  image(hit.u, hit.v) = image(hit.u, hit.v) + scale * hit.flux;
+ }
+}
+
+
+//==================================================================
+// kiran_set_sample - pixel and share of the pixel color of the rays
+//                    traced next, for hit points
+//==================================================================
+void kiran_set_sample(photon_maps_t *photonMaps, int u, int v, double weight)
+{
+ if(photonMaps == NULL)
+  return;
+ photonMaps->u = u;
+ photonMaps->v = v;
+ photonMaps->weight = weight;
+}
+
+
+//==================================================================
+// kiran_copy_hit_points - hit points of a sample that is reused for
+//                         another pixel
+//  first, last  Range of hit points recorded for the sample
+//==================================================================
+void kiran_copy_hit_points(vector<hit_point_t> &hitPoints, size_t first, 
+                           size_t last, int u, int v)
+{
+ for(size_t i = first; i < last; i++)
+ {
+  hit_point_t hit = hitPoints[i];
+  hit.u = u;
+  hit.v = v;
+  hitPoints.push_back(hit);
+ }
+}
+
+
+//==================================================================
+// kiran_save_photons - write the balanced photon maps to a file
+//==================================================================
+int kiran_save_photons(const char *fileName, const photon_maps_t *photonMaps)
+{
+ FILE *file = fopen(fileName, "wb");
+ 
+ if(file == NULL)
+ {
+  cerr << "kiran: ERROR creating photon map file " << fileName << endl;
+  return -1;
+ }
+ if(photonMaps->global.save(file) != 0 || 
+    photonMaps->caustic.save(file) != 0)
+ {
+  fclose(file);
+  return -1;
+ }
+ if(fclose(file) != 0)
+ {
+  cerr << "kiran: ERROR writing photon map file " << fileName << endl;
+  return -1;
+ }
+ return 0;
+}
+
+
+//==================================================================
+// kiran_load_photons - map a file written by kiran_save_photons into
+//                      memory and use the photon maps in it. The file
+//                      stays mapped until the program exits.
+//==================================================================
+int kiran_load_photons(const char *fileName, photon_maps_t *photonMaps)
+{
+ struct stat info;
+ void *data;
+ long offset = 0;
+ int fd = open(fileName, O_RDONLY);
+ 
+ if(fd < 0 || fstat(fd, &info) != 0)
+ {
+  cerr << "kiran: ERROR opening photon map file " << fileName << endl;
+  if(fd >= 0)
+   close(fd);
+  return -1;
+ }
+ data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+ close(fd);
+ if(data == MAP_FAILED)
+ {
+  cerr << "kiran: ERROR mapping photon map file " << fileName << endl;
+  return -1;
+ }
+ if(photonMaps->global.load((const char *)data, info.st_size, offset) != 0 ||
+    photonMaps->caustic.load((const char *)data, info.st_size, offset) != 0)
+  return -1;
+ return 0;
 }
 
 
@@ -379,14 +841,38 @@ int main(int argc, char *argv[])
  Pixmap *outputImage;   // output image
  char *outputFile = "output.ppm";
  char *inputFile = NULL;
+ char *savePhotonsFile = NULL; // photon map file to write, or NULL
+ char *loadPhotonsFile = NULL; // photon map file to read, or NULL
  SceneReader sceneReader; // Scene file reader
  int maxDepth = 5;
+ int numThreads = 1;    // no. of photon mapping threads
+ double cacheError = 0; // irradiance cache error bound, 0 for no cache
+ int precomputeRatio = 0; // photons per precomputed irradiance, 0 for none
+ double photonRadius = 0.2; // gather radius and photon count of estimates
+ int photonEstimate = 1500;
+ int numCausticPhotons = 0; // photons for the caustic map, 0 for no map
+ double causticRadius = 0.1;
+ int causticEstimate = 100;
+ int numPasses = 0;     // progressive photon passes, 0 for a photon map
+ double progressiveAlpha = 0.7;
+ vector<hit_point_t> hitPoints; // where progressive passes gather
+ size_t hits3[2] = {0, 0}; // hit points of the last color3 and color4,
+ size_t hits4[2] = {0, 0}; // which antialiasing reuses
+ IrradianceCache irradianceCache;
+ photon_maps_t scenePhotonMaps;
+ photon_maps_t *photonMaps = NULL;
   
 //------------------------------------------------------------------
 // Read command line options, initialize
 //------------------------------------------------------------------
  int opt;
- while( (opt = getopt(argc, argv, "o:i:")) != -1)
+ static struct option longOptions[] = 
+ {
+  {"save-photons", required_argument, NULL, 's'},
+  {"load-photons", required_argument, NULL, 'l'},
+  {NULL, 0, NULL, 0}
+ };
+ while( (opt = getopt_long(argc, argv, "o:i:j:", longOptions, NULL)) != -1)
  {
   switch(opt)
   {
@@ -396,6 +882,19 @@ int main(int argc, char *argv[])
    case 'i': // set input scene file name
     inputFile = optarg;
     break;
+   case 'j': // set number of photon threads, 0 for one per cpu
+    numThreads = atoi(optarg);
+    if(numThreads <= 0)
+     numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(numThreads <= 0)
+     numThreads = 1;
+    break;
+   case 's': // save the photon maps after they are built
+    savePhotonsFile = optarg;
+    break;
+   case 'l': // use saved photon maps instead of emitting photons
+    loadPhotonsFile = optarg;
+    break;
    default:
     break;
    }
@@ -414,6 +913,21 @@ int main(int argc, char *argv[])
  maxDepth = sceneReader.getRecursionDepth();
  numPhotons = sceneReader.getNumPhotons();
  if( (numPhotons != 0) && (numPhotons < 2000) ) numPhotons = 2000;
+ cacheError = sceneReader.getIrradianceCacheError();
+ precomputeRatio = sceneReader.getPrecomputeRatio();
+ photonRadius = sceneReader.getPhotonRadius();
+ photonEstimate = sceneReader.getPhotonEstimate();
+ numCausticPhotons = (numPhotons != 0) ? sceneReader.getNumCausticPhotons() : 0;
+ causticRadius = sceneReader.getCausticRadius();
+ causticEstimate = sceneReader.getCausticEstimate();
+ numPasses = (numPhotons != 0) ? sceneReader.getProgressivePasses() : 0;
+ progressiveAlpha = sceneReader.getProgressiveAlpha();
+ if(numPasses > 0) // every photon is gathered at the hit points
+ {
+  numCausticPhotons = 0;
+  cacheError = 0;
+  precomputeRatio = 0;
+ }
 
  sceneReader.printSceneInfo();
  cout << "Image size      : " << imageWidth << " x " << imageHeight << endl;
@@ -423,7 +937,33 @@ int main(int argc, char *argv[])
  cout << "Antialias       : "; 
          (antiAlias)?(cout << "enabled"):(cout << "disabled");
  cout << endl;
- cout << "Photons         : " << numPhotons << " per light source" << endl;
+ cout << "Photons         : " << numPhotons << " per light source";
+ if(numPhotons != 0)
+  cout << ", estimates from " << photonEstimate << " within " << photonRadius;
+ cout << endl;
+ cout << "Caustic photons : ";
+ if(numCausticPhotons > 0)
+  cout << numCausticPhotons << " per light source, estimates from " 
+       << causticEstimate << " within " << causticRadius;
+ else
+  cout << "in the photon map";
+ cout << endl;
+ cout << "Irradiance cache: ";
+         (cacheError > 0 && numPhotons != 0)?(cout << "max error " << cacheError)
+                                            :(cout << "disabled");
+ cout << endl;
+ cout << "Precomputed irr.: ";
+         (precomputeRatio > 0 && numPhotons != 0)
+           ?(cout << "1 in " << precomputeRatio << " photons")
+           :(cout << "disabled");
+ cout << endl;
+ cout << "Progressive     : ";
+ if(numPasses > 0)
+  cout << numPasses << " passes, alpha " << progressiveAlpha;
+ else
+  cout << "disabled";
+ cout << endl;
+ cout << "Threads         : " << numThreads << endl;
  
 
 //------------------------------------------------------------------
@@ -466,13 +1006,74 @@ int main(int argc, char *argv[])
  outputImage = new Pixmap(imageWidth, imageHeight);
  pfactor = 100.0/(imageWidth * imageHeight);
  
- // Do photon mapping from lights
- if(numPhotons != 0)
+ // Progressive photon mapping: the eye pass below records hit points
+ // and the photons are emitted afterwards, a pass at a time
+ if(numPasses > 0)
  {
-  for(unsigned int i = 0; i < lightList.size(); i++)
+  photonMaps = &scenePhotonMaps;
+  photonMaps->cache = NULL;
+  photonMaps->hitPoints = &hitPoints;
+  photonMaps->global.setEstimateSize(photonRadius, photonEstimate);
+ }
+ 
+ // Do photon mapping from lights, into one map for all lights
+ else if(numPhotons != 0)
+ {
+  photonMaps = &scenePhotonMaps;
+  photonMaps->cache = NULL;
+  photonMaps->hitPoints = NULL;
+  if(loadPhotonsFile != NULL)
+  {
+   if(kiran_load_photons(loadPhotonsFile, photonMaps) != 0)
+    exit(-1);
+   cout << "Photon map file : " << loadPhotonsFile << endl;
+  }
+  else
+  {
+   photonMaps->global.init(numPhotons * lightList.size());
+   photonMaps->caustic.init(numCausticPhotons * lightList.size());
+   for(unsigned int i = 0; i < lightList.size(); i++)
+   {
+    kiran_photon_trace(lightList[i], photonMaps->global, numPhotons, 
+                       (numCausticPhotons > 0) ? KIRAN_STORE_GLOBAL 
+                                               : KIRAN_STORE_ALL, 2*i,
+                       objectList, 1e-6, camera->getFarClippingDistance(), 
+                       numThreads);
+    if(numCausticPhotons > 0)
+     kiran_photon_trace(lightList[i], photonMaps->caustic, numCausticPhotons,
+                        KIRAN_STORE_CAUSTIC, 2*i + 1, objectList, 1e-6, 
+                        camera->getFarClippingDistance(), numThreads);
+   }
+   photonMaps->global.balance(numThreads);
+   photonMaps->caustic.balance(numThreads);
+  }
+  photonMaps->global.setEstimateSize(photonRadius, photonEstimate);
+  photonMaps->caustic.setEstimateSize(causticRadius, causticEstimate);
+  
+  // keep loaded precomputed irradiance if there is as much as asked for
+  int numPrecomputed = (precomputeRatio > 0) ? 
+                       photonMaps->global.getNumPhotons()/precomputeRatio : 0;
+  if(numPrecomputed != photonMaps->global.getNumPrecomputed())
+   photonMaps->global.precomputeIrradiance(numPrecomputed, photonRadius, 
+                                           photonEstimate, numThreads);
+  cout << "Photon map      : " << photonMaps->global.getNumPhotons() 
+       << " photons stored" << endl;
+  if(photonMaps->caustic.getNumPhotons() > 0)
+   cout << "Caustic map     : " << photonMaps->caustic.getNumPhotons() 
+        << " photons stored" << endl;
+  if(savePhotonsFile != NULL)
+  {
+   if(kiran_save_photons(savePhotonsFile, photonMaps) != 0)
+    exit(-1);
+   cout << "Saved photons   : " << savePhotonsFile << endl;
+  }
+
+  if(cacheError > 0)
   {
-   kiran_photon_trace((lightList[i]), numPhotons, objectList, 
-                      1e-6, camera->getFarClippingDistance());
+   vector3d_t bboxMin, bboxMax;
+   photonMaps->global.getBoundingBox(bboxMin, bboxMax);
+   irradianceCache.init(cacheError, bboxMin, bboxMax);
+   photonMaps->cache = &irradianceCache;
   }
  }
  
@@ -484,9 +1085,10 @@ int main(int argc, char *argv[])
   {
    rayList = camera->getRays(u, v);
    color = sceneReader.getBackGroundColor(u,v);
+   kiran_set_sample(photonMaps, u, v, antiAlias ? 0.5 : 1);
    (*outputImage)(u, v) = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
 
    // Super-sampling for anti-aliasing
    if(antiAlias)
@@ -494,42 +1096,52 @@ int main(int argc, char *argv[])
     if(u == 1)
     {
      color1 = color2 = color3 = color4 = sceneReader.getBackGroundColor(u,v);
+     kiran_set_sample(photonMaps, u, v, 0.125);
 
      rayList = camera->getRays(u-0.5, v-0.5);
      color1 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color1, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
                   
      rayList = camera->getRays(u-0.5, v+0.5);
      color2 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color2, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
 
+     hits3[0] = hitPoints.size();
      rayList = camera->getRays(u+0.5, v+0.5);
      color3 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color3, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
 
+     hits4[0] = hits3[1] = hitPoints.size();
      rayList = camera->getRays(u+0.5, v-0.5);
      color4 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color4, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
+     hits4[1] = hitPoints.size();
     }
     else
     {
      color1 = color4;
      color2 = color3;
      color3 = color4 = sceneReader.getBackGroundColor(u,v);
+     kiran_copy_hit_points(hitPoints, hits4[0], hits4[1], u, v);
+     kiran_copy_hit_points(hitPoints, hits3[0], hits3[1], u, v);
+     kiran_set_sample(photonMaps, u, v, 0.125);
 
+     hits3[0] = hitPoints.size();
      rayList = camera->getRays(u+0.5, v+0.5);
      color3 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color3, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
 
+     hits4[0] = hits3[1] = hitPoints.size();
      rayList = camera->getRays(u+0.5, v-0.5);
      color4 = kiran_trace(rayList, lightList, (Light *)(aLight),
                   objectList, color4, 1e-6, camera->getFarClippingDistance(), 
-                  maxDepth, 0, numShadowRays);
+                  maxDepth, 0, numShadowRays, photonMaps);
+     hits4[1] = hitPoints.size();
     }
     (*outputImage)(u, v) = 0.5 * (*outputImage)(u, v) + 0.125 * color1 + 
                            0.125 * color2 + 0.125 * color3 + 0.125 * color4; 
@@ -539,6 +1151,29 @@ int main(int argc, char *argv[])
   }
  }
  cout << endl << flush;
+ if(photonMaps != NULL && photonMaps->cache != NULL)
+  cout << "Cached records  : " << irradianceCache.getNumRecords() << endl;
+
+ // Progressive passes. Only the photons of one pass are in memory at 
+ // a time, and the image is written after each pass
+ if(numPasses > 0)
+ {
+  Pixmap *directImage = outputImage;
+  outputImage = new Pixmap(imageWidth, imageHeight);
+  cout << "Hit points      : " << hitPoints.size() << endl;
+  for(int pass = 0; pass < numPasses; pass++)
+  {
+   kiran_progressive_pass(hitPoints, photonMaps->global, lightList, 
+                          numPhotons, pass, progressiveAlpha, objectList, 
+                          1e-6, camera->getFarClippingDistance(), numThreads);
+   kiran_progressive_image(*directImage, hitPoints, pass + 1, *outputImage);
+   outputImage->write(outputFile, P6);
+   cout << "\rPhoton passes   : " << pass + 1 << " of " << numPasses 
+        << flush;
+  }
+  cout << endl;
+  delete directImage;
+ }
 //------------------------------------------------------------------
 // write output, clean up and exit
 //------------------------------------------------------------------
@@ -10,7 +10,6 @@
 
 #include "data_types.hpp"
 #include "Pixmap.hpp"
-#include "PhotonMap.hpp"
 
 //==================================================================
 // class Light  A pure virtual base class for all lights.
@@ -56,9 +55,6 @@ class Light
    // intercept point on an object.
    //  return  RGB light intensity in the range [0-255].
 
-  PhotonMap d_photonMap;
-   // The photon map
-
  protected:
   vector3d_t d_pos;
   string d_name; // name for the source